@@ -12,7 +12,7 @@ using namespace std;
 using namespace argparse;
 
 string sh =
-  "Creates or modifies shapes in OFF format.\n"
+  "Creates or modifies shapes in OFF, PLY or STL format.\n"
   "Outputs it on standard output in OFF format.";
 string eh =
   "Operations (except global options) are executed in the order of the command line.\n"
@@ -24,8 +24,10 @@ string ex =
   "MakeShape -l shape1.off -l shape2.off   Combines the two given shape into one.\n"
   "MakeShape -l shape.off -i               Gives information on shape.off";
 string q_help = "represses all warnings and error messages";
-string l_help = "adds file FILE in OFF format to the current shape";
-string o_help = "save current shape in OFF format to file FILE";
+string l_help = "adds file FILE in OFF, PLY or binary STL format to the current shape";
+string o_help = "save current shape to file FILE, in binary PLY or STL format if its name ends with .ply or .stl,\n"
+                "only its vertices as a cloud of points in XYZ or XYZB format if it ends with .xyz or .xyzb,\n"
+                "in OFF format otherwise";
 string c_help = "centers the shape around the center of mass";
 string r_help = "rescales the shape to set its outer radius to R";
 string s_help = "multiplies the number of facets by four N times,\n"
@@ -37,6 +39,7 @@ string a_help =
 string e_help =
   "applies a diagonal matrix (i.e. expands along the axis): -e \"fx fy fz\"";
 string d_help = "number of significant digits printed in the output (default is 6)";
+string m_help = "merges connected coplanar facets (within tolerance TOL) into larger ones";
 string i_help = "shows informations about the shape and stops";
 string cub_help = "adds a cube with 12 facets";
 string ico_help = "adds a regular icosahedron with 20 facets";
@@ -93,6 +96,7 @@ int main (int argc, char *argv[])
   p.rec_list_option("e", "expand", "FACTORS", vec_dat, rec, e_help);
   p.rec_list_option("t", "", "VEC", vec_dat, rec, t_help);
   p.rec_list_option("a", "", "VEC_ANGLE", wvec_dat, rec, a_help);
+  p.rec_list_option("", "merge", "TOL", double_dat, rec, m_help);
 
   p.group("Miscellaneous");
   p.rec_flag("i", "", rec, i_help);
@@ -123,10 +127,12 @@ int main (int argc, char *argv[])
       m.add(m0);
     }
     else if (n == "o") {
-      smart_output out(string_dat[opt.pos]);
+      const mesh_format f = mesh_format_of(string_dat[opt.pos]);
+      smart_output out(string_dat[opt.pos], f != mesh_format::off && f != mesh_format::xyz);
       if (!out)
         p.die(bad_output_msg + n + " (" + strerror(errno) + ")");
-      out << setprecision(digit) << m;
+      out << setprecision(digit);
+      write_mesh(*out.output, m, f);
     }
     else if (n == "sphere") {
       project = (m.empty()) ? -1 : -2;
@@ -171,6 +177,8 @@ int main (int argc, char *argv[])
               wvec_dat[opt.pos].weight * 3.141592653589793238 / 180));
     else if (n == "t")
       m += vec_dat[opt.pos];
+    else if (n == "merge")
+      m = m.merge_coplanar(double_dat[opt.pos]);
     
     if (n == "memorize")
       memo[string_dat[opt.pos]] = m;
@@ -7,6 +7,9 @@
 #include "arg_parse.hpp"
 #include "parallel.hpp"
 #include "moments.hpp"
+#include "align.hpp"
+#include "moment_cache.hpp"
+#include "zm_store.hpp"
 
 using namespace std;
 using namespace argparse;
@@ -16,14 +19,22 @@ const int N_exact = triquad_schemes.max_order();
 const string n_exact = to_string(N_exact);
 
 string sh =
-  "Computes Zernike moments, input should be in OFF format.";
+  "Computes Zernike moments, input should be in OFF, PLY or STL format (or REV for solids of revolution,\n"
+  "XYZ, XYZW or XYZB for clouds of points).";
 string eh = "Currently works up to N = " + n_exact
             + " for the exact computation of the moments.\n"
-            "No limit for N when using -a.\n"
+            "No limit for N when using -a or for REV and XYZ files.\n"
+            "A REV file describes a solid of revolution around the z axis: a line with REV, a line with\n"
+            "the number of vertices of its profile, then the r and z coordinates of each vertex.\n"
+            "An XYZ file gives a cloud of points: a line with XYZ, a line with the number of points, then the\n"
+            "x, y and z coordinates of each point. XYZW files have the weight of each point after its coordinates,\n"
+            "XYZB is their binary form. The moments of a cloud are the sums of the weighted Zernike polynomials\n"
+            "over its points, they are computed by batches so that clouds of any size can be read.\n"
             "The shape must fit into the unit ball (no implicit centering or rescaling, use MakeShape to do this).";
 string ex = "Shape2Zernike 50 shape.off                     Computes the Zernike moments of shape.off up to order 50\n"
             "Shape2Zernike -a 8 -o result.zm 50 shape.off   Same using approximate algorithm with 8 digit precision and results written to file\n"
-            "Shape2Zernike -vt 4 50 shape.off               Same running on four threads, with progression bar";
+            "Shape2Zernike -vt 4 50 shape.off               Same running on four threads, with progression bar\n"
+            "Shape2Zernike --time-budget 60 50 shape.off    Best approximation obtained in one minute";
 string v_help = "outputs more informations, including progression bars";
 string q_help = "represses all warnings and error messages";
 string o_help = "save output to the given file instead of standard output";
@@ -33,18 +44,71 @@ string n_help = "multiplies the moments by sqrt(3/4pi)";
 string a_help = "computes the moments using approximate methods to get the required correct DIGITS";
 string r_help = "the Zernike moments are output in real form instead of complex";
 string p_help = "multiplies the moments by the phase factor (-1)^m";
-string diff_help = "reads Zernike moments in ZM format and substract them from the computed moments";
+string diff_help = "reads Zernike moments in ZM or ZMB format and substract them from the computed moments";
+string deterministic_help = "sums the moments of the facets exactly, so that the result does not depend on the number of threads";
+string cache_help = "keeps the moments of each connected component of the mesh in directory DIR and reuses them";
+string engine_help = "engine used for exact computations: auto, quad (quadratures) or geom (geometric moments)";
 string d_help = "number of significant digits printed in the output (default is 8)";
-
-string FILE_help = "reads FILE in OFF or ZM format (default is standard input)";
+string mc_help = "estimates the moments by quasi-Monte Carlo sampling until their standard error is below 10^-DIGITS";
+string rotate_help = "rotates the moments with the given angle in degrees and axis: --rotate \"x y z angle\"";
+string align_help = "reads Zernike moments in ZM or ZMB format and rotates the computed moments to best match them";
+string scale_help = "shrinks the shape around the origin by the factor S (between 0 and 1) without recomputing the moments";
+string symmetry_help = "integrates one facet by orbit of the symmetry GROUP of the shape: auto (detected) or generators "
+                       "separated by commas among mx, my, mz (mirrors orthogonal to the axes), i (inversion), "
+                       "cNx, cNy, cNz (rotations by 360/N degrees around the axes)";
+string labels_help = "reads one integer label by facet from FILE and also writes the moments of the facets "
+                     "of each label to files named after the output (result.zm gives result.LABEL.zm)";
+string merge_help = "merges connected coplanar facets (within tolerance TOL) before computing the moments";
+string budget_help = "stops refining the approximate moments after SECONDS and outputs the best result reached (implies -a)";
+string snapshot_help = "regularly writes the current approximate moments to FILE while refining (needs --time-budget)";
+string checkpoint_help = "saves the state of the approximate computation to FILE every minute and at the end (needs -a or --time-budget)";
+string binary_help = "writes the moments in the binary ZMB format, exact and faster to read, instead of text";
+string stream_help = "reads the facets by batches and integrates each batch as soon as it is read, "
+                     "keeping only the vertices of the mesh in memory";
+string store_help = "appends the moments to the store STORE (see ZernikeStore), which is created if needed";
+string id_help = "the ID of the shape in the store (default is the name of FILE without directory nor extension)";
+string resume_help = "starts from the state saved in the checkpoint FILE if it matches the shape and order (needs --checkpoint)";
+
+string FILE_help = "reads FILE in OFF, PLY, binary STL, REV, ZM or ZMB format (default is standard input)";
 string N_help = "the maximum order of Zernike moments computed";
 string die_N_msg ="N must be positive and no more than "
                        + n_exact + " for exact computation of the moments";
 string radius_warning =
   "Warning: shape radius is larger than one. Risks of imprecisions.";
 string approx_warning = "Warning; requested precision is very small, program may not halt. Allowed error by facet: ";
-string die_unknown_format = "Unknown file format (should be OFF or ZM): ";
+string die_unknown_format = "Unknown file format (should be OFF, PLY, STL, REV, XYZ, XYZW, XYZB, ZM or ZMB): ";
+string bad_profile_msg = "The profile must lie in the half plane r >= 0";
 string bad_output_msg = "Cannot open output file: ";
+string bad_engine_msg = "Unknown engine (should be auto, quad or geom): ";
+string bad_budget_msg = "The time budget must be positive";
+string bad_mc_msg = "The number of digits of --monte-carlo is too large";
+string cache_failed_msg = "Cannot write moments to cache directory: ";
+string bad_scale_msg = "The scaling factor must be between 0 and 1";
+string not_symmetric_msg = "Warning: the shape is not invariant by the symmetry group, all facets are integrated";
+string labels_output_msg = "Option --labels needs option -o";
+string labels_input_msg = "Option --labels needs a mesh file (OFF, PLY or STL)";
+string bad_labels_msg = "Bad label in file: ";
+string labels_count_msg = "The number of labels differs from the number of facets: ";
+string snapshot_alone_msg = "Option --snapshot needs option --time-budget";
+string checkpoint_alone_msg = "Option --checkpoint needs option -a or --time-budget";
+string resume_alone_msg = "Option --resume needs option --checkpoint";
+string id_alone_msg = "Option --id needs option --store";
+string checkpoint_failed_msg = "Cannot write checkpoint file: ";
+string checkpoint_rejected_msg = "Warning: the checkpoint file does not match the computation, starting from scratch: ";
+
+/** The name of the file receiving the moments of a label.
+  @param output The name of the main output, like result.zm.
+  @param label The label.
+  @return The name, like result.LABEL.zm.
+*/
+string label_filename(const string &output, long label)
+{
+  const size_t dot = output.rfind('.');
+  const size_t slash = output.rfind('/');
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+    return output + "." + to_string(label);
+  return output.substr(0, dot) + "." + to_string(label) + output.substr(dot);
+}
 
 int main (int argc, char *argv[])
 {
@@ -54,11 +118,25 @@ int main (int argc, char *argv[])
   int N = 0;
   int digit = 8;
   int approx = 13;
+  int mc = 3;
+  double merge_tol = 1e-9;
+  w_vec rotation;
+  double scale = 1;
   int nt = 1;
 
   string filename = "-";
   string output = "-";
   string zm_filename;
+  string snapshot_filename;
+  string checkpoint_filename;
+  string align_filename;
+  string cache_dir;
+  string symmetry;
+  string labels_filename;
+  string store_filename;
+  string store_id;
+  string engine_name = "auto";
+  double budget = 0;
 
 
   // Set command line options 
@@ -72,12 +150,30 @@ int main (int argc, char *argv[])
   p.option("t", "threads", "THREAD", nt, t_help);
   p.option("a", "approximate", "DIGITS", approx, a_help);
   p.option("d", "digits", "DIGITS", digit, d_help);
+  p.option("", "merge", "TOL", merge_tol, merge_help);
+  p.option("", "rotate", "VEC_ANGLE", rotation, rotate_help);
+  p.option("", "align", "ZMFILE", align_filename, align_help);
+  p.option("", "scale", "S", scale, scale_help);
+  p.option("", "monte-carlo", "DIGITS", mc, mc_help);
+  p.option("", "time-budget", "SECONDS", budget, budget_help);
+  p.option("", "snapshot", "FILE", snapshot_filename, snapshot_help);
+  p.option("", "checkpoint", "FILE", checkpoint_filename, checkpoint_help);
+  p.flag("", "resume", resume_help);
+  p.flag("", "deterministic", deterministic_help);
+  p.option("", "cache", "DIR", cache_dir, cache_help);
+  p.option("", "symmetry", "GROUP", symmetry, symmetry_help);
+  p.option("", "labels", "FILE", labels_filename, labels_help);
+  p.flag("", "binary", binary_help);
+  p.flag("", "stream", stream_help);
+  p.option("", "store", "STORE", store_filename, store_help);
+  p.option("", "id", "ID", store_id, id_help);
 
   p.hidden(true);
   p.flag("r", "real", r_help);
   p.flag("n", "normalize", n_help);
   p.flag("p", "phase", p_help);
   p.option("", "diff", "ZMFILE", zm_filename, diff_help);
+  p.option("", "engine", "ENGINE", engine_name, engine_help);
   p.flag("", "tests", tests_help);
 
   p.arg("N", N, N_help);
@@ -85,25 +181,81 @@ int main (int argc, char *argv[])
 
   p.quiet("q");
   p.exclusion({"v", "q"});
+  p.exclusion({"a", "monte-carlo"});
+  p.exclusion({"time-budget", "monte-carlo"});
+  p.exclusion({"deterministic", "a"});
+  p.exclusion({"deterministic", "time-budget"});
+  p.exclusion({"deterministic", "monte-carlo"});
+  p.exclusion({"cache", "time-budget"});
+  p.exclusion({"cache", "checkpoint"});
+  p.exclusion({"symmetry", "a"});
+  p.exclusion({"symmetry", "time-budget"});
+  p.exclusion({"symmetry", "monte-carlo"});
+  p.exclusion({"symmetry", "cache"});
+  p.exclusion({"labels", "a"});
+  p.exclusion({"labels", "time-budget"});
+  p.exclusion({"labels", "monte-carlo"});
+  p.exclusion({"labels", "deterministic"});
+  p.exclusion({"labels", "cache"});
+  p.exclusion({"labels", "symmetry"});
+  p.exclusion({"labels", "merge"});
+  p.exclusion({"stream", "a"});
+  p.exclusion({"stream", "time-budget"});
+  p.exclusion({"stream", "monte-carlo"});
+  p.exclusion({"stream", "deterministic"});
+  p.exclusion({"stream", "cache"});
+  p.exclusion({"stream", "symmetry"});
+  p.exclusion({"stream", "labels"});
+  p.exclusion({"stream", "merge"});
 
   // Parse command line
 
   p.run(argc, argv);
 
-  smart_output out(output);
+  smart_output out(output, p("binary"));
   if (!out)
     p.die(bad_output_msg + output + " (" + strerror(errno) + ")");
 
-  // Apply options -a and -d
-
+  // Apply options -a, -d, --time-budget and --monte-carlo
+
+  const bool approximate = p("a") || p("time-budget");
+  if (p("time-budget") && budget <= 0)
+    p.die(bad_budget_msg);
+  if (p("monte-carlo") && pow(0.1, mc) * pow(0.1, mc) == 0)
+    p.die(bad_mc_msg);
+  if (p("snapshot") && !p("time-budget"))
+    p.die(snapshot_alone_msg);
+  if (p("checkpoint") && !approximate)
+    p.die(checkpoint_alone_msg);
+  if (p("resume") && !p("checkpoint"))
+    p.die(resume_alone_msg);
+  if (p("scale") && (scale <= 0 || scale > 1))
+    p.die(bad_scale_msg);
+  if (p("id") && !p("store"))
+    p.die(id_alone_msg);
+  if (p("labels") && output == "-")
+    p.die(labels_output_msg);
   const double approx_err = pow(0.1, approx);
-  if (p("a") && !p("d"))
+  if (approximate && !p("d"))
     digit = approx + 1;
+  if (p("monte-carlo") && !p("d"))
+    digit = mc + 1;
   if (digit <= 0)
     digit = 1;
   out << setprecision(digit);
 
 
+  // Option --engine
+
+  mesh_engine engine = mesh_engine::automatic;
+  if (engine_name == "quad")
+    engine = mesh_engine::quadrature;
+  else if (engine_name == "geom")
+    engine = mesh_engine::geometric;
+  else if (engine_name != "auto")
+    p.die(bad_engine_msg + engine_name);
+
+
   // Option --tests auto tests and exits
 
   if (p("tests")) {
@@ -146,6 +298,7 @@ int main (int argc, char *argv[])
   smart_input is(filename);
   if (!is)
     p.die(cannot_open_msg + is.name + " (" + strerror(errno) + ")");
+  is.threads = nt;
   
 
   // Write ouput header
@@ -157,26 +310,49 @@ int main (int argc, char *argv[])
   // Identify type of input file
   
   zernike zm;
+  vector<pair<long, zernike>> parts; // the moments of each label, with option --labels
 
   istringstream iss;
   is.peek_line(iss);
   string filetype;
   iss >> filetype;
+  const bool mesh_file = filetype == "OFF" || filetype == "off" || is_ply_or_stl(is);
+  if (p("labels") && !mesh_file)
+    p.die(labels_input_msg);
 
-  // it is a ZM file, read it
-  if (filetype == "ZM" || filetype == "zm") {
+  // it is a ZM or ZMB file, read it
+  if (!mesh_file && (filetype == "ZM" || filetype == "zm" || filetype == "ZMB")) {
     zernike zm2;
     string err = read_object(is, zm2, p("v"));
     if (!err.empty())
       p.die(err);
     zm = zernike(N, zm2);
   }
-  // it is an OFF file, compute moments
-  else if (filetype == "OFF" || filetype == "off") {
+  // it is a mesh (OFF, PLY or STL file) read by batches of facets, compute moments
+  else if (mesh_file && p("stream")) {
+    if (N > N_exact)
+      p.die(die_N_msg);
+    facet_stream fs(is);
+    if (!is)
+      p.die(input_error(is));
+    const double rad = fs.m.radius();
+    if (rad > 1.001)
+      p.warn(radius_warning);
+    zm = mesh_stream_integrate(fs, N, triquad_schemes, nt, p("v"), engine);
+    const string err = input_error(is);
+    if (!err.empty())
+      p.die(err);
+    out << "# Mesh: " << fs.m.points.size() << " vertices, "
+        << fs.given << " facets, "
+        << "radius: " << rad << "\n";
+    out << "# error estimate: " << zm.get_error() << "\n";
+  }
+  // it is a mesh (OFF, PLY or STL file), compute moments
+  else if (mesh_file) {
     // check max bound on N
-    if ((!p("a") && N > N_exact))
+    if ((!approximate && !p("monte-carlo") && N > N_exact))
       p.die(die_N_msg);
-    // read OFF file
+    // read mesh file
     mesh m;
     string err = read_object(is, m, p("v"));
     if (!err.empty())
@@ -188,32 +364,248 @@ int main (int argc, char *argv[])
         << "radius: " << rad << "\n";
     if (rad > 1.001)
       p.warn(radius_warning);
+    if (p("merge")) {
+      const size_t before = m.triangles.size();
+      m = m.merge_coplanar(merge_tol);
+      out << "# Merged coplanar facets: " << before - m.triangles.size() << " facets removed\n";
+    }
 
     // compute moments
-    if (p("a")) {
+    if (p("cache")) {
+      string mode = "exact-" + engine_name;
+      if (approximate)
+        mode = "approx-" + to_string(approx);
+      else if (p("monte-carlo"))
+        mode = "qmc-" + to_string(mc);
+      else if (p("deterministic"))
+        mode = "deterministic-" + engine_name;
+      cache_report rep;
+      zm = moment_cache(cache_dir, triquad_schemes).integrate(m, N, mode, [&](const mesh &c) {
+          if (approximate)
+            return mesh_approx_integrate(c, N, approx_err, triquad_schemes, nt, p("v"));
+          if (p("monte-carlo"))
+            return mesh_qmc_integrate(c, N, pow(0.1, mc), nt, p("v"));
+          if (p("deterministic"))
+            return incremental_moments(c, N, triquad_schemes, nt, p("v"), engine).result();
+          return mesh_exact_integrate(c, N, triquad_schemes, nt, p("v"), engine);
+        }, &rep);
+      if (rep.failed)
+        p.warn(cache_failed_msg + cache_dir);
+      out << "# cache: " << rep.hits << " of " << rep.components << " components found\n";
+      out << "# error estimate: " << zm.get_error() << "\n";
+    }
+    else if (approximate) {
       const double facet_error = approx_err / sqrt(m.triangles.size());
-      if (facet_error < 1e-13) {
+      if (facet_error < 1e-13 && !p("time-budget")) {
         ostringstream out;
         out << scientific << facet_error;
         p.warn(approx_warning + out.str());
       }
-      zm = mesh_approx_integrate(m, N, approx_err, triquad_schemes, nt, p("v"));
+      approx_report rep;
+      approx_checkpoint ckpt(checkpoint_filename, p("resume"));
+      approx_checkpoint *cp = (p("checkpoint")) ? &ckpt : NULL;
+      if (p("time-budget")) {
+        // snapshots are written at most once a second, through a temporary file
+        double last = -1;
+        auto snapshot = [&](const zernike &z) {
+          if (snapshot_filename.empty() || (last >= 0 && timer.seconds() < last + 1))
+            return;
+          last = timer.seconds();
+          const string tmp = snapshot_filename + ".tmp";
+          {
+            smart_output snap(tmp);
+            if (!snap) {
+              p.warn(bad_output_msg + tmp + " (" + strerror(errno) + ")");
+              return;
+            }
+            zernike zs = z;
+            zs.normalize(make_norm(false, false, p("n")));
+            zs.output = make_output(!p("r"), p("p"));
+            snap << setprecision(digit);
+            snap << "# Snapshot by " << p.prog_name << " (" << p.version_text << ") from file: " << is.name << "\n";
+            snap << "# Date: " << now() << "\n";
+            snap << "# approximation error estimate: " << z.get_error() << "\n";
+            snap << zs;
+          }
+          if (rename(tmp.c_str(), snapshot_filename.c_str()) != 0)
+            p.warn(bad_output_msg + snapshot_filename + " (" + strerror(errno) + ")");
+        };
+        const double target = (p("a")) ? approx_err : 0;
+        zm = mesh_anytime_integrate(m, N, budget, target, triquad_schemes, snapshot, nt, p("v"), &rep, cp);
+      }
+      else
+        zm = mesh_approx_integrate(m, N, approx_err, triquad_schemes, nt, p("v"), &rep, cp);
+      if (ckpt.rejected)
+        p.warn(checkpoint_rejected_msg + checkpoint_filename);
+      if (ckpt.failed)
+        p.warn(checkpoint_failed_msg + checkpoint_filename);
+      if (ckpt.resumed)
+        out << "# Resumed from checkpoint " << checkpoint_filename << ": " << ckpt.resumed << " of "
+            << m.triangles.size() << " facets already integrated\n";
       out << "# approximation error estimate: " << zm.get_error() << "\n";
+      out << "# facet refinements: " << rep.refinements << "\n";
+      for (auto &f: rep.facets)
+        out << "#   order " << f.first << ": " << f.second << " facets, error estimate "
+            << sqrt(rep.variance[f.first]) << "\n";
+    }
+    else if (p("monte-carlo")) {
+      size_t points;
+      zm = mesh_qmc_integrate(m, N, pow(0.1, mc), nt, p("v"), &points);
+      out << "# Monte Carlo standard error: " << zm.get_error() << "\n";
+      out << "# sample points: " << points << "\n";
+    }
+    else if (p("labels")) {
+      smart_input ls(labels_filename);
+      if (!ls)
+        p.die(cannot_open_msg + ls.name + " (" + strerror(errno) + ")");
+      vector<long> labels;
+      istringstream s;
+      long l;
+      while (ls.next_line(s)) {
+        while (s >> l)
+          labels.push_back(l);
+        if (!s.eof())
+          p.die(bad_labels_msg + ls.name);
+      }
+      if (labels.size() != m.triangles.size())
+        p.die(labels_count_msg + to_string(labels.size()) + " labels, "
+              + to_string(m.triangles.size()) + " facets");
+      // labels are numbered from 0 in increasing order
+      map<long, size_t> index, count;
+      for (auto l: labels)
+        count[l]++;
+      for (auto &c: count)
+        index.insert({c.first, index.size()});
+      vector<size_t> dense(labels.size());
+      for (size_t i = 0 ; i < labels.size() ; i++)
+        dense[i] = index[labels[i]];
+      vector<zernike> res = mesh_labeled_integrate(m, dense, index.size(), N, triquad_schemes, nt, p("v"));
+      zm = zernike(N);
+      for (auto &i: index) {
+        zm += res[i.second];
+        parts.push_back({i.first, res[i.second]});
+        out << "# Label " << i.first << ": " << count[i.first] << " facets, moments written to "
+            << label_filename(output, i.first) << "\n";
+      }
+      out << "# error estimate: " << zm.get_error() << "\n";
+    }
+    else if (p("symmetry")) {
+      symmetry_group g;
+      if (symmetry == "auto")
+        g = m.symmetries();
+      else {
+        string err = g.add_generators(symmetry);
+        if (!err.empty())
+          p.die(err);
+      }
+      symmetry_report rep;
+      zm = mesh_symmetric_integrate(m, g, [&](const mesh &c) {
+          if (p("deterministic"))
+            return incremental_moments(c, N, triquad_schemes, nt, p("v"), engine).result();
+          return mesh_exact_integrate(c, N, triquad_schemes, nt, p("v"), engine);
+        }, &rep);
+      if (!rep.invariant)
+        p.warn(not_symmetric_msg);
+      out << "# Symmetry group: " << g.size() << " elements, " << rep.integrated << " of "
+          << m.triangles.size() << " facets integrated\n";
+      out << "# error estimate: " << zm.get_error() << "\n";
+    }
+    else if (p("deterministic")) {
+      zm = incremental_moments(m, N, triquad_schemes, nt, p("v"), engine).result();
+      out << "# error estimate: " << zm.get_error() << "\n";
     }
     else {
-      zm = mesh_exact_integrate(m, N, triquad_schemes, nt, p("v"));
+      zm = mesh_exact_integrate(m, N, triquad_schemes, nt, p("v"), engine);
       out << "# error estimate: " << zm.get_error() << "\n";
     }
   }
+  // it is a cloud of points (XYZ, XYZW or XYZB file), compute moments by batches
+  else if (filetype == "XYZ" || filetype == "xyz" || filetype == "XYZW" || filetype == "xyzw"
+           || filetype == "XYZB") {
+    point_stream ps(is);
+    if (!is)
+      p.die(input_error(is));
+    zm = cloud_stream_integrate(ps, N, nt, p("v"));
+    const string err = input_error(is);
+    if (!err.empty())
+      p.die(err);
+    out << "# Cloud: " << ps.given << " points, "
+        << "weight: " << ps.weight << ", "
+        << "radius: " << ps.radius << "\n";
+    if (ps.radius > 1.001)
+      p.warn(radius_warning);
+    out << "# error estimate: " << zm.get_error() << "\n";
+  }
+  // it is a REV file, compute moments of the solid of revolution
+  else if (filetype == "REV" || filetype == "rev") {
+    profile pr;
+    string err = read_object(is, pr, p("v"));
+    if (!err.empty())
+      p.die(err);
+    for (auto &pt: pr.points)
+      if (pt.x < 0)
+        p.die(bad_profile_msg);
+    double rad = pr.radius();
+    out << "# Profile: " << pr.points.size() << " vertices, "
+        << "volume: " << fabs(pr.volume()) << ", "
+        << "radius: " << rad << "\n";
+    if (rad > 1.001)
+      p.warn(radius_warning);
+    zm = profile_integrate(pr, N, nt, p("v"));
+    out << "# error estimate: " << zm.get_error() << "\n";
+  }
   // unknown file type
   else
     p.die(die_unknown_format + is.name);
   
 
+  // Option --rotate rotates the moments
+
+  if (p("rotate")) {
+    out << "# Rotated around axis " << rotation.v << " by " << rotation.weight << " degrees\n";
+    const mat r = rotation_mat(rotation.v.normalize(), rotation.weight * 3.141592653589793238 / 180);
+    zm.rotate(r);
+    for (auto &l: parts)
+      l.second.rotate(r);
+  }
+
+
+  // Option --align rotates the moments onto the ones read from a file
+
+  if (p("align")) {
+    zernike ref;
+    string err = read_file(align_filename, ref, p("v"));
+    if (!err.empty())
+      p.die(err);
+    const alignment a = zernike_aligner(zm).align(ref);
+    const w_vec axis = rotation_axis(a.rotation);
+    out << "# Aligned on file " << align_filename << ": rotated around axis " << axis.v
+        << " by " << axis.weight * 180 / 3.141592653589793238 << " degrees\n";
+    out << "# Alignment correlation: " << a.correlation << ", residual: " << a.residual << "\n";
+    zm.rotate(a.rotation);
+    for (auto &l: parts)
+      l.second.rotate(a.rotation);
+  }
+
+
+  // Option --scale shrinks the shape
+
+  if (p("scale")) {
+    out << "# Scaled by " << scale << "\n";
+    zm.scale(scale);
+    for (auto &l: parts)
+      l.second.scale(scale);
+  }
+
+
   // Select normalization and apply output options -r -p and -n
 
   zm.normalize(make_norm(false, false, p("n")));
   zm.output = make_output(!p("r"), p("p"));
+  for (auto &l: parts) {
+    l.second.normalize(make_norm(false, false, p("n")));
+    l.second.output = zm.output;
+  }
 
   // option -d read a secondary zm file
 
@@ -228,9 +620,41 @@ int main (int argc, char *argv[])
   }
 
 
+  // option --store appends the result to a store
+
+  if (p("store")) {
+    const string shape = p("id") ? store_id : shape_id(filename);
+    string err = zm_store::append(store_filename, shape, zm);
+    if (!err.empty())
+      p.die(err);
+    out << "# Appended to store " << store_filename << " as " << shape << "\n";
+  }
+
+
   // write result
 
-  out << zm;
+  if (p("binary"))
+    write_binary(*out.output, zm);
+  else
+    out << zm;
+
+  // option --labels writes the moments of each label
+
+  for (auto &l: parts) {
+    const string name = label_filename(output, l.first);
+    smart_output lout(name, p("binary"));
+    if (!lout)
+      p.die(bad_output_msg + name + " (" + strerror(errno) + ")");
+    lout << setprecision(digit);
+    lout << "# Produced by " << p.prog_name << " (" << p.version_text << ") from file: " << is.name
+         << ", label " << l.first << "\n";
+    lout << "# Date: " << now() << "\n";
+    lout << "# error estimate: " << l.second.get_error() << "\n";
+    if (p("binary"))
+      write_binary(*lout.output, l.second);
+    else
+      lout << l.second;
+  }
 
   // ciao !
 
@@ -17,20 +17,21 @@ using namespace argparse;
 
 string sh =
   "Computes a shape from Zernike moments.\n"
-  "Input should be in ZM format as produced by Shape2Zernike.\n"
+  "Input should be in ZM or binary ZMB format as produced by Shape2Zernike.\n"
   "Output is in OFF format.";
 string ex = "Zernike2Shape 50 100 mom.zm                     Builds an OFF shape from the given moments up to order 50 on a 100^3 lattice\n"
             "Zernike2Shape -vt4 -o shape.off 50 100 mom.zm   Same running on 4 threads with progression bar and output saved to file";
 string eh = "";
 string v_help = "Outputs additional informations including progression bars";
 string q_help = "represses all warnings and error messages";
-string o_help = "Save output to the given file instead of standard output";
+string o_help = "Save output to the given file instead of standard output,\n"
+                "in binary PLY or STL format if its name ends with .ply or .stl";
 string t_help = "number of threads to use in parallel, use 0 to adapt to the machine";
 string d_help = "Number of significant digits printed in the output (default is 6)";
 string thresh_help = "Threshold value which separates the inside from the outside (default is 1/2)";
 string N_help = "The maximum order of Zernike moments to use (if available)";
 string RES_help = "Resolution of the mesh (i.e. number of intervals between -1 and 1)";
-string FILE_help = "Reads FILE in ZM format (default is standard input)";
+string FILE_help = "Reads FILE in ZM or ZMB format (default is standard input)";
 string die_N_msg = "N must be positive.";
 string warn_N_msg = "N larger than maximum moment available. Adapting.";
 string bad_output_msg = "Cannot open output file: ";
@@ -66,7 +67,8 @@ int main (int argc, char *argv[])
   if (N < 0)
     p.die(die_N_msg);
 
-  smart_output out(output);
+  const mesh_format format = mesh_format_of(output);
+  smart_output out(output, format != mesh_format::off);
   if (!out)
     p.die(bad_output_msg + output + " (" + strerror(errno) + ")");
 
@@ -103,9 +105,8 @@ int main (int argc, char *argv[])
 
   mesh m = marching_tetrahedra({-1, 1, res}, {-1, 1, res}, {-1, 1, res}, zm, thresh, true, nt, p("v"));
 
-  out << "# Produced by " << p.prog_name << " (" << p.version_text << ") from file: " << filename << "\n";
-  out << "# Date: " << now() << "\n";
-  out << m;
+  write_mesh(*out.output, m, format, {"Produced by " + p.prog_name + " (" + p.version_text + ") from file: " + filename,
+                                      "Date: " + now()}, nt);
 
   if (p("v"))
     cerr << p.prog_name << " used " << (int) (timer.seconds() * 100) / 100. << " seconds to run.\n"; 
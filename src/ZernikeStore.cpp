@@ -0,0 +1,236 @@
+/** \file ZernikeStore.cpp
+  A standalone program to keep the Zernike moments of many shapes in a single file.
+
+  It appends moments from ZM or ZMB files to a store (see zm_store),
+  lists the shapes of a store and extracts the moments of a shape.
+  It also searches the store for the shapes closest to a given one, see zm_codes.
+  \author J. Houdayer
+*/
+
+#include "version.hpp"
+#include "arg_parse.hpp"
+#include "parallel.hpp"
+#include "zm_codes.hpp"
+
+using namespace std;
+using namespace argparse;
+
+string sh =
+  "Keeps the Zernike moments of many shapes in a single store file.\n"
+  "Appends the moments of each FILE (in ZM or ZMB format) to STORE, which is created if needed.";
+string eh = "A store holds moments of the same order and normalization, one record by shape.\n"
+            "Its index, giving the ID of each shape, is kept in the file STORE.idx.\n"
+            "A search compares the rotational invariants of the shapes, first through compact codes\n"
+            "kept in the file STORE.zmq (built by --codes, or on the fly if missing or out of date),\n"
+            "then exactly for the best candidates, using their moments.";
+string ex = "ZernikeStore shapes.zms a.zm b.zmb              Appends the moments of a.zm and b.zmb with IDs a and b\n"
+            "ZernikeStore --id a42 shapes.zms - < a.zm       Appends the moments read on standard input with ID a42\n"
+            "ZernikeStore -l shapes.zms                      Lists the shapes of the store\n"
+            "ZernikeStore -g a -o a.zm shapes.zms            Writes the moments of shape a in ZM format\n"
+            "ZernikeStore --codes 8 shapes.zms               Builds the codes of the store for searches\n"
+            "ZernikeStore -k 5 -s a.zm shapes.zms            Lists the five shapes closest to a";
+string v_help = "outputs more informations";
+string q_help = "represses all warnings and error messages";
+string o_help = "save output to the given file instead of standard output";
+string d_help = "number of significant digits printed in the output (default is 8)";
+string l_help = "lists the records of the store with their ID";
+string g_help = "writes the moments of the shape with the given ID";
+string id_help = "the ID of the shape appended (default is the name of the file without directory nor extension)";
+string binary_help = "writes the moments in the binary ZMB format instead of text (with -g)";
+string s_help = "lists the shapes closest to the one given in ZM or ZMB format, with their distance";
+string k_help = "number of shapes listed by -s (default is 10)";
+string candidates_help = "number of shapes ranked again exactly by -s (default is 4 times the number listed)";
+string codes_help = "builds the codes of the store used by -s, with 8 or 16 bits by value";
+string t_help = "number of threads to use in parallel, use 0 to adapt to the machine";
+string STORE_help = "the store file";
+string FILE_help = "reads FILE in ZM or ZMB format, use - for standard input";
+string id_many_msg = "Option --id needs exactly one FILE";
+string no_file_msg = "Nothing to do: give files to append, or use option -l, -g, -s or --codes";
+string bad_k_msg = "The number of shapes listed should be positive";
+string bad_candidates_msg = "The number of shapes ranked again should not be negative";
+string bad_bits_msg = "The codes should have 8 or 16 bits";
+string store_order_msg = "The order of the moments is lower than the order of store ";
+string bad_store_msg = "Cannot read store ";
+string unknown_id_msg = "Unknown shape ID: ";
+string bad_output_msg = "Cannot open output file: ";
+
+int main (int argc, char *argv[])
+{
+  elapsed timer;
+  int digit = 8;
+  string store_name;
+  string output = "-";
+  string get_id;
+  string id;
+  string search;
+  int k = 10;
+  int candidates = 0;
+  int bits = 8;
+  int nt = 1;
+  vector<string> files;
+
+  parser p(sh, eh, ex);
+  p.prog_name = "ZernikeStore";
+  p.flag("v", "verbose", v_help);
+  p.flag("q", "quiet", q_help);
+  p.option("o", "output", "FILE", output, o_help);
+  p.option("d", "digits", "DIGITS", digit, d_help);
+  p.flag("l", "list", l_help);
+  p.option("g", "get", "ID", get_id, g_help);
+  p.option("", "id", "ID", id, id_help);
+  p.flag("", "binary", binary_help);
+  p.option("s", "search", "FILE", search, s_help);
+  p.option("k", "", "K", k, k_help);
+  p.option("", "candidates", "C", candidates, candidates_help);
+  p.option("", "codes", "BITS", bits, codes_help);
+  p.option("t", "threads", "THREAD", nt, t_help);
+  p.arg("STORE", store_name, STORE_help);
+  p.rest_arg("FILE", files, FILE_help);
+
+  p.quiet("q");
+  p.exclusion({"v", "q"});
+  p.exclusion({"l", "g"});
+  p.exclusion({"l", "FILE"});
+  p.exclusion({"g", "FILE"});
+  p.exclusion({"s", "l"});
+  p.exclusion({"s", "g"});
+  p.exclusion({"s", "FILE"});
+
+  p.run(argc, argv);
+
+  if (p("id") && files.size() != 1)
+    p.die(id_many_msg);
+  if (files.empty() && !p("l") && !p("g") && !p("s") && !p("codes"))
+    p.die(no_file_msg);
+  if (k <= 0)
+    p.die(bad_k_msg);
+  if (candidates < 0)
+    p.die(bad_candidates_msg);
+  if (bits != 8 && bits != 16)
+    p.die(bad_bits_msg);
+
+
+  // number of threads
+
+  #ifdef NO_THREADS
+    if (nt != 1)
+      p.warn("Threads are not available in this build, running on one thread");
+  #else
+  if (nt < 0)
+    nt = 1;
+  if (nt == 0) {
+    nt = max_threads();
+    if (nt == 0)
+      nt = 1;
+    if (p("v"))
+      cerr << "Choosing to run on " << nt << " threads" << endl;
+  }
+  #endif
+
+  // append files
+
+  for (auto &f: files) {
+    zernike zm;
+    string err = read_file(f, zm, p("v"));
+    if (!err.empty())
+      p.die(err);
+    const string shape = p("id") ? id : shape_id(f);
+    err = zm_store::append(store_name, shape, zm);
+    if (!err.empty())
+      p.die(err);
+    if (p("v"))
+      cerr << "Appended " << f << " as " << shape << endl;
+  }
+
+  // option --codes builds the codes of the store
+
+  const string codes_name = store_name + ".zmq";
+  if (p("codes")) {
+    const zm_store st(store_name);
+    if (!st)
+      p.die(bad_store_msg + store_name);
+    const zm_codes codes(st, bits, nt, p("v"));
+    const string err = codes.save(codes_name);
+    if (!err.empty())
+      p.die(err);
+    if (p("v"))
+      cerr << "Wrote the codes of " << codes.size() << " records to " << codes_name
+           << ", error bound: " << codes.codec.error_bound() << endl;
+  }
+
+  if (p("l") || p("g") || p("s")) {
+    const zm_store st(store_name);
+    if (!st)
+      p.die(bad_store_msg + store_name);
+
+    smart_output out(output, p("binary"));
+    if (!out)
+      p.die(bad_output_msg + output + " (" + strerror(errno) + ")");
+    if (digit <= 0)
+      digit = 1;
+    out << setprecision(digit);
+
+    // option -l lists the records
+
+    if (p("l")) {
+      out << "# Store " << store_name << ": " << st.size() << " records, order " << st.order()
+          << ", normalization " << st.get_norm() << "\n";
+      for (size_t i = 0 ; i < st.size() ; i++)
+        out << i << " " << (st.id(i).empty() ? "-" : st.id(i)) << "\n";
+    }
+
+    // option -g writes the moments of a shape
+
+    if (p("g")) {
+      const size_t i = st.find(get_id);
+      if (i == st.size())
+        p.die(unknown_id_msg + get_id);
+      zernike zm;
+      st.read(i, zm);
+      out << "# Produced by " << p.prog_name << " (" << p.version_text << ") from store: " << store_name
+          << ", shape " << get_id << "\n";
+      out << "# Date: " << now() << "\n";
+      if (p("binary"))
+        write_binary(*out.output, zm);
+      else
+        out << zm;
+    }
+
+    // option -s lists the closest shapes
+
+    if (p("s")) {
+      zernike zm;
+      string err = read_file(search, zm, p("v"));
+      if (!err.empty())
+        p.die(err);
+      const int n = st.order();
+      if (zm.order() < n)
+        p.die(store_order_msg + store_name + " (" + to_string(n) + ")");
+      unique_ptr<zm_codes> codes(new zm_codes(codes_name));
+      if (!*codes || codes->size() != st.size() || codes->order() != n
+          || codes->store_stamp() != st.stamp()) {
+        if (p("v"))
+          cerr << "Building the codes of the store, " << codes_name << " is missing or out of date" << endl;
+        codes.reset(new zm_codes(st, bits, nt, p("v")));
+      }
+      const vector<double> query = zm_codes::invariants(zm, n);
+      const vector<zm_match> found = codes->search(query, k, candidates ? candidates : 4 * k,
+        [&](size_t i) {
+          st.read(i, zm);
+          return euclidean_distance(zm_codes::invariants(zm, n), query);
+        }, nt);
+      out << "# Search in store " << store_name << " for " << search << ": " << found.size()
+          << " closest shapes by rotational invariants\n";
+      out << "# Codes: " << codes->codec.bits << " bits, error bound: " << codes->codec.error_bound() << "\n";
+      for (size_t r = 0 ; r < found.size() ; r++) {
+        const string &shape = st.id(found[r].second);
+        out << r + 1 << " " << (shape.empty() ? "-" : shape) << " " << found[r].first << "\n";
+      }
+    }
+  }
+
+  if (p("v"))
+    cerr << p.prog_name << " used " << (int) (timer.seconds() * 100) / 100. << " seconds to run.\n";
+
+  return 0;
+}
@@ -5,6 +5,8 @@
 
 #include <unordered_map>
 #include <algorithm>
+#include <cstdint>
+#include <map>
 #include "mesh.hpp"
 #include "parallel.hpp"
 
@@ -362,6 +364,50 @@ mesh mesh::split() const
   return m;
 }
 
+/** Finds the root of a vertex in the union-find forest of mesh::components. */
+static size_t find_root(std::vector<size_t> &parent, size_t i)
+{
+  while (parent[i] != i)
+    i = parent[i] = parent[parent[i]];
+  return i;
+}
+
+/** Splits the mesh into its connected components (facets sharing a vertex are connected).
+  Components are ordered by their first facet, facets keep their order
+  and vertices their relative order. Vertices without facets are dropped.
+*/
+std::vector<mesh> mesh::components() const
+{
+  std::vector<size_t> parent(points.size());
+  for (size_t i = 0 ; i < parent.size() ; i++)
+    parent[i] = i;
+  for (auto &t: triangles) {
+    const size_t r1 = find_root(parent, t.i1);
+    parent[find_root(parent, t.i2)] = r1;
+    parent[find_root(parent, t.i3)] = r1;
+  }
+
+  std::vector<mesh> comps;
+  std::vector<size_t> comp(points.size(), (size_t) -1);
+  for (auto &t: triangles) {
+    const size_t r = find_root(parent, t.i1);
+    if (comp[r] == (size_t) -1) {
+      comp[r] = comps.size();
+      comps.push_back(mesh());
+    }
+  }
+  std::vector<size_t> index(points.size(), (size_t) -1);
+  std::vector<bool> used(points.size(), false);
+  for (auto &t: triangles)
+    used[t.i1] = used[t.i2] = used[t.i3] = true;
+  for (size_t i = 0 ; i < points.size() ; i++)
+    if (used[i])
+      index[i] = comps[comp[find_root(parent, i)]].add_point(points[i]);
+  for (auto &t: triangles)
+    comps[comp[find_root(parent, t.i1)]].triangles.push_back({index[t.i1], index[t.i2], index[t.i3]});
+  return comps;
+}
+
 /** a class to gather data about an edge in a mesh.*/
 class edge_info {
 public:
@@ -400,9 +446,1067 @@ edge_report mesh::edges() const
   return r;
 }
 
-/** Reads a mesh in OFF format. */
+/** a class to hash oriented edges. */
+class hash_oriented_edge {
+public:
+  size_t operator()(const std::pair<size_t, size_t> &e) const
+  { return std::hash<size_t>{}(e.first) ^ (std::hash<size_t>{}(e.second) * 0x9e3779b97f4a7c15ULL); }
+};
+
+typedef std::unordered_map<std::pair<size_t, size_t>, size_t, hash_oriented_edge> oriented_edge_map;
+
+/** Triangulates a simple planar polygon by ear clipping.
+ @param pts the points of the mesh.
+ @param poly the indices of the vertices, counterclockwise around normal n.
+ @param n the normal of the plane.
+ @param tol the tolerance used to discard flat ears.
+ @param res where the triangles are added.
+ @return false if the polygon could not be triangulated.
+*/
+bool ear_clip(const std::vector<vec> &pts, std::vector<size_t> poly, const vec &n, double tol,
+              std::vector<t_mesh> &res)
+{
+  // project on the plane, keeping the orientation
+  const double an[3] = {fabs(n.x), fabs(n.y), fabs(n.z)};
+  const int k = std::max_element(an, an + 3) - an;
+  const double sn[3] = {n.x, n.y, n.z};
+  auto proj = [&](size_t i) {
+    const double c[3] = {pts[i].x, pts[i].y, pts[i].z};
+    const double u = c[(k + 1) % 3], v = c[(k + 2) % 3];
+    return (sn[k] > 0) ? std::make_pair(u, v) : std::make_pair(v, u);
+  };
+  auto cross2 = [&](size_t a, size_t b, size_t c) {
+    const auto pa = proj(a), pb = proj(b), pc = proj(c);
+    return (pb.first - pa.first) * (pc.second - pa.second)
+         - (pb.second - pa.second) * (pc.first - pa.first);
+  };
+
+  const size_t start = res.size();
+  while (poly.size() > 3) {
+    const size_t s = poly.size();
+    bool found = false;
+    for (size_t i = 0 ; i < s && !found ; i++) {
+      const size_t a = poly[(i + s - 1) % s], b = poly[i], c = poly[(i + 1) % s];
+      const double len = (pts[b] - pts[a]).length() * (pts[c] - pts[b]).length();
+      if (cross2(a, b, c) <= tol * len)
+        continue;
+      bool empty = true;
+      for (auto j: poly)
+        if (j != a && j != b && j != c
+            && cross2(a, b, j) >= 0 && cross2(b, c, j) >= 0 && cross2(c, a, j) >= 0) {
+          empty = false;
+          break;
+        }
+      if (empty) {
+        res.push_back({a, b, c});
+        poly.erase(poly.begin() + i);
+        found = true;
+      }
+    }
+    if (!found) {
+      res.resize(start);
+      return false;
+    }
+  }
+  if (cross2(poly[0], poly[1], poly[2]) <= 0) {
+    res.resize(start);
+    return false;
+  }
+  res.push_back({poly[0], poly[1], poly[2]});
+  return true;
+}
+
+/** Merges connected coplanar facets into larger ones.
+
+ Facets are gathered into patches: connected sets of facets (by consistently
+ oriented edges) lying in the plane of the first facet of the patch, within the tolerance.
+ The border of each patch is then triangulated again, without the vertices
+ lying on straight parts of the border when no other facet uses them.
+ Patches whose border is not a simple loop (holes, pinched vertices, non manifold edges)
+ keep their original facets. The surface, hence any integral over it, is unchanged.
+ Vertices no longer used are removed.
+ @param tol the tolerance on the distances to the plane and the normals.
+ @return the new mesh.
+*/
+mesh mesh::merge_coplanar(double tol) const
+{
+  const size_t nt = triangles.size();
+  const size_t none = -1;
+
+  // normals and oriented edges
+  std::vector<vec> normal(nt);
+  std::vector<bool> mergeable(nt, true);
+  oriented_edge_map oedges;
+  for (size_t i = 0 ; i < nt ; i++) {
+    const t_mesh &t = triangles[i];
+    const triangle tr = t.get_triangle(*this);
+    const vec c = cross(tr.p2 - tr.p1, tr.p3 - tr.p1);
+    const double l = c.length();
+    if (l <= tol * tol)
+      mergeable[i] = false;
+    else
+      normal[i] = c / l;
+    const size_t id[3] = {t.i1, t.i2, t.i3};
+    for (int j = 0 ; j < 3 ; j++) {
+      auto r = oedges.insert({{id[j], id[(j + 1) % 3]}, i});
+      if (!r.second) {
+        mergeable[i] = false;
+        mergeable[r.first->second] = false;
+      }
+    }
+  }
+
+  // patches of coplanar facets
+  std::vector<size_t> patch(nt, none);
+  std::vector<std::vector<size_t>> patches;
+  for (size_t seed = 0 ; seed < nt ; seed++) {
+    if (patch[seed] != none)
+      continue;
+    patch[seed] = patches.size();
+    patches.push_back({seed});
+    if (!mergeable[seed])
+      continue;
+    std::vector<size_t> &pt = patches.back();
+    const vec n0 = normal[seed];
+    const double d0 = dot(n0, points[triangles[seed].i1]);
+    for (size_t k = 0 ; k < pt.size() ; k++) {
+      const t_mesh &t = triangles[pt[k]];
+      const size_t id[3] = {t.i1, t.i2, t.i3};
+      for (int j = 0 ; j < 3 ; j++) {
+        auto e = oedges.find({id[(j + 1) % 3], id[j]});
+        if (e == oedges.end())
+          continue;
+        const size_t nb = e->second;
+        if (patch[nb] != none || !mergeable[nb] || dot(normal[nb], n0) < 1 - tol)
+          continue;
+        const t_mesh &tn = triangles[nb];
+        if (fabs(dot(n0, points[tn.i1]) - d0) > tol || fabs(dot(n0, points[tn.i2]) - d0) > tol
+            || fabs(dot(n0, points[tn.i3]) - d0) > tol)
+          continue;
+        patch[nb] = patch[seed];
+        pt.push_back(nb);
+      }
+    }
+  }
+
+  // borders of the patches, as simple loops
+  std::vector<std::vector<size_t>> loops(patches.size());
+  std::vector<size_t> incident(points.size(), 0), removable(points.size(), 0);
+  for (auto &t: triangles) {
+    incident[t.i1]++;
+    incident[t.i2]++;
+    incident[t.i3]++;
+  }
+  for (size_t p = 0 ; p < patches.size() ; p++) {
+    if (patches[p].size() < 2)
+      continue;
+    std::unordered_map<size_t, size_t> next;
+    bool simple = true;
+    for (auto i: patches[p]) {
+      const t_mesh &t = triangles[i];
+      const size_t id[3] = {t.i1, t.i2, t.i3};
+      for (int j = 0 ; j < 3 ; j++) {
+        auto e = oedges.find({id[(j + 1) % 3], id[j]});
+        if (e != oedges.end() && patch[e->second] == p)
+          continue;
+        if (!next.insert({id[j], id[(j + 1) % 3]}).second)
+          simple = false;
+      }
+    }
+    if (!simple || next.empty())
+      continue;
+    std::vector<size_t> &loop = loops[p];
+    size_t v = next.begin()->first;
+    do {
+      loop.push_back(v);
+      auto e = next.find(v);
+      if (e == next.end() || loop.size() > next.size())
+        break;
+      v = e->second;
+    } while (v != loop.front());
+    if (v != loop.front() || loop.size() != next.size()) {
+      loop.clear();
+      continue;
+    }
+    // vertices this patch can drop: inner and straight border vertices
+    std::unordered_map<size_t, bool> corner;
+    const size_t s = loop.size();
+    for (size_t k = 0 ; k < s ; k++) {
+      const vec &a = points[loop[(k + s - 1) % s]], &b = points[loop[k]], &c = points[loop[(k + 1) % s]];
+      corner[loop[k]] = cross(b - a, c - b).length() > tol * (b - a).length() * (c - b).length();
+    }
+    for (auto i: patches[p]) {
+      const t_mesh &t = triangles[i];
+      for (auto v: {t.i1, t.i2, t.i3}) {
+        auto c = corner.find(v);
+        if (c == corner.end() || !c->second)
+          removable[v]++;
+      }
+    }
+  }
+
+  // new facets
+  mesh m;
+  std::vector<t_mesh> res;
+  for (size_t p = 0 ; p < patches.size() ; p++) {
+    std::vector<size_t> poly;
+    for (auto v: loops[p])
+      if (removable[v] != incident[v])
+        poly.push_back(v);
+    if (poly.size() < 3 || !ear_clip(points, poly, normal[patches[p][0]], tol, res))
+      for (auto i: patches[p])
+        res.push_back(triangles[i]);
+  }
+
+  // remove unused vertices
+  std::vector<size_t> index(points.size(), none);
+  for (auto &t: res) {
+    size_t *id[3] = {&t.i1, &t.i2, &t.i3};
+    for (auto i: id) {
+      if (index[*i] == none)
+        index[*i] = m.add_point(points[*i]);
+      *i = index[*i];
+    }
+    m.add_triangle(t);
+  }
+  return m;
+}
+
+/** Determinant of a matrix, negative for reflections. */
+static double det(const mat &m)
+{
+  return dot(m.mx, cross(m.my, m.mz));
+}
+
+/** Tells whether two orthogonal matrices are equal up to rounding errors. */
+static bool same_mat(const mat &m1, const mat &m2)
+{
+  const mat d = m1 - m2;
+  return d.mx.length_square() + d.my.length_square() + d.mz.length_square() < 1e-18;
+}
+
+/** Maximum number of elements of a symmetry_group. */
+const size_t max_group_size = 240;
+
+/** Tells whether the group contains g (up to rounding errors). */
+bool symmetry_group::contains(const mat &g) const
+{
+  for (auto &e: elements)
+    if (same_mat(e, g))
+      return true;
+  return false;
+}
+
+/** Adds an orthogonal transformation to the group, then closes it under composition.
+  @return False if the resulting group would have more than 240 elements,
+  in which case the group is unchanged.
+*/
+bool symmetry_group::add_generator(const mat &g)
+{
+  if (contains(g))
+    return true;
+  std::vector<mat> els = elements;
+  els.push_back(g);
+  for (size_t i = 0 ; i < els.size() ; i++)
+    for (size_t j = 0 ; j <= i ; j++)
+      for (const mat &p: {els[i] * els[j], els[j] * els[i]}) {
+        bool found = false;
+        for (auto &e: els)
+          if (same_mat(e, p)) {
+            found = true;
+            break;
+          }
+        if (found)
+          continue;
+        if (els.size() == max_group_size)
+          return false;
+        els.push_back(p);
+      }
+  elements = els;
+  return true;
+}
+
+/** Adds generators given by a string.
+  @param spec A comma separated list among mx, my, mz (mirrors orthogonal to the axes),
+  i (inversion) and cNx, cNy, cNz (rotations by 360/N degrees around the axes).
+  @return An error message, empty on success.
+*/
+std::string symmetry_group::add_generators(const std::string &spec)
+{
+  const vec axes[3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  std::istringstream is(spec);
+  std::string tok;
+  while (std::getline(is, tok, ',')) {
+    const size_t ax = tok.empty() ? 3 : std::string("xyz").find(tok.back());
+    mat g;
+    if (tok == "i")
+      g = -1 * mat_id;
+    else if (tok.size() == 2 && tok[0] == 'm' && ax < 3)
+      g = mat_id - 2 * dot_mat(axes[ax], axes[ax]);
+    else if (tok.size() > 2 && tok[0] == 'c' && ax < 3 &&
+             tok.find_first_not_of("0123456789", 1) == tok.size() - 1) {
+      const int n = atoi(tok.c_str() + 1);
+      if (n < 1)
+        return "Bad symmetry: " + tok;
+      g = rotation_mat(axes[ax], 2 * M_PI / n);
+    }
+    else
+      return "Unknown symmetry (should be mx, my, mz, i, cNx, cNy or cNz): " + tok;
+    if (!add_generator(g))
+      return "Symmetry group too large: " + spec;
+  }
+  return "";
+}
+
+/** Finds how an orthogonal transformation permutes the facets of the mesh.
+  Facets must be sent onto facets with the same orientation.
+  @param g The transformation.
+  @param tol The largest distance between a transformed vertex and its image.
+  @param perm Receives the permutation: facet i is sent to facet perm[i].
+  @return False if the mesh is not invariant by g.
+*/
+bool mesh::facet_permutation(const mat &g, double tol, std::vector<size_t> &perm) const
+{
+  const size_t none = -1;
+  const double h = 2 * tol;
+  auto cell = [h](double x) { return (int64_t) floor(x / h); };
+  auto cell_key = [](int64_t x, int64_t y, int64_t z) {
+    return ((uint64_t) x * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t) y * 0xc2b2ae3d27d4eb4fULL) ^
+           ((uint64_t) z * 0x165667b19e3779f9ULL);
+  };
+  if (!(h > 0))
+    return false;
+
+  // vertices hashed by cells of size 2 tol, images are looked for in the neighboring cells
+  std::unordered_multimap<uint64_t, size_t> grid;
+  for (size_t i = 0 ; i < points.size() ; i++)
+    grid.insert({cell_key(cell(points[i].x), cell(points[i].y), cell(points[i].z)), i});
+  std::vector<size_t> img(points.size(), none);
+  for (auto &t: triangles)
+    for (size_t i: {t.i1, t.i2, t.i3}) {
+      if (img[i] != none)
+        continue;
+      const vec p = g * points[i];
+      const int64_t cx = cell(p.x), cy = cell(p.y), cz = cell(p.z);
+      for (int d = 0 ; d < 27 && img[i] == none ; d++) {
+        auto r = grid.equal_range(cell_key(cx + d % 3 - 1, cy + (d / 3) % 3 - 1, cz + d / 9 - 1));
+        for (auto it = r.first ; it != r.second ; ++it)
+          if ((points[it->second] - p).length_square() <= tol * tol) {
+            img[i] = it->second;
+            break;
+          }
+      }
+      if (img[i] == none)
+        return false;
+    }
+
+  // reflections reverse the orientation of the facets
+  oriented_edge_map oedges;
+  for (size_t f = 0 ; f < triangles.size() ; f++) {
+    const t_mesh &t = triangles[f];
+    oedges[{t.i1, t.i2}] = f;
+    oedges[{t.i2, t.i3}] = f;
+    oedges[{t.i3, t.i1}] = f;
+  }
+  const bool reflect = det(g) < 0;
+  std::vector<bool> hit(triangles.size(), false);
+  perm.assign(triangles.size(), none);
+  for (size_t f = 0 ; f < triangles.size() ; f++) {
+    const t_mesh &t = triangles[f];
+    const size_t a = img[t.i1], b = img[reflect ? t.i3 : t.i2], c = img[reflect ? t.i2 : t.i3];
+    auto e = oedges.find({a, b});
+    if (e == oedges.end() || hit[e->second])
+      return false;
+    const t_mesh &u = triangles[e->second];
+    if (!((u.i1 == a && u.i2 == b && u.i3 == c) || (u.i2 == a && u.i3 == b && u.i1 == c) ||
+          (u.i3 == a && u.i1 == b && u.i2 == c)))
+      return false;
+    hit[e->second] = true;
+    perm[f] = e->second;
+  }
+  return true;
+}
+
+/** Finds symmetries of the mesh around the origin.
+  The mirrors orthogonal to the axes and to the diagonals of their planes, the inversion,
+  the rotations of order 2 to 12 around the axes, of order 3 around the diagonals
+  of the cube and of order 5 around an axis of the icosahedron are tried,
+  the group they generate is returned.
+  @param tol The tolerance on the positions of the vertices, relative to the radius of the mesh.
+*/
+symmetry_group mesh::symmetries(double tol) const
+{
+  const double g = (1 + sqrt(5)) / 2;
+  const vec axes[3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  std::vector<mat> candidates;
+  for (int i = 0 ; i < 3 ; i++) {
+    candidates.push_back(mat_id - 2 * dot_mat(axes[i], axes[i]));
+    for (int s = -1 ; s <= 1 ; s += 2) {
+      const vec n = (1 / sqrt(2)) * (axes[i] + s * axes[(i + 1) % 3]);
+      candidates.push_back(mat_id - 2 * dot_mat(n, n));
+    }
+  }
+  candidates.push_back(-1 * mat_id);
+  for (int k = 2 ; k <= 12 ; k++)
+    for (auto &a: axes)
+      candidates.push_back(rotation_mat(a, 2 * M_PI / k));
+  for (int s = 0 ; s < 4 ; s++)
+    candidates.push_back(rotation_mat(vec((s & 1) ? -1 : 1, (s & 2) ? -1 : 1, 1).normalize(), 2 * M_PI / 3));
+  candidates.push_back(rotation_mat(vec(1, 0, g).normalize(), 2 * M_PI / 5));
+
+  symmetry_group grp;
+  const double t = tol * radius();
+  std::vector<size_t> perm;
+  for (auto &c: candidates)
+    if (!grp.contains(c) && facet_permutation(c, t, perm))
+      grp.add_generator(c);
+  return grp;
+}
+
+/** Minimum number of bytes by chunk when reading OFF files in parallel. */
+const size_t off_chunk_size = 1 << 20;
+
+/** Reads one vertex line of an OFF file. */
+static bool read_off_point(mapped_input &mi, vec &v)
+{
+  return mi.read(v.x) && mi.read(v.y) && mi.read(v.z);
+}
+
+/** Reads one facet line of an OFF file. */
+static bool read_off_triangle(mapped_input &mi, t_mesh &t)
+{
+  long k;
+  size_t a, b, c;
+  if (!mi.read(k) || !mi.read(a) || !mi.read(b) || !mi.read(c))
+    return false;
+  t = {a, b, c};
+  return true;
+}
+
+/** The lines of a chunk of an OFF file, see read_mapped. */
+class off_chunk
+{
+public:
+  std::streamoff from, to; /**< Position of the chunk in the file. */
+  size_t items, lines;     /**< Number of vertex or facet lines and of all lines. */
+  std::streamoff stop;     /**< Position of the line after the last one read, or of a bad line. */
+  size_t stop_lines;       /**< Number of lines before stop. */
+  bool bad;                /**< True if a line could not be read. */
+};
+
+/** Reads the vertices and facets of an OFF file from a file mapped in memory.
+  With several threads, the file is split in chunks of whole lines. The lines
+  of each chunk are counted in parallel, which gives the vertex or facet of each line,
+  then the chunks are parsed in parallel directly into the mesh. Line numbers are
+  kept, so that mi is left on the first bad line like a sequential reading.
+  @return False if a line is missing or cannot be read.
+*/
+static bool read_off(mapped_input &mi, mesh &m, int nt)
+{
+  if (!mi.next_line() || !mi.next_line()) // first line contains "OFF"
+    return false;
+  size_t n_points, n_faces, dummy;
+  if (!mi.read(n_points) || !mi.read(n_faces) || !mi.read(dummy))
+    return false;
+  const std::streamoff start = mi.tell();
+  const size_t rest = mi.size() - start;
+  const size_t n_chunks = std::min<size_t>(4 * nt, rest / off_chunk_size);
+
+  if (nt <= 1 || n_chunks <= 1) {
+    // a vertex needs at least 6 bytes and a facet 8, do not trust the counts more than that
+    m.points.reserve(std::min(n_points, mi.size() / 6));
+    m.triangles.reserve(std::min(n_faces, mi.size() / 8));
+    for (size_t i = 0 ; i < n_points ; i++) {
+      vec v;
+      if (!mi.next_line() || !read_off_point(mi, v))
+        return false;
+      m.add_point(v);
+    }
+    for (size_t i = 0 ; i < n_faces ; i++) {
+      t_mesh t;
+      if (!mi.next_line() || !read_off_triangle(mi, t))
+        return false;
+      m.add_triangle(t);
+    }
+    return true;
+  }
+
+  std::vector<off_chunk> chunks(n_chunks);
+  for (size_t i = 0 ; i < n_chunks ; i++) {
+    chunks[i].from = (i == 0) ? start : chunks[i - 1].to;
+    chunks[i].to = (i + 1 == n_chunks) ? mi.size() : mi.line_start(start + rest * (i + 1) / n_chunks);
+  }
+  parallel_eval<off_chunk>(nt, chunks, [&](size_t i) {
+      off_chunk c = chunks[i];
+      mapped_input v(mi, c.from, c.to, 0);
+      for (c.items = 0 ; v.next_line() ; c.items++)
+        ;
+      c.lines = v.line_count;
+      return c;
+    });
+
+  const size_t needed = n_points + n_faces;
+  size_t items = 0, lines = mi.line_count;
+  for (auto &c: chunks) {
+    const size_t k = c.items, l = c.lines;
+    c.items = items;
+    c.lines = lines;
+    items += k;
+    lines += l;
+  }
+  // vertex and facet lines beyond the end of a truncated file are not allocated
+  m.points.resize(std::min(n_points, items));
+  m.triangles.resize(std::min(n_faces, items - std::min(n_points, items)));
+  parallel_eval<off_chunk>(nt, chunks, [&](size_t i) {
+      off_chunk c = chunks[i];
+      mapped_input v(mi, c.from, c.to, c.lines);
+      c.bad = false;
+      for (size_t k = c.items ; k < needed ; k++) {
+        c.stop = v.tell();
+        c.stop_lines = v.line_count;
+        if (!v.next_line())
+          return c;
+        const bool ok = (k < n_points) ? read_off_point(v, m.points[k]) : read_off_triangle(v, m.triangles[k - n_points]);
+        if (!ok) {
+          c.bad = true;
+          return c;
+        }
+      }
+      c.stop = v.tell();
+      c.stop_lines = v.line_count;
+      return c;
+    });
+
+  // the first bad line, or the end of the last line needed
+  for (size_t i = 0 ; i < n_chunks ; i++) {
+    const off_chunk &c = chunks[i];
+    if (c.bad || i + 1 == n_chunks || chunks[i + 1].items >= needed) {
+      mi.seek(c.stop, c.stop_lines);
+      if (c.bad || items < needed) {
+        mi.next_line();
+        return false;
+      }
+      break;
+    }
+  }
+  m.triangles.erase(std::remove_if(m.triangles.begin(), m.triangles.end(),
+                                   [](const t_mesh &t) { return t.collapsed(); }),
+                    m.triangles.end());
+  return true;
+}
+
+/** Size of the buffers used to write binary files. */
+const size_t binary_buffer_size = 1 << 20;
+
+/** A property of an element of a PLY file.
+  Types are given by their size in bytes and their kind: 'i' for signed integers,
+  'u' for unsigned integers and 'f' for floating point numbers.
+*/
+class ply_property
+{
+public:
+  std::string name;
+  int size;
+  char kind;
+  int count_size;  /**< Size of the number of values of a list property, 0 for other properties. */
+  char count_kind;
+};
+
+/** An element of a PLY file, with the number of its records and their properties. */
+class ply_element
+{
+public:
+  std::string name;
+  size_t count;
+  std::vector<ply_property> props;
+};
+
+/** Reads the type of a PLY property.
+  @return False if the type is unknown.
+*/
+static bool ply_type(const std::string &t, int &size, char &kind)
+{
+  static const std::map<std::string, std::pair<int, char>> types = {
+    {"char", {1, 'i'}}, {"int8", {1, 'i'}}, {"uchar", {1, 'u'}}, {"uint8", {1, 'u'}},
+    {"short", {2, 'i'}}, {"int16", {2, 'i'}}, {"ushort", {2, 'u'}}, {"uint16", {2, 'u'}},
+    {"int", {4, 'i'}}, {"int32", {4, 'i'}}, {"uint", {4, 'u'}}, {"uint32", {4, 'u'}},
+    {"float", {4, 'f'}}, {"float32", {4, 'f'}}, {"double", {8, 'f'}}, {"float64", {8, 'f'}}};
+  const auto i = types.find(t);
+  if (i == types.end())
+    return false;
+  size = i->second.first;
+  kind = i->second.second;
+  return true;
+}
+
+/** Decodes a binary little endian PLY value. */
+static double ply_value(const char *p, int size, char kind)
+{
+  switch (size * 4 + (kind == 'f') * 2 + (kind == 'u')) {
+  case 4: return get_le<int8_t>(p);
+  case 5: return get_le<uint8_t>(p);
+  case 8: return get_le<int16_t>(p);
+  case 9: return get_le<uint16_t>(p);
+  case 16: return get_le<int32_t>(p);
+  case 17: return get_le<uint32_t>(p);
+  case 18: return get_le<float>(p);
+  default: return get_le<double>(p);
+  }
+}
+
+/** Reads the header of a PLY file.
+  @param binary Set to true for the binary little endian format, to false for ascii.
+  @return False if the header cannot be read.
+*/
+static bool read_ply_header(mapped_input &mi, std::vector<ply_element> &elems, bool &binary)
+{
+  std::string w;
+  if (!mi.next_line() || !mi.read(w) || w != "ply")
+    return false;
+  bool format = false;
+  while (mi.next_line() && mi.read(w)) {
+    if (w == "format") {
+      if (!mi.read(w) || (w != "ascii" && w != "binary_little_endian"))
+        return false;
+      binary = (w != "ascii");
+      format = true;
+    }
+    else if (w == "element") {
+      ply_element e;
+      if (!mi.read(e.name) || !mi.read(e.count))
+        return false;
+      elems.push_back(e);
+    }
+    else if (w == "property") {
+      ply_property p = {"", 0, 0, 0, 0};
+      if (elems.empty() || !mi.read(w))
+        return false;
+      if (w == "list" && !(mi.read(w) && ply_type(w, p.count_size, p.count_kind) && mi.read(w)))
+        return false;
+      if (!ply_type(w, p.size, p.kind) || !mi.read(p.name))
+        return false;
+      elems.back().props.push_back(p);
+    }
+    else if (w == "end_header")
+      return format;
+    else if (w != "comment" && w != "obj_info")
+      return false;
+  }
+  return false;
+}
+
+/** Reads a mesh in PLY format (binary little endian or ascii) from a file mapped in memory.
+  Vertices are read from the properties x, y and z of the element vertex, facets from the
+  property vertex_indices (or vertex_index) of the element face, polygons being split
+  by mesh::add_polygon. Other elements and properties are ignored. Binary vertices
+  made of the three coordinates in double precision are copied directly into the mesh.
+  The records may be read in several steps, see ply_reader::read, and a copy of the
+  reader can be used to go back to the record it was on.
+*/
+class ply_reader
+{
+public:
+  bool ok; /**< True if the header was read. */
+
+  ply_reader(mapped_input &m);
+
+  /** True if all records were read. */
+  bool done() const
+  { return e == elems.size(); }
+
+  size_t facets() const;
+  bool read(mesh &m, size_t max_facets);
+
+private:
+  mapped_input *mi;
+  std::vector<ply_element> elems;
+  bool binary;
+  const char *p, *end; /**< Position in the binary data. */
+  size_t vertices;     /**< Number of vertices read. */
+  size_t e, r;         /**< Current element and record. */
+
+  bool truncated();
+  bool get(int size, char kind, double &x);
+};
+
+/** Constructor, reads the header. */
+ply_reader::ply_reader(mapped_input &m):
+ok(false), mi(&m), binary(false), p(NULL), end(NULL), vertices(0), e(0), r(0)
+{
+  ok = read_ply_header(m, elems, binary);
+  p = m.content() + m.tell();
+  end = m.content() + m.size();
+}
+
+/** Number of records of the element face. */
+size_t ply_reader::facets() const
+{
+  size_t n = 0;
+  for (auto &el: elems)
+    if (el.name == "face")
+      n += el.count;
+  return n;
+}
+
+/** Marks the end of the file as reached, for error messages. */
+bool ply_reader::truncated()
+{
+  mi->seek(mi->size(), mi->line_count);
+  mi->next_line();
+  return false;
+}
+
+/** Reads one value, in binary or in ascii. */
+bool ply_reader::get(int size, char kind, double &x)
+{
+  if (!binary)
+    return mi->read(x);
+  if (end - p < size)
+    return truncated();
+  x = ply_value(p, size, kind);
+  p += size;
+  return true;
+}
+
+/** Reads the next records.
+  @param m Receives the vertices and facets read.
+  @param max_facets Reading stops before a record of the element face
+  when the mesh has this number of facets.
+  @return False if the file cannot be read.
+*/
+bool ply_reader::read(mesh &m, size_t max_facets)
+{
+  for ( ; e < elems.size() ; e++, r = 0) {
+    const ply_element &el = elems[e];
+    const bool vert = (el.name == "vertex"), face = (el.name == "face");
+    size_t ix = el.props.size(), iy = ix, iz = ix, il = ix;
+    for (size_t k = 0 ; k < el.props.size() ; k++) {
+      const ply_property &pr = el.props[k];
+      if (pr.count_size == 0) {
+        ix = (pr.name == "x") ? k : ix;
+        iy = (pr.name == "y") ? k : iy;
+        iz = (pr.name == "z") ? k : iz;
+      }
+      else if (pr.name == "vertex_indices" || pr.name == "vertex_index")
+        il = k;
+    }
+    if ((vert && (ix == el.props.size() || iy == el.props.size() || iz == el.props.size())) ||
+        (face && il == el.props.size()))
+      return false;
+
+    if (vert && r == 0 && binary && little_endian() && sizeof(vec) == 3 * sizeof(double) &&
+        el.props.size() == 3 && ix == 0 && iy == 1 && iz == 2 &&
+        el.props[0].size == 8 && el.props[1].size == 8 && el.props[2].size == 8 &&
+        el.props[0].kind == 'f' && el.props[1].kind == 'f' && el.props[2].kind == 'f') {
+      if ((size_t) (end - p) / 24 < el.count)
+        return truncated();
+      const size_t n0 = m.points.size();
+      m.points.resize(n0 + el.count);
+      memcpy((void *) (m.points.data() + n0), p, 24 * el.count);
+      p += 24 * el.count;
+      vertices = m.points.size();
+      continue;
+    }
+
+    std::vector<size_t> poly;
+    for ( ; r < el.count ; r++) {
+      if (face && m.triangles.size() >= max_facets)
+        return true;
+      if (!binary && !mi->next_line())
+        return false;
+      vec v;
+      poly.clear();
+      for (size_t k = 0 ; k < el.props.size() ; k++) {
+        const ply_property &pr = el.props[k];
+        double c = 1, x;
+        if (pr.count_size && (!get(pr.count_size, pr.count_kind, c) || c < 0))
+          return false;
+        for (size_t j = 0 ; j < (size_t) c ; j++) {
+          if (!get(pr.size, pr.kind, x))
+            return false;
+          if (k == ix)
+            v.x = x;
+          else if (k == iy)
+            v.y = x;
+          else if (k == iz)
+            v.z = x;
+          else if (k == il) {
+            if (x < 0 || x >= vertices)
+              return false;
+            poly.push_back(x);
+          }
+        }
+      }
+      if (vert)
+        m.add_point(v);
+      else if (face && poly.size() == 3)
+        m.add_triangle({poly[0], poly[1], poly[2]});
+      else if (face)
+        m.add_polygon(poly);
+    }
+    if (vert)
+      vertices = m.points.size();
+  }
+  if (binary)
+    mi->seek(p - mi->content(), mi->line_count);
+  return true;
+}
+
+/** Reads a whole mesh in PLY format, see ply_reader.
+  @return False if the file cannot be read.
+*/
+static bool read_ply(mapped_input &mi, mesh &m)
+{
+  ply_reader pr(mi);
+  return pr.ok && pr.read(m, SIZE_MAX);
+}
+
+/** The coordinates of a vertex of an STL file, used to weld equal vertices. */
+class stl_vertex
+{
+public:
+  uint32_t x, y, z; /**< The bits of the coordinates. */
+
+  bool operator==(const stl_vertex &v) const
+  { return x == v.x && y == v.y && z == v.z; }
+};
+
+/** a class to hash STL vertices. */
+class hash_stl_vertex {
+public:
+  size_t operator()(const stl_vertex &v) const
+  { return ((v.x * 0x9e3779b97f4a7c15ULL) ^ v.y) * 0x9e3779b97f4a7c15ULL ^ v.z; }
+};
+
+/** True if the file has the size of a binary STL file with the number of facets it gives. */
+static bool stl_binary(const mapped_input &mi)
+{
+  return mi.size() >= 84 && mi.size() == 84 + 50 * (size_t) get_le<uint32_t>(mi.content() + 80);
+}
+
+/** Reads a mesh in binary STL format from a file mapped in memory.
+  Vertices with exactly the same coordinates are welded into one vertex of the mesh.
+  The normals are ignored, the orientation is given by the order of the vertices.
+*/
+static void read_stl(mapped_input &mi, mesh &m)
+{
+  const size_t n = get_le<uint32_t>(mi.content() + 80);
+  std::unordered_map<stl_vertex, size_t, hash_stl_vertex> index;
+  index.reserve(n / 2 + 3);
+  m.triangles.reserve(n);
+  const char *p = mi.content() + 84;
+  for (size_t i = 0 ; i < n ; i++, p += 50) {
+    size_t t[3];
+    for (int j = 0 ; j < 3 ; j++) {
+      float c[3];
+      stl_vertex v;
+      for (int k = 0 ; k < 3 ; k++)
+        c[k] = get_le<float>(p + 12 * (j + 1) + 4 * k) + 0.0f; // -0 becomes 0
+      memcpy(&v.x, c, 4);
+      memcpy(&v.y, c + 1, 4);
+      memcpy(&v.z, c + 2, 4);
+      const auto r = index.insert({v, m.points.size()});
+      if (r.second)
+        m.add_point({c[0], c[1], c[2]});
+      t[j] = r.first->second;
+    }
+    m.add_triangle({t[0], t[1], t[2]});
+  }
+  mi.seek(mi.size(), mi.line_count);
+}
+
+/** The binary format of a mapped file, mesh_format::off if it is neither PLY nor binary STL. */
+static mesh_format mapped_format(const mapped_input &mi)
+{
+  if (mi.size() >= 4 && memcmp(mi.content(), "ply", 3) == 0 &&
+      (mi.content()[3] == '\n' || mi.content()[3] == '\r'))
+    return mesh_format::ply;
+  if (stl_binary(mi))
+    return mesh_format::stl;
+  return mesh_format::off;
+}
+
+/** True if the input is a PLY or binary STL file, which can be read as a mesh.
+  The input should be at its beginning, the standard input is never recognized.
+*/
+bool is_ply_or_stl(smart_input &is)
+{
+  size_t lines;
+  if (is.tell(lines) != 0)
+    return false;
+  mapped_input mi(is.name);
+  return mi && mapped_format(mi) != mesh_format::off;
+}
+
+/** The format of a mesh file given by its extension: .ply, .stl or OFF for others. */
+mesh_format mesh_format_of(const std::string &filename)
+{
+  const size_t dot = filename.rfind('.');
+  if (dot == std::string::npos)
+    return mesh_format::off;
+  std::string ext = filename.substr(dot + 1);
+  for (auto &c: ext)
+    c = tolower(c);
+  if (ext == "ply")
+    return mesh_format::ply;
+  if (ext == "stl")
+    return mesh_format::stl;
+  if (ext == "xyz")
+    return mesh_format::xyz;
+  if (ext == "xyzb")
+    return mesh_format::xyzb;
+  return mesh_format::off;
+}
+
+/** Writes a mesh in binary little endian PLY format.
+  Coordinates are written in double precision.
+*/
+static void write_ply(std::ostream &os, const mesh &m, const std::vector<std::string> &comments)
+{
+  os << "ply\nformat binary_little_endian 1.0\n";
+  for (auto &c: comments)
+    os << "comment " << c << "\n";
+  os << "element vertex " << m.points.size() << "\n"
+     << "property double x\nproperty double y\nproperty double z\n"
+     << "element face " << m.triangles.size() << "\n"
+     << "property list uchar uint vertex_indices\n"
+     << "end_header\n";
+  std::string buf;
+  buf.reserve(binary_buffer_size + 32);
+  for (auto &pt: m.points) {
+    put_le(buf, pt.x);
+    put_le(buf, pt.y);
+    put_le(buf, pt.z);
+    if (buf.size() >= binary_buffer_size) {
+      os.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  for (auto &t: m.triangles) {
+    put_le<uint8_t>(buf, 3);
+    put_le<uint32_t>(buf, t.i1);
+    put_le<uint32_t>(buf, t.i2);
+    put_le<uint32_t>(buf, t.i3);
+    if (buf.size() >= binary_buffer_size) {
+      os.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  os.write(buf.data(), buf.size());
+}
+
+/** Writes a mesh in binary STL format.
+  Coordinates are written in single precision, the first comment is put in the header.
+*/
+static void write_stl(std::ostream &os, const mesh &m, const std::vector<std::string> &comments)
+{
+  std::string buf = (comments.empty()) ? "" : comments.front();
+  buf.resize(80, 0);
+  put_le<uint32_t>(buf, m.triangles.size());
+  for (auto &tm: m.triangles) {
+    const triangle t = tm.get_triangle(m);
+    const vec n = cross(t.p2 - t.p1, t.p3 - t.p1);
+    const double l = n.length();
+    for (const vec &v: {(l > 0) ? n / l : n, t.p1, t.p2, t.p3}) {
+      put_le<float>(buf, v.x);
+      put_le<float>(buf, v.y);
+      put_le<float>(buf, v.z);
+    }
+    put_le<uint16_t>(buf, 0);
+    if (buf.size() >= binary_buffer_size) {
+      os.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  os.write(buf.data(), buf.size());
+}
+
+/** Version of the XYZB format. */
+const uint32_t xyzb_version = 1;
+
+/** Size of the header of the XYZB format, including the line "XYZB". */
+const size_t xyzb_header_size = 21;
+
+/** Writes the points of a cloud in XYZ format, or in XYZB format if binary (see point_stream).
+  Text is written with the precision of the stream.
+  @param comments Lines written as comments before the name of the format.
+*/
+void write_points(std::ostream &os, const cloud &c, bool binary, const std::vector<std::string> &comments)
+{
+  for (auto &cm: comments)
+    os << "# " << cm << "\n";
+  if (!binary) {
+    os << "XYZ\n" << c.points.size() << "\n";
+    text_buffer b(os);
+    for (auto &pt: c.points)
+      b << pt.x << ' ' << pt.y << ' ' << pt.z << '\n';
+    return;
+  }
+  std::string buf = "XYZB\n";
+  buf.reserve(binary_buffer_size + 32);
+  put_le<uint32_t>(buf, xyzb_version);
+  put_le<uint32_t>(buf, 0);
+  put_le<uint64_t>(buf, c.points.size());
+  for (auto &pt: c.points) {
+    put_le(buf, pt.x);
+    put_le(buf, pt.y);
+    put_le(buf, pt.z);
+    if (buf.size() >= binary_buffer_size) {
+      os.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  os.write(buf.data(), buf.size());
+}
+
+/** Writes a mesh in the given format.
+  @param comments Lines written as comments (in the header for STL, truncated to 80 characters).
+*/
+void write_mesh(std::ostream &os, const mesh &m, mesh_format f, const std::vector<std::string> &comments, int nt)
+{
+  if (f == mesh_format::ply)
+    write_ply(os, m, comments);
+  else if (f == mesh_format::stl)
+    write_stl(os, m, comments);
+  else if (f == mesh_format::xyz || f == mesh_format::xyzb)
+    write_points(os, m, f == mesh_format::xyzb, comments);
+  else {
+    for (auto &c: comments)
+      os << "# " << c << "\n";
+    write_off(os, m, nt);
+  }
+}
+
+/** Reads a mesh in OFF, PLY or binary STL format.
+  Files are mapped in memory and parsed in place (see mapped_input),
+  other inputs like the standard input are read line by line in OFF format.
+*/
 smart_input &operator >>(smart_input &is, mesh &m)
 {
+  size_t lines;
+  const std::streamoff pos = is.tell(lines);
+  if (pos >= 0) {
+    mapped_input mi(is.name, pos, lines);
+    if (mi) {
+      mesh m0;
+      const mesh_format f = (pos == 0) ? mapped_format(mi) : mesh_format::off;
+      bool ok = true;
+      if (f == mesh_format::ply)
+        ok = read_ply(mi, m0);
+      else if (f == mesh_format::stl)
+        read_stl(mi, m0);
+      else
+        ok = read_off(mi, m0, is.threads);
+      is.seek(mi.tell(), mi.line_count);
+      if (ok)
+        m = m0;
+      else if (mi.eof())
+        is.input->setstate(std::ios_base::eofbit | std::ios_base::failbit);
+      else
+        is.failed();
+      return is;
+    }
+  }
   mesh m0;
   std::istringstream s;
   if (!is.next_line(s)) //remove first line containing "OFF"
@@ -422,15 +1526,409 @@ smart_input &operator >>(smart_input &is, mesh &m)
   return is;
 }
 
+/** Constructor, reads the vertices.
+  @param in The input, at the start of a mesh in OFF, PLY or binary STL format.
+  It is marked as failed in case of error.
+  @param batch_size The number of facets of a batch.
+*/
+facet_stream::facet_stream(smart_input &in, size_t batch_size):
+facets(0), given(0), is(in), batch(batch_size), format(mesh_format::off),
+start(0), start_lines(0), next_facet(0)
+{
+  size_t lines;
+  const std::streamoff pos = is.tell(lines);
+  if (pos >= 0) {
+    mi.reset(new mapped_input(is.name, pos, lines));
+    if (!*mi)
+      mi.reset();
+  }
+  if (!mi) {
+    std::istringstream s;
+    if (!is.next_line(s) || !is.next_line(s)) // first line contains "OFF"
+      return;
+    size_t n_points, dummy;
+    s >> n_points >> facets >> dummy;
+    if (!s) {
+      is.failed();
+      return;
+    }
+    for (size_t i = 0 ; i < n_points && is ; i++)
+      m.read_point(is);
+    return;
+  }
+
+  format = (pos == 0) ? mapped_format(*mi) : mesh_format::off;
+  if (format == mesh_format::stl) {
+    read_stl(*mi, m);
+    all.swap(m.triangles);
+    facets = all.size();
+  }
+  else if (format == mesh_format::ply) {
+    ply.reset(new ply_reader(*mi));
+    if (!ply->ok || !ply->read(m, 0)) {
+      failed();
+      return;
+    }
+    facets = ply->facets();
+    ply_start.reset(new ply_reader(*ply));
+  }
+  else {
+    size_t n_points, dummy;
+    if (!mi->next_line() || !mi->next_line() || !mi->read(n_points) || !mi->read(facets) || !mi->read(dummy)) {
+      failed();
+      return;
+    }
+    m.points.reserve(std::min(n_points, mi->size() / 6));
+    for (size_t i = 0 ; i < n_points ; i++) {
+      vec v;
+      if (!mi->next_line() || !read_off_point(*mi, v)) {
+        failed();
+        return;
+      }
+      m.add_point(v);
+    }
+  }
+  start = mi->tell();
+  start_lines = mi->line_count;
+}
+
+facet_stream::~facet_stream()
+{}
+
+/** True if facets remain to be read. */
+bool facet_stream::more() const
+{
+  if (format == mesh_format::ply)
+    return !ply->done();
+  if (format == mesh_format::stl)
+    return next_facet < all.size();
+  return next_facet < facets;
+}
+
+/** Marks the input as failed at the position reached in the mapped file, like operator>>.
+  @return False.
+*/
+bool facet_stream::failed()
+{
+  is.seek(mi->tell(), mi->line_count);
+  if (mi->eof())
+    is.input->setstate(std::ios_base::eofbit | std::ios_base::failbit);
+  else
+    is.failed();
+  return false;
+}
+
+/** Reads the next batch of facets into m.triangles.
+  @return False at the end of the facets or in case of error, see the input.
+*/
+bool facet_stream::next()
+{
+  m.triangles.clear();
+  while (is && m.triangles.empty() && more()) {
+    if (!mi)
+      for ( ; next_facet < facets && m.triangles.size() < batch && is ; next_facet++)
+        m.read_triangle(is);
+    else if (format == mesh_format::stl) {
+      const size_t n = std::min(batch, all.size() - next_facet);
+      m.triangles.assign(all.begin() + next_facet, all.begin() + next_facet + n);
+      next_facet += n;
+    }
+    else if (format == mesh_format::ply) {
+      if (!ply->read(m, batch))
+        return failed();
+    }
+    else
+      for ( ; next_facet < facets && m.triangles.size() < batch ; next_facet++) {
+        t_mesh t;
+        if (!mi->next_line() || !read_off_triangle(*mi, t))
+          return failed();
+        m.add_triangle(t);
+      }
+  }
+  if (!is)
+    return false;
+  if (m.triangles.empty()) {
+    if (mi)
+      is.seek(mi->tell(), mi->line_count);
+    return false;
+  }
+  given += m.triangles.size();
+  return true;
+}
+
+/** Goes back to the first facet.
+  @return False if it is not possible, on the standard input.
+*/
+bool facet_stream::rewind()
+{
+  if (!can_rewind())
+    return false;
+  if (ply)
+    *ply = *ply_start;
+  mi->seek(start, start_lines);
+  is.clear();
+  next_facet = 0;
+  given = 0;
+  return true;
+}
+
+/** Constructor, reads the header.
+  @param in The input, at the start of a cloud in XYZ, XYZW or XYZB format.
+  It is marked as failed in case of error.
+  @param batch_size The number of points of a batch.
+*/
+point_stream::point_stream(smart_input &in, size_t batch_size):
+points(0), given(0), weighted(false), weight(0), radius(0),
+is(in), batch(batch_size), binary(false), pos(0), lines(0)
+{
+  std::istringstream s;
+  std::string tag;
+  if (!is.peek_line(s) || !(s >> tag))
+    return;
+  binary = tag == "XYZB";
+  weighted = tag == "XYZW" || tag == "xyzw";
+  const std::streamoff start = is.tell(lines);
+  if (start >= 0) {
+    mi.reset(new mapped_input(is.name, start, lines));
+    if (!*mi)
+      mi.reset();
+  }
+
+  if (binary) {
+    char head[xyzb_header_size];
+    if (mi) {
+      if (mi->size() < (size_t) start + xyzb_header_size) {
+        is.input->setstate(std::ios_base::eofbit | std::ios_base::failbit);
+        return;
+      }
+      memcpy(head, mi->content() + start, xyzb_header_size);
+    }
+    else {
+      is.next_line(s); // the line with the name of the format
+      memcpy(head, "XYZB\n", 5);
+      if (!is.input->read(head + 5, xyzb_header_size - 5))
+        return;
+    }
+    const uint32_t w = get_le<uint32_t>(head + 9);
+    if (memcmp(head, "XYZB\n", 5) != 0 || get_le<uint32_t>(head + 5) != xyzb_version || w > 1) {
+      is.failed();
+      return;
+    }
+    weighted = w == 1;
+    points = get_le<uint64_t>(head + 13);
+    pos = start + xyzb_header_size;
+    lines++;
+    return;
+  }
+
+  if (!mi) {
+    if (is.next_line(s) && is.next_line(s) && !(s >> points))
+      is.failed();
+    return;
+  }
+  if (!mi->next_line() || !mi->next_line() || !mi->read(points))
+    failed();
+}
+
+point_stream::~point_stream()
+{}
+
+/** Marks the input as failed at the position reached in the mapped file, like operator>>.
+  @return False.
+*/
+bool point_stream::failed()
+{
+  if (binary) {
+    is.input->setstate(std::ios_base::eofbit | std::ios_base::failbit);
+    return false;
+  }
+  is.seek(mi->tell(), mi->line_count);
+  if (mi->eof())
+    is.input->setstate(std::ios_base::eofbit | std::ios_base::failbit);
+  else
+    is.failed();
+  return false;
+}
+
+/** Reads the next batch of points into c.
+  @return False at the end of the points or in case of error, see the input.
+*/
+bool point_stream::next()
+{
+  c.points.clear();
+  const size_t n = std::min(batch, points - given);
+  if (!is || n == 0) {
+    if (is && mi && binary)
+      is.seek(pos, lines);
+    else if (is && mi)
+      is.seek(mi->tell(), mi->line_count);
+    return false;
+  }
+  c.points.reserve(n);
+  const size_t values = weighted ? 4 : 3;
+  if (binary) {
+    const size_t size = n * values * sizeof(double);
+    std::string buf;
+    const char *p;
+    if (mi) {
+      if (mi->size() - (size_t) pos < size)
+        return failed();
+      p = mi->content() + pos;
+    }
+    else {
+      buf.resize(size);
+      if (!is.input->read(&buf[0], size))
+        return false;
+      p = buf.data();
+    }
+    for (size_t i = 0 ; i < n ; i++, p += values * sizeof(double)) {
+      const vec v = {get_le<double>(p), get_le<double>(p + 8), get_le<double>(p + 16)};
+      c.add_point({weighted ? get_le<double>(p + 24) : 1, v});
+    }
+    if (mi) {
+      pos += size;
+      mi->release(pos);
+    }
+  }
+  else if (mi) {
+    for (size_t i = 0 ; i < n ; i++) {
+      w_vec w = {1, {0, 0, 0}};
+      if (!mi->next_line() || !read_off_point(*mi, w.v) || (weighted && !mi->read(w.weight)))
+        return failed();
+      c.add_point(w);
+    }
+    mi->release(mi->tell());
+  }
+  else {
+    std::istringstream s;
+    for (size_t i = 0 ; i < n && is.next_line(s) ; i++) {
+      w_vec w = {1, {0, 0, 0}};
+      s >> w.v;
+      if (weighted)
+        s >> w.weight;
+      if (!s) {
+        is.failed();
+        return false;
+      }
+      c.add_point(w);
+    }
+    if (!is)
+      return false;
+  }
+  given += c.points.size();
+  for (auto &p: c.points) {
+    weight += p.weight;
+    radius = std::max(radius, p.v.length());
+  }
+  return true;
+}
+
+/** Number of vertex or facet lines formatted by each task of write_off. */
+const size_t off_lines_by_task = 1 << 15;
+
+/** Writes a mesh in OFF format, with the precision of the stream.
+  The lines are formatted by text_buffer. With several threads, groups of lines are
+  formatted in parallel, then written in order, a few groups by thread at a time.
+*/
+void write_off(std::ostream &os, const mesh &m, int nt)
+{
+  os << "OFF\n";
+  os << m.points.size() << " " << m.triangles.size() << " " << 0 << "\n";
+  const size_t np = m.points.size(), lines = np + m.triangles.size();
+  auto format = [&](text_buffer &b, size_t from, size_t to) {
+    for (size_t i = from ; i < to ; i++)
+      if (i < np) {
+        const vec &pt = m.points[i];
+        b << pt.x << ' ' << pt.y << ' ' << pt.z << '\n';
+      }
+      else {
+        const t_mesh &t = m.triangles[i - np];
+        b << "3 " << t.i1 << ' ' << t.i2 << ' ' << t.i3 << '\n';
+      }
+  };
+  if (nt <= 1 || lines <= off_lines_by_task) {
+    text_buffer b(os);
+    format(b, 0, lines);
+    return;
+  }
+  const size_t tasks = (lines + off_lines_by_task - 1) / off_lines_by_task;
+  const size_t group = 4 * nt;
+  for (size_t g = 0 ; g < tasks ; g += group) {
+    std::vector<std::string> parts(std::min(group, tasks - g));
+    parallel_eval<std::string>(nt, parts, [&](size_t i) {
+        text_buffer b(os, false);
+        const size_t from = (g + i) * off_lines_by_task;
+        format(b, from, std::min(lines, from + off_lines_by_task));
+        return b.str();
+      });
+    for (auto &p: parts)
+      os.write(p.data(), p.size());
+  }
+}
+
 /** Writes a mesh in OFF format. */
 std::ostream &operator <<(std::ostream &os, const mesh &m)
 {
-  os << "OFF" << std::endl;
-  os << m.points.size() << " " << m.triangles.size() << " " << 0 << std::endl;
-  for (auto &pt: m.points)
-    os << pt << std::endl;
-  for (auto &t: m.triangles)
-    os << 3 << " " << t << std::endl;
+  write_off(os, m);
+  return os;
+}
+
+/** The radius of the solid (from the origin). */
+double profile::radius() const
+{
+  double r = 0;
+  for (auto &pt: points)
+    r = std::max(r, pt.length());
+  return r;
+}
+
+/** The volume of the solid, by the theorem of Pappus.
+  It is negative if the profile turns clockwise in the (r, z) plane.
+*/
+double profile::volume() const
+{
+  double v = 0;
+  for (size_t i = 0 ; i < points.size() ; i++) {
+    const vec &a = points[i], &b = points[(i + 1) % points.size()];
+    v += (a.x * b.z - b.x * a.z) * (a.x + b.x);
+  }
+  return M_PI * v / 3;
+}
+
+/** Reads a profile in REV format: a line with REV, a line with the number of vertices,
+  then one line by vertex with its r and z coordinates.
+*/
+smart_input &operator >>(smart_input &is, profile &p)
+{
+  profile p0;
+  std::istringstream s;
+  if (!is.next_line(s)) // remove first line containing "REV"
+    return is;
+  if (!is.next_line(s))
+    return is;
+  size_t n_points;
+  s >> n_points;
+  if (!s)
+    return is.failed();
+  for (size_t i = 0 ; i < n_points && is.next_line(s) ; i++) {
+    double r, z;
+    s >> r >> z;
+    if (!s)
+      return is.failed();
+    p0.add_point(r, z);
+  }
+  if (is)
+    p = p0;
+  return is;
+}
+
+/** Writes a profile in REV format. */
+std::ostream &operator <<(std::ostream &os, const profile &p)
+{
+  os << "REV" << std::endl;
+  os << p.points.size() << std::endl;
+  for (auto &pt: p.points)
+    os << pt.x << " " << pt.z << std::endl;
   return os;
 }
 
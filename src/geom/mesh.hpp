@@ -6,6 +6,7 @@
 #define MESH_HPP
 
 #include <functional>
+#include <memory>
 #include "iotools.hpp"
 #include "triangle.hpp"
 
@@ -89,6 +90,25 @@ public:
   size_t count, border, strange, bad_orient;
 };
 
+/** A finite group of orthogonal transformations, used for the symmetries of meshes.
+  Elements are stored as matrices, reflections having a negative determinant.
+*/
+class symmetry_group
+{
+public:
+  std::vector<mat> elements; /**< The elements, starting with the identity. */
+
+  symmetry_group(): elements(1, mat_id) {}
+
+  /** Number of elements. */
+  size_t size() const
+  { return elements.size(); }
+
+  bool contains(const mat &g) const;
+  bool add_generator(const mat &g);
+  std::string add_generators(const std::string &spec);
+};
+
 /** A triangular mesh. */
 class mesh: public cloud
 {
@@ -118,12 +138,151 @@ public:
   void read_triangle(smart_input &is);
   void add(const mesh &m);
   mesh split() const;
+  mesh merge_coplanar(double tol = 1e-9) const;
+  std::vector<mesh> components() const;
+  bool facet_permutation(const mat &g, double tol, std::vector<size_t> &perm) const;
+  symmetry_group symmetries(double tol = 1e-9) const;
   edge_report edges() const;
 };
 
 smart_input &operator >>(smart_input &is, mesh &m);
 std::ostream &operator <<(std::ostream &os, const mesh &m);
 
+/** File formats of meshes: text OFF, binary little endian PLY and binary STL.
+  Meshes are read in any of them (PLY also in ascii), see operator>>.
+  Formats XYZ and XYZB only keep the vertices, as a cloud of points (see point_stream).
+*/
+enum class mesh_format {off, ply, stl, xyz, xyzb};
+
+mesh_format mesh_format_of(const std::string &filename);
+bool is_ply_or_stl(smart_input &is);
+void write_off(std::ostream &os, const mesh &m, int nt = 1);
+void write_mesh(std::ostream &os, const mesh &m, mesh_format f, const std::vector<std::string> &comments = {}, int nt = 1);
+void write_points(std::ostream &os, const cloud &c, bool binary, const std::vector<std::string> &comments = {});
+
+class ply_reader;
+
+/** Reads the facets of a mesh by batches, once all its vertices are read.
+
+  Only the vertices and one batch of facets are kept in memory. OFF and PLY files are
+  mapped in memory (see mapped_input) and their facets parsed batch by batch, the
+  standard input is read line by line in OFF format. Binary STL files give the
+  vertices with the facets, they are read whole then given by batches.
+
+  Usage:
+    1. create one instance on an input at the start of a mesh, it reads the vertices.
+    2. call facet_stream::next until it returns false, each call gives a batch of facets in m.triangles.
+    3. check the input with input_error: errors are reported there as by operator>>.
+    4. use facet_stream::rewind to read the facets again, if possible.
+*/
+class facet_stream
+{
+public:
+  mesh m;        /**< The vertices of the mesh, and the facets of the current batch. */
+  size_t facets; /**< Number of facets given by the header, collapsed facets included. */
+  size_t given;  /**< Number of facets given so far, collapsed facets excluded. */
+
+  facet_stream(smart_input &in, size_t batch_size = 1 << 16);
+  ~facet_stream();
+  facet_stream(const facet_stream &) = delete;
+  facet_stream &operator=(const facet_stream &) = delete;
+
+  bool next();
+  bool rewind();
+
+  /** Expected number of batches, for progression bars. */
+  size_t batches() const
+  { return (facets + batch - 1) / batch; }
+
+  /** True if the facets can be read again (not on the standard input). */
+  bool can_rewind() const
+  { return mi != nullptr; }
+
+private:
+  smart_input &is;
+  size_t batch;
+  mesh_format format;
+  std::unique_ptr<mapped_input> mi;
+  std::unique_ptr<ply_reader> ply, ply_start; /**< The PLY reader, and a copy of it at the first facet. */
+  std::streamoff start;   /**< Position of the first facet. */
+  size_t start_lines;     /**< Number of lines before start. */
+  size_t next_facet;      /**< Number of facet records read in OFF and STL formats. */
+  std::vector<t_mesh> all; /**< All the facets of an STL file. */
+
+  bool more() const;
+  bool failed();
+};
+
+/** Reads the points of a cloud by batches, so that clouds of any size can be integrated.
+
+  Each format starts with a line giving its name:
+    - XYZ: a line with the number of points, then one point by line: x y z.
+    - XYZW: the same with the weight of each point after its coordinates: x y z w.
+    - XYZB: binary, little endian numbers following the line: the version (uint32, 1),
+    1 if the points are weighted and 0 otherwise (uint32), the number of points (uint64),
+    then the coordinates of each point, followed by its weight if weighted (doubles).
+  Files are mapped in memory (see mapped_input) and the part already read is given back to
+  the system, other inputs (like the standard input) are read directly. Only one batch of
+  points is kept in memory.
+
+  Usage:
+    1. create one instance on an input at the start of a cloud, it reads the header.
+    2. call point_stream::next until it returns false, each call gives a batch of points in c.
+    3. check the input with input_error: errors are reported there as by operator>>.
+*/
+class point_stream
+{
+public:
+  w_cloud c;       /**< The points of the current batch, of weight one if they are not weighted. */
+  size_t points;   /**< Number of points given by the header. */
+  size_t given;    /**< Number of points given so far. */
+  bool weighted;   /**< True if the points have weights. */
+  double weight;   /**< Sum of the weights of the points given so far. */
+  double radius;   /**< Radius of the points given so far (from the origin). */
+
+  point_stream(smart_input &in, size_t batch_size = 1 << 16);
+  ~point_stream();
+  point_stream(const point_stream &) = delete;
+  point_stream &operator=(const point_stream &) = delete;
+
+  bool next();
+
+  /** Expected number of batches, for progression bars. */
+  size_t batches() const
+  { return (points + batch - 1) / batch; }
+
+private:
+  smart_input &is;
+  size_t batch;
+  bool binary;
+  std::unique_ptr<mapped_input> mi;
+  std::streamoff pos;  /**< Position of the next point in a mapped binary file. */
+  size_t lines;        /**< Number of lines before the data of a mapped binary file. */
+
+  bool failed();
+};
+
+/** A solid of revolution around the z axis, given by its profile.
+  The profile is a closed polygon in the half plane y = 0, x >= 0, the last vertex being
+  joined to the first. Edges lying on the z axis add nothing, so a polyline going from
+  the axis back to the axis describes the solid bounded by its surface of revolution.
+*/
+class profile
+{
+public:
+  std::vector<vec> points; /**< The vertices, as (r, 0, z). */
+
+  /** Adds a vertex to the profile. */
+  void add_point(double r, double z)
+  { points.push_back({r, 0, z}); }
+
+  double radius() const;
+  double volume() const;
+};
+
+smart_input &operator >>(smart_input &is, profile &p);
+std::ostream &operator <<(std::ostream &os, const profile &p);
+
 mesh make_cube();
 mesh make_tetrahedron();
 mesh make_icosahedron();
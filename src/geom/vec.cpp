@@ -55,6 +55,32 @@ mat rotation_mat(const vec &v, double angle)
   return c * mat_id + (1 - c) * dot_mat(v, v) + s * cross_mat(v);
 }
 
+/** The axis and angle of a rotation, the inverse of rotation_mat.
+  @param m A rotation matrix.
+  @return The unit axis in v and the angle (between 0 and pi) in weight.
+*/
+w_vec rotation_axis(const mat &m)
+{
+  const vec a = 0.5 * vec(m.mz.y - m.my.z, m.mx.z - m.mz.x, m.my.x - m.mx.y);
+  const double c = 0.5 * (m.mx.x + m.my.y + m.mz.z - 1);
+  const double s = a.length();
+  if (s == 0 && c > 0)
+    return {0, {0, 0, 1}};
+  if (c > -0.5)
+    return {atan2(s, c), (1 / s) * a};
+  // close to a half turn, the axis is taken from the symmetric part
+  const vec d = {m.mx.x - c, m.my.y - c, m.mz.z - c};
+  vec u = {m.mx.x - c, 0.5 * (m.mx.y + m.my.x), 0.5 * (m.mx.z + m.mz.x)};
+  if (d.y >= d.x && d.y >= d.z)
+    u = {0.5 * (m.my.x + m.mx.y), m.my.y - c, 0.5 * (m.my.z + m.mz.y)};
+  else if (d.z >= d.x)
+    u = {0.5 * (m.mz.x + m.mx.z), 0.5 * (m.mz.y + m.my.z), m.mz.z - c};
+  u.normalize();
+  if (dot(u, a) < 0)
+    u = -1 * u;
+  return {atan2(s, c), u};
+}
+
 /** Spherical coordinates representation. */
 s_vec vec::spherical() const
 {
@@ -84,6 +84,8 @@ inline mat operator - (const mat &m1, const mat &m2)
 inline mat operator * (double scalar, const mat &m)
 { return { scalar * m.mx, scalar * m.my, scalar * m.mz}; }
 
+mat operator * (const mat &m1, const mat &m2);
+
 extern const mat mat_id;
 
 mat diag_mat(const vec &v);
@@ -98,6 +100,8 @@ public:
   vec v;
 };
 
+w_vec rotation_axis(const mat &m);
+
 std::ostream& operator<<(std::ostream& os, const w_vec &v);
 std::istream& operator>>(std::istream& is, w_vec &v);
 
@@ -0,0 +1,31 @@
+/** \file check_approx.cpp
+  Checks that mesh_approx_integrate gives the same result with 0 and 1 threads.
+  \author J. Houdayer
+*/
+
+#include "moments.hpp"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) {
+    cerr << "Usage: CheckApprox FILE.off" << endl;
+    return 1;
+  }
+  mesh m;
+  const string err = read_file(argv[1], m);
+  if (!err.empty()) {
+    cerr << err << endl;
+    return 1;
+  }
+  const triquad_selector ts;
+  approx_report r0, r1;
+  const zernike z0 = mesh_approx_integrate(m, 20, 1e-7, ts, 0, false, &r0);
+  const zernike z1 = mesh_approx_integrate(m, 20, 1e-7, ts, 1, false, &r1);
+  cout << setprecision(10);
+  cout << "Refinements with 0 threads: " << r0.refinements << ", with 1 thread: " << r1.refinements << "\n";
+  cout << "Error: " << sqrt(z0.variance) << "\n";
+  cout << "Same result: " << ((z0.get_zm() == z1.get_zm() && r0.refinements == r1.refinements) ? "yes" : "no") << "\n";
+  return 0;
+}
@@ -0,0 +1,72 @@
+/** \file check_gradient.cpp
+  Checks mesh_moment_gradient against finite differences.
+  The function differentiated is half the sum of the squares of the raw moments.
+  \author J. Houdayer
+*/
+
+#include "moments.hpp"
+
+using namespace std;
+
+/** The raw moments of a mesh, with their unused elements cleared. */
+static zernike raw_moments(const mesh &m, int n, const triquad_selector &ts)
+{
+  zernike z = mesh_exact_integrate(m, n, ts, 1, false, mesh_engine::quadrature);
+  z.normalize(zm_norm::raw);
+  z.finish();
+  return z;
+}
+
+/** Half the sum of the squares of the raw moments of a mesh. */
+static double half_square(const mesh &m, int n, const triquad_selector &ts)
+{
+  const zernike z = raw_moments(m, n, ts);
+  double f = 0;
+  for (auto x: z.get_zm())
+    f += x * x / 2;
+  return f;
+}
+
+/** Coordinate c of a vector. */
+static double coord(const vec &p, int c)
+{
+  return (c == 0) ? p.x : (c == 1) ? p.y : p.z;
+}
+
+/** Moves a vertex of a mesh along coordinate c. */
+static mesh moved(const mesh &m, size_t v, int c, double h)
+{
+  mesh mv = m;
+  mv.points[v] = mv.points[v] + vec(c == 0 ? h : 0, c == 1 ? h : 0, c == 2 ? h : 0);
+  return mv;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) {
+    cerr << "Usage: CheckGradient FILE.off" << endl;
+    return 1;
+  }
+  mesh m;
+  const string err = read_file(argv[1], m);
+  if (!err.empty()) {
+    cerr << err << endl;
+    return 1;
+  }
+  const triquad_selector ts;
+  const int n = 10;
+  const double h = 1e-5;
+  const vector<vec> grad = mesh_moment_gradient(m, raw_moments(m, n, ts), ts);
+  double diff = 0, norm = 0;
+  for (size_t v = 0 ; v < m.points.size() ; v++)
+    for (int c = 0 ; c < 3 ; c++) {
+      const double fd = (half_square(moved(m, v, c, h), n, ts) - half_square(moved(m, v, c, -h), n, ts)) / (2 * h);
+      diff = max(diff, abs(fd - coord(grad[v], c)));
+      norm = max(norm, abs(fd));
+    }
+  cout << setprecision(3);
+  cout << "Vertices: " << m.points.size() << ", largest derivative: " << norm << "\n";
+  cout << "Difference with finite differences " << ((diff < 1e-6 * norm) ? "below" : "above")
+       << " 1e-6 of the largest derivative\n";
+  return 0;
+}
@@ -0,0 +1,102 @@
+/** \file check_invariants.cpp
+  Checks that rotational and signature invariants read back what was written,
+  in the text ZRI and ZSI formats and in the binary ZRB and ZSB formats.
+  \author J. Houdayer
+*/
+
+#include <functional>
+#include <limits>
+#include "zernike.hpp"
+
+using namespace std;
+
+/** Writes invariants to a file in the format given by its extension, then reads them back.
+  @param name The file, ending with .zri or .zrb for rotational invariants, .zsi or .zsb for signature invariants.
+  @return A line telling whether the invariants read back are the ones written.
+*/
+template<typename T>
+string round_trip(const T &x, const string &name, bool binary, std::function<const vector<double> &(const T &)> values)
+{
+  {
+    ofstream os(name, ios::binary);
+    os << setprecision(numeric_limits<double>::max_digits10);
+    if (binary)
+      write_binary(os, x);
+    else
+      os << x;
+    if (!os)
+      return "Cannot write " + name;
+  }
+  T y;
+  const string err = read_file(name, y);
+  if (!err.empty())
+    return err;
+  ostringstream out;
+  out << "Read back: norm " << y.get_norm() << ", order " << y.order() << ", "
+      << ((y.get_norm() == x.get_norm() && y.order() == x.order() && values(y) == values(x)) ? "same" : "different")
+      << " values";
+  return out.str();
+}
+
+/** Reads invariants from a file.
+  @return A line with the error message, or the norm and order read.
+*/
+template<typename T>
+string read_only(const string &name)
+{
+  T x;
+  const string err = read_file(name, x);
+  if (!err.empty())
+    return err;
+  ostringstream out;
+  out << "Read: norm " << x.get_norm() << ", order " << x.order();
+  return out.str();
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 2) {
+    const string in = argv[1];
+    const bool si = in.size() > 4 && (in.substr(in.size() - 4) == ".zsi" || in.substr(in.size() - 4) == ".zsb");
+    cout << (si ? read_only<signature_invariants>(in) : read_only<rotational_invariants>(in)) << "\n";
+    return 0;
+  }
+  if (argc != 4) {
+    cerr << "Usage: CheckInvariants NORM FILE.zm OUT, or CheckInvariants FILE to read invariants" << endl;
+    return 1;
+  }
+  zm_norm norm;
+  istringstream s(argv[1]);
+  if (!(s >> norm)) {
+    cerr << "Unknown norm: " << argv[1] << endl;
+    return 1;
+  }
+  zernike z;
+  const string err = read_file(argv[2], z);
+  if (!err.empty()) {
+    cerr << err << endl;
+    return 1;
+  }
+  z.normalize(norm);
+  const string out = argv[3];
+  const string ext = (out.size() > 4) ? out.substr(out.size() - 4) : "";
+  if (ext == ".zri" || ext == ".zrb") {
+    rotational_invariants ri(z.order());
+    ri.eval_ri(z);
+    cout << "Wrote " << ri.get_ri().size() << " rotational invariants\n";
+    cout << round_trip<rotational_invariants>(ri, out, ext == ".zrb",
+                                              [](const rotational_invariants &r) -> const vector<double> & { return r.get_ri(); }) << "\n";
+  }
+  else if (ext == ".zsi" || ext == ".zsb") {
+    signature_invariants si(z.order());
+    si.eval_si(z);
+    cout << "Wrote " << si.get_si().size() << " signature invariants\n";
+    cout << round_trip<signature_invariants>(si, out, ext == ".zsb",
+                                             [](const signature_invariants &r) -> const vector<double> & { return r.get_si(); }) << "\n";
+  }
+  else {
+    cerr << "Unknown format: " << out << endl;
+    return 1;
+  }
+  return 0;
+}
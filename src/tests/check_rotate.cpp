@@ -0,0 +1,31 @@
+/** \file check_rotate.cpp
+  Checks that zernike::rotate refuses a rotation of too low order.
+  \author J. Houdayer
+*/
+
+#include "zernike.hpp"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) {
+    cerr << "Usage: CheckRotate FILE.zm" << endl;
+    return 1;
+  }
+  zernike z;
+  const string err = read_file(argv[1], z);
+  if (!err.empty()) {
+    cerr << err << endl;
+    return 1;
+  }
+  const mat m = rotation_mat(vec(1, 2, 3).normalize(), 0.7);
+  zernike low = z, full = z;
+  const bool low_done = low.rotate(wigner_rotation(m, z.order() - 1));
+  const bool full_done = full.rotate(wigner_rotation(m, z.order()));
+  cout << "Order " << z.order() << "\n";
+  cout << "Rotation of lower order: " << (low_done ? "done" : "refused")
+       << ", moments " << ((low.get_zm() == z.get_zm()) ? "unchanged" : "changed") << "\n";
+  cout << "Rotation of the same order: " << (full_done ? "done" : "refused") << "\n";
+  return 0;
+}
@@ -0,0 +1,49 @@
+/** \file cache.hpp
+  A thread safe cache for objects which are costly to build.
+  \author J. Houdayer
+*/
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <map>
+#include <functional>
+
+#ifndef NO_THREADS
+#include <mutex>
+#endif
+
+/** A cache of objects indexed by a key.
+
+  Objects are built on first request and kept until the cache is destroyed.
+  References returned by object_cache::get stay valid for the life of the cache.
+  It is safe to use from several threads.
+*/
+template<typename K, typename T>
+class object_cache
+{
+public:
+  /** Gets the object for the given key, building it if needed.
+    @param key The key of the object.
+    @param make Builds the object from the key, it is only called if the object is not in the cache.
+    @return The cached object.
+  */
+  const T &get(const K &key, std::function<T(const K &)> make)
+  {
+#ifndef NO_THREADS
+    std::lock_guard<std::mutex> lock(mtx);
+#endif
+    auto it = objects.find(key);
+    if (it == objects.end())
+      it = objects.insert({key, make(key)}).first;
+    return it->second;
+  }
+
+private:
+  std::map<K, T> objects;
+#ifndef NO_THREADS
+  std::mutex mtx;
+#endif
+};
+
+#endif
@@ -0,0 +1,114 @@
+/** \file exact_sum.cpp
+  Implementation of exact_sum.hpp.
+  \author J. Houdayer
+*/
+
+#include "exact_sum.hpp"
+#include <cmath>
+
+/** Constructor.
+  @param n The number of sums, all starting at 0.
+*/
+exact_sum::exact_sum(size_t n):
+acc(limbs * n, 0)
+{}
+
+/** Resets all sums to 0. */
+void exact_sum::reset()
+{
+  for (auto &a: acc)
+    a = 0;
+}
+
+/** Adds a term to sum i.
+  The term is rounded to the nearest multiple of \f$2^{-128}\f$, non finite terms are ignored.
+*/
+void exact_sum::add(size_t i, double v)
+{
+  if (v == 0 || !std::isfinite(v))
+    return;
+  int e;
+  uint64_t m = (uint64_t) ldexp(frexp(fabs(v), &e), 53);
+  int sh = e - 53 + 128; // v = m 2^(sh - 128)
+  if (sh < 0) {
+    if (sh <= -64)
+      return;
+    m = (m + ((uint64_t) 1 << (-sh - 1))) >> -sh;
+    sh = 0;
+  }
+  uint64_t w[limbs] = {0, 0, 0};
+  const int k = sh / 64, off = sh % 64;
+  if (k < limbs)
+    w[k] = m << off;
+  if (off > 0 && k + 1 < limbs)
+    w[k + 1] = m >> (64 - off);
+
+  uint64_t *a = acc.data() + limbs * i;
+  uint64_t c = 0;
+  if (v > 0)
+    for (int j = 0 ; j < limbs ; j++) {
+      const uint64_t s = a[j] + w[j];
+      const uint64_t s2 = s + c;
+      c = (s < a[j]) | (s2 < s);
+      a[j] = s2;
+    }
+  else
+    for (int j = 0 ; j < limbs ; j++) {
+      const uint64_t d = a[j] - w[j];
+      const uint64_t d2 = d - c;
+      c = (a[j] < w[j]) | (d < c);
+      a[j] = d2;
+    }
+}
+
+/** Adds a vector of terms to the first sums.
+  @param v The terms, there should not be more than the number of sums.
+  @param sign 1 to add the terms, -1 to subtract them.
+*/
+void exact_sum::add(const std::vector<double> &v, double sign)
+{
+  for (size_t i = 0 ; i < v.size() ; i++)
+    add(i, sign * v[i]);
+}
+
+/** Adds partial sums, the number of sums should be the same. */
+exact_sum &exact_sum::operator +=(const exact_sum &s)
+{
+  for (size_t i = 0 ; i + limbs <= acc.size() && i + limbs <= s.acc.size() ; i += limbs) {
+    uint64_t c = 0;
+    for (int j = 0 ; j < limbs ; j++) {
+      const uint64_t x = acc[i + j] + s.acc[i + j];
+      const uint64_t x2 = x + c;
+      c = (x < acc[i + j]) | (x2 < x);
+      acc[i + j] = x2;
+    }
+  }
+  return *this;
+}
+
+/** Value of sum i, rounded to a double. */
+double exact_sum::get(size_t i) const
+{
+  uint64_t x[limbs];
+  for (int j = 0 ; j < limbs ; j++)
+    x[j] = acc[limbs * i + j];
+  const bool neg = x[limbs - 1] >> 63;
+  if (neg) {
+    uint64_t c = 1;
+    for (int j = 0 ; j < limbs ; j++) {
+      x[j] = ~x[j] + c;
+      c = c && x[j] == 0;
+    }
+  }
+  const double r = ldexp((double) x[0], -128) + ldexp((double) x[1], -64) + (double) x[2];
+  return neg ? -r : r;
+}
+
+/** Values of all sums, rounded to doubles. */
+std::vector<double> exact_sum::get() const
+{
+  std::vector<double> v(size());
+  for (size_t i = 0 ; i < v.size() ; i++)
+    v[i] = get(i);
+  return v;
+}
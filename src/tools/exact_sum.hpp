@@ -0,0 +1,52 @@
+/** \file exact_sum.hpp
+  Exact sums of floating point numbers, independent of the order of the terms.
+  \author J. Houdayer
+*/
+
+#ifndef EXACT_SUM_HPP
+#define EXACT_SUM_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/** A vector of exact accumulators.
+
+  Each term is rounded to a multiple of \f$2^{-128}\f$, then added to a 192 bit
+  fixed point integer. Integer additions being exact, the result does not depend on
+  the order of the terms nor on the number of threads used, and subtracting a term
+  exactly cancels its addition. Sums must stay below \f$2^{63}\f$ in absolute value.
+
+  Usage:
+    1. create one instance with the number of sums needed.
+    2. use exact_sum::add (or exact_sum::sub) with the terms.
+    3. merge partial sums with exact_sum::operator+=.
+    4. get the rounded results with exact_sum::get.
+*/
+class exact_sum
+{
+public:
+  exact_sum(size_t n = 0);
+
+  /** Number of sums. */
+  size_t size() const
+  { return acc.size() / limbs; }
+
+  void reset();
+  void add(size_t i, double v);
+  void add(const std::vector<double> &v, double sign = 1);
+
+  /** Subtracts a term from sum i. */
+  void sub(size_t i, double v)
+  { add(i, -v); }
+
+  exact_sum &operator +=(const exact_sum &s);
+  double get(size_t i) const;
+  std::vector<double> get() const;
+
+private:
+  static const int limbs = 3; /**< Number of 64 bit words for each sum. */
+  std::vector<uint64_t> acc;  /**< The sums in two's complement, least significant word first. */
+};
+
+#endif
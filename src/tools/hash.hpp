@@ -0,0 +1,46 @@
+/** \file hash.hpp
+  A simple hash to identify data saved in files.
+  \author J. Houdayer
+*/
+
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/** A 64 bit FNV-1a hash, fed with integers and doubles (by their bits). */
+class fnv_hash
+{
+public:
+  uint64_t h;
+
+  fnv_hash(): h(14695981039346656037ULL) {}
+
+  fnv_hash &operator <<(uint64_t v)
+  {
+    for (int i = 0 ; i < 8 ; i++, v >>= 8) {
+      h ^= v & 0xff;
+      h *= 1099511628211ULL;
+    }
+    return *this;
+  }
+
+  fnv_hash &operator <<(double d)
+  {
+    uint64_t v;
+    memcpy(&v, &d, sizeof(v));
+    return *this << v;
+  }
+
+  fnv_hash &operator <<(const std::string &s)
+  {
+    *this << (uint64_t) s.size();
+    for (unsigned char c: s)
+      *this << (uint64_t) c;
+    return *this;
+  }
+};
+
+#endif
@@ -4,6 +4,23 @@
 */
 
 #include "iotools.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <iterator>
+#include <limits>
+#include <vector>
+#ifndef NO_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 const std::string cannot_open_msg = "Cannot open file ";
 const std::string invalid_file_msg = "Cannot read file ";
@@ -79,7 +96,7 @@ void progression::progress(const std::string &s)
  The created file is properly closed at destruction.
 */
 smart_input::smart_input(const std::string &n):
-line_count(0), name(n), input(NULL), resend(false), line(""), file(NULL)
+line_count(0), name(n), input(NULL), threads(1), resend(false), line(""), file(NULL)
 {
   if (name == "-") {
     name = "standard input";
@@ -93,7 +110,7 @@ line_count(0), name(n), input(NULL), resend(false), line(""), file(NULL)
 
 /** Make a smart_input from an istream with the given name (for error messages).*/
 smart_input::smart_input(std::istream &is, const std::string &n):
-line_count(0), name(n), input(&is), resend(false), line(""), file(NULL)
+line_count(0), name(n), input(&is), threads(1), resend(false), line(""), file(NULL)
 {}
 
 smart_input::~smart_input()
@@ -150,11 +167,481 @@ smart_input &smart_input::failed()
   return *this;
 }
 
+/** The error message for the state of an input after reading, empty if there was no error. */
+std::string input_error(const smart_input &is)
+{
+  if (is.bad())
+    return bad_file_msg + is.name + " (" + strerror(errno) + ")";
+  if (is.eof())
+    return unexpect_eof_msg + is.name;
+  if (is.fail())
+    return invalid_file_msg + is.name + " at line " + std::to_string(is.line_count);
+  return "";
+}
+
+/** Position in the file of the next line to read.
+  @param lines Receives the number of lines before this position.
+  @return The position, or -1 if it is unknown (for instance on standard input).
+*/
+std::streamoff smart_input::tell(size_t &lines) const
+{
+  if (file == NULL)
+    return -1;
+  // nothing read yet, or only the first line kept by peek_line (which may be binary data)
+  if (line_count == (resend ? 1u : 0u)) {
+    lines = 0;
+    return 0;
+  }
+  if (!*file)
+    return -1;
+  std::streamoff pos = file->tellg();
+  if (pos < 0)
+    return -1;
+  lines = line_count;
+  if (resend) {
+    // the line kept by peek_line is read again, its '\n' was replaced by the space added
+    pos -= line.size();
+    lines--;
+  }
+  return pos;
+}
+
+/** Moves to the given position in the file, which should be the start of a line.
+  @param lines The number of lines before this position.
+*/
+void smart_input::seek(std::streamoff pos, size_t lines)
+{
+  if (file == NULL)
+    return;
+  resend = false;
+  file->clear();
+  file->seekg(pos);
+  line_count = lines;
+}
+
+/** Largest integer such that all integers up to it are exact doubles. */
+static const uint64_t exact_int = (uint64_t) 1 << 53;
+
+/** Powers of ten which are exact doubles. */
+static const double exact_pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/** Number of bits of the mantissa of long double (64 on x86). */
+static const int long_digits = std::numeric_limits<long double>::digits;
+
+/** Largest integer such that all integers up to it are exact long doubles. */
+static const uint64_t exact_long_int = (long_digits >= 64) ? UINT64_MAX : (uint64_t) 1 << long_digits;
+
+/** Powers of ten which are exact long doubles (up to 10^27 on x86), those of five fitting in the mantissa. */
+static const std::vector<long double> &exact_long_pow10()
+{
+  static const std::vector<long double> pow10 = [] {
+    std::vector<long double> p(1, 1);
+    for (long double five = 5 ; five < std::ldexp(1.0L, long_digits) ; five *= 5)
+      p.push_back(p.back() * 10);
+    return p;
+  }();
+  return pow10;
+}
+
+/** Same as isspace in the C locale, without the call to the library. */
+static inline bool is_space(char c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/** True if a long double lies halfway between two consecutive doubles.
+  @param d The long double rounded to double.
+*/
+static bool halfway(long double v, double d)
+{
+  const long double r = v - d;
+  if (r == 0)
+    return false;
+  const double other = std::nextafter(d, (r > 0) ? HUGE_VAL : -HUGE_VAL);
+  return r == (other - (long double) d) / 2;
+}
+
+/** Maps a file in memory.
+  @param name The file name.
+  @param start The position to start reading from, which should be the start of a line.
+  @param lines The number of lines before this position.
+*/
+mapped_input::mapped_input(const std::string &name, std::streamoff start, size_t lines):
+line_count(lines), ok(false), at_end(false), owner(true), data(NULL), length(0), released(0),
+cur(NULL), line_end(NULL), next(NULL), end(NULL)
+{
+#ifndef NO_MMAP
+  const int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    length = st.st_size;
+    if (length == 0)
+      ok = true;
+    else {
+      void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data = (const char *) p;
+        madvise(p, length, MADV_SEQUENTIAL);
+        ok = true;
+      }
+    }
+  }
+  close(fd);
+#else
+  std::ifstream f(name, std::ios::binary);
+  std::ostringstream os;
+  os << f.rdbuf();
+  if (f) {
+    copy = os.str();
+    data = copy.data();
+    length = copy.size();
+    ok = true;
+  }
+#endif
+  if (start < 0 || (size_t) start > length)
+    ok = false;
+  if (ok) {
+    next = data + start;
+    end = data + length;
+  }
+}
+
+/** Creates a view on a part of a mapped file, which should stay alive.
+  Positions are those in the whole file.
+  @param whole The mapped file.
+  @param from The position of the first line of the part.
+  @param to The position following the last line of the part.
+  @param lines The number of lines before from.
+*/
+mapped_input::mapped_input(const mapped_input &whole, std::streamoff from, std::streamoff to, size_t lines):
+line_count(lines), ok(whole.ok), at_end(false), owner(false), data(whole.data), length(whole.length),
+released(0), cur(NULL), line_end(NULL), next(whole.data + from), end(whole.data + to)
+{}
+
+/** Reads the rest of a stream into memory, for inputs which cannot be mapped.
+  @param lines The number of lines already read from the stream.
+*/
+mapped_input::mapped_input(std::istream &is, size_t lines):
+line_count(lines), ok(false), at_end(false), owner(false), data(NULL), length(0), released(0),
+cur(NULL), line_end(NULL), next(NULL), end(NULL),
+copy(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>())
+{
+  data = copy.data();
+  length = copy.size();
+  ok = !is.bad();
+  next = data;
+  end = data + length;
+}
+
+mapped_input::~mapped_input()
+{
+#ifndef NO_MMAP
+  if (owner && length > 0 && data != NULL)
+    munmap((void *) data, length);
+#endif
+}
+
+/** Moves to the given position, which should be the start of a line.
+  @param lines The number of lines before this position.
+*/
+void mapped_input::seek(std::streamoff pos, size_t lines)
+{
+  next = data + pos;
+  line_count = lines;
+  at_end = false;
+}
+
+/** Tells the system that the part of the file before the given position will not be read again,
+  so that the memory holding it can be reclaimed. Files read in one pass then use a bounded
+  amount of memory whatever their size. It does nothing without mmap.
+*/
+void mapped_input::release(std::streamoff pos)
+{
+  if (!owner || pos <= (std::streamoff) released)
+    return;
+#ifndef NO_MMAP
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t to = std::min((size_t) pos, length) / page * page;
+  if (to > released) {
+    madvise((void *) (data + released), to - released, MADV_DONTNEED);
+    released = to;
+  }
+#endif
+}
+
+/** The position of the first line starting at or after the given position. */
+std::streamoff mapped_input::line_start(std::streamoff pos) const
+{
+  if (pos <= 0 || (size_t) pos >= length)
+    return std::max<std::streamoff>(0, std::min<std::streamoff>(pos, length));
+  if (data[pos - 1] == '\n')
+    return pos;
+  const char *nl = (const char *) memchr(data + pos, '\n', length - pos);
+  return (nl) ? nl + 1 - data : length;
+}
+
+/** Goes to the next line, ignoring empty lines and lines starting with '#'.
+  @return False at the end of the file.
+*/
+bool mapped_input::next_line()
+{
+  while (next < end) {
+    cur = next;
+    const char *nl = (const char *) memchr(cur, '\n', end - cur);
+    line_end = (nl) ? nl : end;
+    next = (nl) ? nl + 1 : end;
+    line_count++;
+    if (skip_space() && *cur != '#')
+      return true;
+  }
+  at_end = true;
+  cur = line_end = next;
+  return false;
+}
+
+/** Skips spaces in the current line.
+  @return False if nothing else is left in the line.
+*/
+bool mapped_input::skip_space()
+{
+  while (cur < line_end && is_space(*cur))
+    cur++;
+  return cur < line_end;
+}
+
+/** Reads a floating point number from the current line.
+  Numbers with at most 19 significant digits and a small exponent are computed
+  directly, both their digits and the power of ten being exact doubles, or else exact
+  long doubles: the product rounded to long double then to double is correctly rounded,
+  unless the first rounding gives a value halfway between two doubles.
+  Others are converted by strtod, so that the result is always correctly rounded.
+  @return False if there is no valid number.
+*/
+bool mapped_input::read(double &x)
+{
+  if (!skip_space())
+    return false;
+  const char *p = cur;
+  const bool neg = (*p == '-');
+  if (*p == '-' || *p == '+')
+    p++;
+  uint64_t m = 0;
+  int digits = 0, exp10 = 0;
+  bool exact = true, some = false;
+  for (bool frac = false ; p < line_end ; p++) {
+    if (*p == '.' && !frac) {
+      frac = true;
+      continue;
+    }
+    if (!isdigit((unsigned char) *p))
+      break;
+    some = true;
+    if (digits < 19) {
+      m = 10 * m + (*p - '0');
+      digits += (m > 0);
+      exp10 -= frac;
+    }
+    else {
+      exp10 += !frac;
+      exact = exact && *p == '0';
+    }
+  }
+  if (!some)
+    return false;
+  if (p < line_end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    const bool eneg = (q < line_end && *q == '-');
+    if (q < line_end && (*q == '-' || *q == '+'))
+      q++;
+    if (q < line_end && isdigit((unsigned char) *q)) {
+      int e = 0;
+      for ( ; q < line_end && isdigit((unsigned char) *q) ; q++)
+        if (e < 100000)
+          e = 10 * e + (*q - '0');
+      exp10 += (eneg) ? -e : e;
+      p = q;
+    }
+  }
+
+  bool done = false;
+  if (exact && m <= exact_int && exp10 >= -22 && exp10 <= 22) {
+    const double v = (double) m;
+    x = (exp10 < 0) ? v / exact_pow10[-exp10] : v * exact_pow10[exp10];
+    done = true;
+  }
+  else if (exact && m <= exact_long_int && (size_t) std::abs(exp10) < exact_long_pow10().size()) {
+    const std::vector<long double> &p10 = exact_long_pow10();
+    const long double v = (exp10 < 0) ? m / p10[-exp10] : m * p10[exp10];
+    x = (double) v;
+    done = !halfway(v, x);
+  }
+  if (done) {
+    if (neg)
+      x = -x;
+  }
+  else {
+    // strtod needs a terminated string, short numbers are copied on the stack
+    char small[64];
+    std::string large;
+    const size_t len = p - cur;
+    const char *buf = small;
+    if (len < sizeof(small)) {
+      memcpy(small, cur, len);
+      small[len] = 0;
+    }
+    else {
+      large.assign(cur, p);
+      buf = large.c_str();
+    }
+    errno = 0;
+    char *e;
+    x = strtod(buf, &e);
+    if (e != buf + len || (errno == ERANGE && std::isinf(x)))
+      return false;
+  }
+  cur = p;
+  return true;
+}
+
+/** Reads a non negative integer from the current line.
+  @return False if there is no valid number.
+*/
+bool mapped_input::read(size_t &x)
+{
+  if (!skip_space())
+    return false;
+  const char *p = cur;
+  if (*p == '+')
+    p++;
+  size_t v = 0;
+  const char *start = p;
+  for ( ; p < line_end && isdigit((unsigned char) *p) ; p++) {
+    const size_t d = *p - '0';
+    if (v > (SIZE_MAX - d) / 10)
+      return false;
+    v = 10 * v + d;
+  }
+  if (p == start)
+    return false;
+  x = v;
+  cur = p;
+  return true;
+}
+
+/** Reads an integer from the current line.
+  @return False if there is no valid number.
+*/
+bool mapped_input::read(long &x)
+{
+  if (!skip_space())
+    return false;
+  const char *start = cur;
+  const bool neg = (*cur == '-');
+  if (neg)
+    cur++;
+  size_t v;
+  if (cur == line_end || !isdigit((unsigned char) *cur) || !read(v) || v > (size_t) LONG_MAX) {
+    cur = start;
+    return false;
+  }
+  x = (neg) ? -(long) v : (long) v;
+  return true;
+}
+
+/** Reads a word (up to the next space) from the current line.
+  @return False if nothing is left in the line.
+*/
+bool mapped_input::read(std::string &w)
+{
+  if (!skip_space())
+    return false;
+  const char *p = cur;
+  while (p < line_end && !is_space(*p))
+    p++;
+  w.assign(cur, p);
+  cur = p;
+  return true;
+}
+
+/** Creates a buffer with the precision and the floating point notation of a stream.
+  @param attached If true, the text is written to the stream, otherwise it is kept.
+*/
+text_buffer::text_buffer(std::ostream &os, bool attached):
+out((attached) ? &os : NULL), precision(os.precision()), format('g')
+{
+  const std::ios_base::fmtflags f = os.flags() & std::ios_base::floatfield;
+  if (f == std::ios_base::fixed)
+    format = 'f';
+  else if (f == std::ios_base::scientific)
+    format = 'e';
+  else if (f == (std::ios_base::fixed | std::ios_base::scientific))
+    format = 'a';
+  buf.reserve(block + 64);
+}
+
+text_buffer::~text_buffer()
+{
+  flush();
+}
+
+/** Appends a floating point number. */
+text_buffer &text_buffer::operator<<(double x)
+{
+  char s[512];
+  const char f[] = {'%', '.', '*', format, 0};
+  // iostream ignores the precision in hexadecimal notation
+  const int n = (format == 'a') ? snprintf(s, sizeof(s), "%a", x) : snprintf(s, sizeof(s), f, precision, x);
+  if (n >= 0 && n < (int) sizeof(s))
+    buf.append(s, n);
+  else {
+    std::ostringstream os;
+    os.precision(precision);
+    if (format != 'g')
+      os.setf((format == 'f') ? std::ios_base::fixed : (format == 'e') ? std::ios_base::scientific :
+              std::ios_base::fixed | std::ios_base::scientific, std::ios_base::floatfield);
+    os << x;
+    buf.append(os.str());
+  }
+  if (out && buf.size() >= block)
+    flush();
+  return *this;
+}
+
+/** Appends an integer given by its absolute value and its sign. */
+text_buffer &text_buffer::put_int(unsigned long long u, bool neg)
+{
+  char s[24];
+  char *p = s + sizeof(s);
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (neg)
+    *--p = '-';
+  buf.append(p, s + sizeof(s) - p);
+  if (out && buf.size() >= block)
+    flush();
+  return *this;
+}
+
+/** Writes the text of an attached buffer to its stream. */
+void text_buffer::flush()
+{
+  if (out == NULL || buf.empty())
+    return;
+  out->write(buf.data(), buf.size());
+  buf.clear();
+}
+
 /** Creates a smart_output from a filename.
  Uses cout if filename is set to "-".
  The created file is properly closed at destruction.
+ @param binary If true, the file is opened in binary mode.
 */
-smart_output::smart_output(const std::string &n):
+smart_output::smart_output(const std::string &n, bool binary):
 name(n), output(NULL), file(NULL)
 {
   if (name == "-") {
@@ -162,7 +649,7 @@ name(n), output(NULL), file(NULL)
     output = &std::cout;
   }
   else {
-    file = new std::ofstream(name);
+    file = new std::ofstream(name, (binary) ? std::ios::out | std::ios::binary : std::ios::out);
     output = file;
   }
 }
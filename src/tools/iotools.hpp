@@ -12,6 +12,8 @@
 #include <fstream>
 #include <cstring>
 #include <chrono>
+#include <algorithm>
+#include <cstdint>
 
 
 extern const std::string cannot_open_msg;
@@ -21,6 +23,37 @@ extern const std::string unexpect_eof_msg;
 
 std::istream &failed(std::istream &is);
 
+/** True if the computer stores numbers in little endian order. */
+inline bool little_endian()
+{
+  const uint16_t one = 1;
+  return *(const char *) &one == 1;
+}
+
+/** Reads a little endian number. */
+template<typename T>
+T get_le(const char *p)
+{
+  char b[sizeof(T)];
+  memcpy(b, p, sizeof(T));
+  if (!little_endian())
+    std::reverse(b, b + sizeof(T));
+  T x;
+  memcpy(&x, b, sizeof(T));
+  return x;
+}
+
+/** Appends a little endian number to a buffer. */
+template<typename T>
+void put_le(std::string &buf, T x)
+{
+  char b[sizeof(T)];
+  memcpy(b, &x, sizeof(T));
+  if (!little_endian())
+    std::reverse(b, b + sizeof(T));
+  buf.append(b, sizeof(T));
+}
+
 /** A class to measure ealpsed time. */
 class elapsed
 {
@@ -74,10 +107,13 @@ public:
   smart_input &next_line(std::istringstream &iss);
   smart_input &peek_line(std::istringstream &iss);
   smart_input &failed();
+  std::streamoff tell(size_t &lines) const;
+  void seek(std::streamoff pos, size_t lines);
 
   size_t line_count;
   std::string name;
   std::istream *input;
+  int threads; /**< Number of threads readers may use, 1 by default. */
 
 private:
   bool resend;
@@ -85,6 +121,125 @@ private:
   std::ifstream *file;
 };
 
+/** A file mapped in memory and parsed in place, line by line.
+  Like smart_input, it ignores empty lines and lines starting with '#'.
+  Numbers are parsed without copying the lines, which is much faster than
+  reading them through streams. Without mmap (NO_MMAP), the file is read into memory.
+  Parts of the file can be parsed concurrently through views, see mapped_input::line_start.
+
+  Usage:
+    1. create one instance with the file name and the position to start from.
+    2. check it with operator bool (the file may not be mappable).
+    3. use mapped_input::next_line to go to the next line, then mapped_input::read on its numbers.
+  Inputs which cannot be mapped, like the standard input, may be read whole into memory instead.
+*/
+class mapped_input
+{
+public:
+  size_t line_count; /**< Number of lines read so far. */
+
+  mapped_input(const std::string &name, std::streamoff start = 0, size_t lines = 0);
+  mapped_input(const mapped_input &whole, std::streamoff from, std::streamoff to, size_t lines);
+  mapped_input(std::istream &is, size_t lines);
+  ~mapped_input();
+  mapped_input(const mapped_input &) = delete;
+  mapped_input &operator=(const mapped_input &) = delete;
+
+  /** To check whether the file was mapped. */
+  explicit operator bool() const
+  { return ok; }
+
+  /** True if the end of the file was reached by next_line. */
+  bool eof() const
+  { return at_end; }
+
+  /** Size of the mapped file in bytes. */
+  size_t size() const
+  { return length; }
+
+  /** The content of the file, for binary formats. */
+  const char *content() const
+  { return data; }
+
+  /** Position in the file of the line following the current one. */
+  std::streamoff tell() const
+  { return next - data; }
+
+  void seek(std::streamoff pos, size_t lines);
+  void release(std::streamoff pos);
+  std::streamoff line_start(std::streamoff pos) const;
+  bool next_line();
+  bool read(double &x);
+  bool read(size_t &x);
+  bool read(long &x);
+  bool read(std::string &w);
+
+private:
+  bool ok, at_end, owner;
+  const char *data;
+  size_t length;
+  size_t released; /**< Size of the start of the file given back to the system, see release. */
+  const char *cur, *line_end, *next, *end;
+  std::string copy; /**< The content of the file, without mmap. */
+
+  bool skip_space();
+};
+
+/** A buffer to write text quickly.
+  Numbers are formatted with snprintf as the stream would do with its precision and
+  floating point notation, so that the text is the same, but without the locale
+  machinery of iostream and without flushing lines. An attached buffer writes its text
+  to the stream by large blocks. A detached buffer keeps its text (see text_buffer::str),
+  so that parts of a file can be formatted in parallel and then written in order.
+*/
+class text_buffer
+{
+public:
+  text_buffer(std::ostream &os, bool attached = true);
+  ~text_buffer();
+  text_buffer(const text_buffer &) = delete;
+  text_buffer &operator=(const text_buffer &) = delete;
+
+  text_buffer &operator<<(double x);
+  text_buffer &operator<<(int x)
+  { return *this << (long long) x; }
+  text_buffer &operator<<(long x)
+  { return *this << (long long) x; }
+  text_buffer &operator<<(long long x)
+  { return put_int((x < 0) ? 0ULL - (unsigned long long) x : x, x < 0); }
+  text_buffer &operator<<(unsigned x)
+  { return put_int(x, false); }
+  text_buffer &operator<<(unsigned long x)
+  { return put_int(x, false); }
+  text_buffer &operator<<(unsigned long long x)
+  { return put_int(x, false); }
+
+  text_buffer &operator<<(char c)
+  { buf.push_back(c); return *this; }
+
+  text_buffer &operator<<(const char *s)
+  { buf.append(s); return *this; }
+
+  text_buffer &operator<<(const std::string &s)
+  { buf.append(s); return *this; }
+
+  /** The text of a detached buffer. */
+  const std::string &str() const
+  { return buf; }
+
+  void flush();
+
+private:
+  std::ostream *out; /**< The stream, NULL for a detached buffer. */
+  std::string buf;
+  int precision;
+  char format;       /**< The conversion of snprintf: 'g', 'f', 'e' or 'a' (without precision, as iostream). */
+
+  text_buffer &put_int(unsigned long long u, bool neg);
+
+  static const size_t block = 1 << 16; /**< Size of the blocks written. */
+};
+
 /** Reads an object from a smart_input, so you can use them like any istream.*/
 template <typename T>
 smart_input &operator>>(smart_input &is, T &x)
@@ -93,6 +248,8 @@ smart_input &operator>>(smart_input &is, T &x)
   return is;
 }
 
+std::string input_error(const smart_input &is);
+
 /** Reads an object from a smart_input with error messages.
   It can prints more info to cerr with verbose set to true.
   */
@@ -106,13 +263,7 @@ std::string read_object(smart_input &is, T &x,  bool verbose = false)
   is >> x;
   if (verbose)
     std::cerr << "Done" << std::endl;
-  if (is.bad())
-    return bad_file_msg + is.name + " (" + strerror(errno) + ")";
-  if (is.eof())
-    return unexpect_eof_msg + is.name;
-  if (is.fail())
-    return invalid_file_msg + is.name + " at line " + std::to_string(is.line_count);
-  return "";
+  return input_error(is);
 }
 
 /** Reads a file into an object with helpful error messages printed to cerr.
@@ -129,7 +280,7 @@ std::string read_file(const std::string &filename, T &x,  bool verbose = false)
 class smart_output
 {
 public:
-  smart_output(const std::string &name);
+  smart_output(const std::string &name, bool binary = false);
   smart_output(std::ostream &os, const std::string &name);
   ~smart_output();
   smart_output(const smart_output &) = delete;
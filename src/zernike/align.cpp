@@ -0,0 +1,257 @@
+/** \file align.cpp
+  Implementation of align.hpp.
+  \author J. Houdayer
+*/
+
+#include "align.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238
+#endif
+
+/** Precision on the angles reached by the refinement.
+  The correlation is quadratic near its maximum, so the angles cannot be found much more
+  precisely than the square root of the machine precision.
+*/
+const double align_tolerance = 1e-8;
+
+/** The trigonometric functions used for the Fourier coefficients: cos(f x) if f >= 0, sin(-f x) otherwise. */
+static double trig(int f, double x)
+{
+  return (f >= 0) ? cos(f * x) : sin(-f * x);
+}
+
+/** The rotation with the given Euler angles in the zyz convention of wigner_rotation. */
+static mat euler_mat(double alpha, double beta, double gamma)
+{
+  return rotation_mat({0, 0, 1}, alpha) * rotation_mat({0, 1, 0}, beta) * rotation_mat({0, 0, 1}, gamma);
+}
+
+/** Constructor.
+  @param query The moments to rotate, in any normalization.
+  @param coarse_order Maximum order used by the coarse search,
+  the grid has about \f$4L^3\f$ points for L = coarse_order.
+  @param candidates Number of maxima of the coarse search refined.
+*/
+zernike_aligner::zernike_aligner(const zernike &query, int coarse_order, int candidates):
+q(query), coarse(coarse_order), candidates(candidates)
+{
+  q.normalize(zm_norm::ortho);
+}
+
+/** Fourier coefficients of the correlation with the target in the Euler angles.
+  @param t The target, in orthonormal normalization.
+  @param l_max The maximum order used.
+  @return The coefficient of trig(a, alpha) trig(b, beta) trig(g, gamma) for
+  a, b, g between -l_max and l_max, at index ((a + l_max) * s + b + l_max) * s + g + l_max with s = 2 l_max + 1.
+*/
+std::vector<double> zernike_aligner::fourier(const zernike &t, int l_max) const
+{
+  const int s0 = 2 * l_max + 1;
+  std::vector<double> f(s0 * s0 * s0, 0);
+  const wigner_rotation w(mat_id, l_max);
+  const std::vector<double> &tz = t.get_zm(), &qz = q.get_zm();
+
+  for (int l = 0 ; l <= l_max ; l++) {
+    const int s = 2 * l + 1;
+    const std::vector<double> &j = w.matrix_j(l);
+
+    // cross-correlation of order l
+    std::vector<double> c(s * s, 0);
+    for (int n = l ; n <= t.order() ; n += 2) {
+      const double *tn = tz.data() + t.index(n, l, -l);
+      const double *qn = qz.data() + q.index(n, l, -l);
+      for (int m1 = 0 ; m1 < s ; m1++)
+        for (int m2 = 0 ; m2 < s ; m2++)
+          c[m1 * s + m2] += tn[m1] * qn[m2];
+    }
+
+    // Z(alpha) and Z(gamma): column k of Z(x) has cos(|k| x) on row k and sign(k) sin(|k| x) on row -k
+    std::vector<double> e(4 * s * s, 0);
+    for (int k1 = -l ; k1 <= l ; k1++)
+      for (int ia = 0 ; ia < 1 + (k1 != 0) ; ia++) {
+        const int m1 = ia ? -k1 : k1;
+        const double ca = ia ? ((k1 > 0) ? 1 : -1) : 1;
+        for (int m2 = -l ; m2 <= l ; m2++)
+          for (int ig = 0 ; ig < 1 + (m2 != 0) ; ig++) {
+            const int k2 = ig ? -m2 : m2;
+            const double cg = ig ? ((m2 > 0) ? 1 : -1) : 1;
+            e[(((k1 + l) * s + k2 + l) * 2 + ia) * 2 + ig] += ca * cg * c[(m1 + l) * s + m2 + l];
+          }
+      }
+
+    // J Z(beta) J^T
+    std::vector<double> b(s * s * s, 0);
+    for (int k1 = 0 ; k1 < s ; k1++)
+      for (int k2 = 0 ; k2 < s ; k2++) {
+        double *bk = b.data() + (k1 * s + k2) * s;
+        for (int kp = -l ; kp <= l ; kp++) {
+          const double v = j[k2 * s + kp + l];
+          bk[abs(kp) + l] += j[k1 * s + kp + l] * v;
+          if (kp != 0)
+            bk[l - abs(kp)] += ((kp > 0) ? 1 : -1) * j[k1 * s - kp + l] * v;
+        }
+      }
+
+    for (int k1 = -l ; k1 <= l ; k1++)
+      for (int k2 = -l ; k2 <= l ; k2++)
+        for (int ia = 0 ; ia < 2 ; ia++)
+          for (int ig = 0 ; ig < 2 ; ig++) {
+            const double v = e[(((k1 + l) * s + k2 + l) * 2 + ia) * 2 + ig];
+            if (v == 0)
+              continue;
+            const int a = ia ? -abs(k1) : abs(k1);
+            const int g = ig ? -abs(k2) : abs(k2);
+            const double *bk = b.data() + ((k1 + l) * s + k2 + l) * s;
+            double *fk = f.data() + (a + l_max) * s0 * s0 + g + l_max;
+            for (int bb = -l ; bb <= l ; bb++)
+              fk[(bb + l_max) * s0] += v * bk[bb + l];
+          }
+  }
+  return f;
+}
+
+/** The correlation between the target and the query rotated by r.
+  @param t The target, in orthonormal normalization.
+  @param r The rotation.
+*/
+double zernike_aligner::correlation(const zernike &t, const mat &r) const
+{
+  const int n_max = t.order();
+  const wigner_rotation w(r, n_max);
+  std::vector<double> out(2 * n_max + 1);
+  double c = 0;
+  for (int n = 0 ; n <= n_max ; n++)
+    for (int l = n & 1 ; l <= n ; l += 2) {
+      w.apply(l, q.get_zm().data() + q.index(n, l, -l), out.data());
+      const double *tn = t.get_zm().data() + t.index(n, l, -l);
+      for (int m = 0 ; m <= 2 * l ; m++)
+        c += tn[m] * out[m];
+    }
+  return c;
+}
+
+/** Aligns the query on a target.
+  @param target The target moments, in any normalization.
+  The moments are compared up to the smallest order of the target and the query.
+  @return The rotation R such that the query rotated by R (see zernike::rotate) is closest to the target.
+*/
+alignment zernike_aligner::align(const zernike &target) const
+{
+  zernike t(std::min(target.order(), q.order()), target);
+  t.normalize(zm_norm::ortho);
+  const int l_max = std::min(coarse, t.order());
+  const int s0 = 2 * l_max + 1;
+
+  // coarse search on a grid of Euler angles, summing the Fourier series one angle at a time
+  const std::vector<double> f = fourier(t, l_max);
+  const int ma = 2 * l_max + 2, mb = l_max + 1;
+  std::vector<double> ta(ma * s0), tb(mb * s0);
+  for (int i = 0 ; i < ma ; i++)
+    for (int k = -l_max ; k <= l_max ; k++)
+      ta[i * s0 + k + l_max] = trig(k, 2 * M_PI * i / ma);
+  for (int i = 0 ; i < mb ; i++)
+    for (int k = -l_max ; k <= l_max ; k++)
+      tb[i * s0 + k + l_max] = trig(k, M_PI * (i + 0.5) / mb);
+
+  std::vector<double> x(s0 * s0 * ma, 0);  // a, b, gamma
+  for (int ab = 0 ; ab < s0 * s0 ; ab++)
+    for (int k = 0 ; k < ma ; k++) {
+      double v = 0;
+      for (int g = 0 ; g < s0 ; g++)
+        v += f[ab * s0 + g] * ta[k * s0 + g];
+      x[ab * ma + k] = v;
+    }
+  std::vector<double> y(s0 * mb * ma, 0);  // a, beta, gamma
+  for (int a = 0 ; a < s0 ; a++)
+    for (int jb = 0 ; jb < mb ; jb++)
+      for (int b = 0 ; b < s0 ; b++) {
+        const double tv = tb[jb * s0 + b];
+        const double *xv = x.data() + (a * s0 + b) * ma;
+        double *yv = y.data() + (a * mb + jb) * ma;
+        for (int k = 0 ; k < ma ; k++)
+          yv[k] += tv * xv[k];
+      }
+  std::vector<double> grid(ma * mb * ma, 0); // alpha, beta, gamma
+  for (int i = 0 ; i < ma ; i++)
+    for (int a = 0 ; a < s0 ; a++) {
+      const double tv = ta[i * s0 + a];
+      for (int jk = 0 ; jk < mb * ma ; jk++)
+        grid[i * mb * ma + jk] += tv * y[a * mb * ma + jk];
+    }
+
+  // local maxima of the grid, periodic in alpha and gamma
+  auto at = [&](int i, int jb, int k) {
+    return grid[(((i + ma) % ma) * mb + jb) * ma + (k + ma) % ma];
+  };
+  std::vector<std::pair<double, int>> maxima;
+  for (int i = 0 ; i < ma ; i++)
+    for (int jb = 0 ; jb < mb ; jb++)
+      for (int k = 0 ; k < ma ; k++) {
+        const double v = at(i, jb, k);
+        if (v >= at(i - 1, jb, k) && v >= at(i + 1, jb, k) &&
+            v >= at(i, jb, k - 1) && v >= at(i, jb, k + 1) &&
+            (jb == 0 || v >= at(i, jb - 1, k)) && (jb == mb - 1 || v >= at(i, jb + 1, k)))
+          maxima.push_back({-v, (i * mb + jb) * ma + k});
+      }
+  std::sort(maxima.begin(), maxima.end());
+  if ((int) maxima.size() > candidates)
+    maxima.resize(candidates);
+
+  // refinement by compass search over small rotations
+  const vec axes[3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  alignment best = {mat_id, -HUGE_VAL, 0};
+  for (auto &mx: maxima) {
+    const int k = mx.second % ma, jb = (mx.second / ma) % mb, i = mx.second / (ma * mb);
+    mat r = euler_mat(2 * M_PI * i / ma, M_PI * (jb + 0.5) / mb, 2 * M_PI * k / ma);
+    double c = correlation(t, r);
+    for (double h = M_PI / mb ; h > align_tolerance ; ) {
+      bool moved = false;
+      for (auto &ax: axes)
+        for (int sg = -1 ; sg <= 1 ; sg += 2) {
+          const mat r2 = r * rotation_mat(ax, sg * h);
+          const double c2 = correlation(t, r2);
+          if (c2 > c) {
+            r = r2;
+            c = c2;
+            moved = true;
+          }
+        }
+      if (!moved)
+        h /= 2;
+    }
+    if (c > best.correlation)
+      best = {r, c, 0};
+  }
+
+  // normalization of the result, the residual is computed directly to avoid cancellations
+  zernike rq(t.order(), q);
+  rq.rotate(best.rotation);
+  double tt = 0, qq = 0, d = 0;
+  for (int n = 0 ; n <= t.order() ; n++)
+    for (int l = n & 1 ; l <= n ; l += 2)
+      for (int m = -l ; m <= l ; m++) {
+        const double tv = t.get(n, l, m), qv = rq.get(n, l, m);
+        tt += tv * tv;
+        qq += qv * qv;
+        d += (tv - qv) * (tv - qv);
+      }
+  best.residual = sqrt(d);
+  best.correlation = (tt * qq > 0) ? best.correlation / sqrt(tt * qq) : 0;
+  return best;
+}
+
+/** Aligns the query on many targets.
+  @param targets The target moments.
+  @param nt Number of threads to use.
+  @param verbose If true, shows a progression bar.
+  @return The alignment for each target.
+*/
+std::vector<alignment> zernike_aligner::align(const std::vector<zernike> &targets, int nt, bool verbose) const
+{
+  std::vector<alignment> res(targets.size());
+  parallel_eval<alignment>(nt, res, [&](size_t i) { return align(targets[i]); }, verbose);
+  return res;
+}
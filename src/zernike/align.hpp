@@ -0,0 +1,57 @@
+/** \file align.hpp
+  Rotational alignment of Zernike moments.
+  \author J. Houdayer
+*/
+
+#ifndef ALIGN_HPP
+#define ALIGN_HPP
+
+#include "zernike.hpp"
+
+/** The result of an alignment. */
+class alignment
+{
+public:
+  mat rotation;       /**< The rotation bringing the query onto the target. */
+  double correlation; /**< Normalized correlation after rotation, between -1 and 1. */
+  double residual;    /**< Distance between the rotated query and the target, in orthonormal normalization. */
+};
+
+/** A class to find the rotation that best aligns Zernike moments.
+
+  It maximizes over all rotations R the correlation
+  \f[ C(R) = \sum_{nlm} t_{nlm} (R q)_{nlm}, \f]
+  between a query q rotated by R (as in zernike::rotate) and a target t, both
+  in orthonormal normalization.
+
+  Writing the Wigner matrices as \f$D(R) = Z(\alpha) J Z(\beta) J^T Z(\gamma)\f$
+  (see wigner_rotation), C is a trigonometric polynomial in the Euler angles.
+  Its Fourier coefficients are computed from the cross-correlation matrices
+  \f$\sum_n t_{nlm} q_{nlm'}\f$ of each order l and summed on a regular grid of
+  Euler angles, one angle at a time. This is the SO(3) Fourier transform of the
+  correlation, it costs \f$O(L^4)\f$ operations for the orders l up to L used
+  by the coarse search. The best grid points are then refined by a compass search
+  over small rotations, using all orders.
+
+  Usage:
+    1. create one instance with the query.
+    2. use zernike_aligner::align with one or many targets.
+*/
+class zernike_aligner
+{
+public:
+  zernike_aligner(const zernike &query, int coarse_order = 16, int candidates = 4);
+
+  alignment align(const zernike &target) const;
+  std::vector<alignment> align(const std::vector<zernike> &targets, int nt = 1, bool verbose = false) const;
+
+private:
+  zernike q;      /**< The query in orthonormal normalization. */
+  int coarse;     /**< Maximum order used by the coarse search. */
+  int candidates; /**< Number of grid maxima refined. */
+
+  std::vector<double> fourier(const zernike &t, int l_max) const;
+  double correlation(const zernike &t, const mat &r) const;
+};
+
+#endif
@@ -0,0 +1,316 @@
+/** \file geometric.cpp
+  Implementation of geometric.hpp.
+  \author J. Houdayer
+*/
+
+#include "geometric.hpp"
+#include "cache.hpp"
+#include <limits>
+#include <algorithm>
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238
+#endif
+
+/** Number of monomials of degree up to n. */
+static int monomial_count(int n)
+{
+  return (n + 1) * (n + 2) * (n + 3) / 6;
+}
+
+/** Constructor.
+  @param n Maximum order needed. Should be positive.
+*/
+geometric_moments::geometric_moments(int n):
+N(n), gm(monomial_count(n), 0), abs_gm(gm.size(), 0), fact(gm.size()),
+h1(gm.size()), h2(gm.size()), h3(gm.size())
+{
+  std::vector<double> f(N + 4, 1);
+  for (int i = 1 ; i < N + 4 ; i++)
+    f[i] = f[i - 1] * i;
+  for (int d = 0, k = 0 ; d <= N ; d++)
+    for (int j = 0 ; j <= d ; j++)
+      for (int c = 0 ; c <= j ; c++, k++)
+        fact[k] = f[d - j] * f[j - c] * f[c] / f[d + 3];
+}
+
+/** Reset the computation to 0. */
+void geometric_moments::reset_gm()
+{
+  for (auto &v: gm)
+    v = 0;
+  for (auto &v: abs_gm)
+    v = 0;
+}
+
+/** Sets the moments and their error estimate, for moments summed elsewhere.
+  @param g The moments, as in geometric_moments::get_gm.
+  @param abs_g The sums of the absolute values of the terms, as in geometric_moments::get_abs_gm.
+*/
+void geometric_moments::assign(const std::vector<double> &g, const std::vector<double> &abs_g)
+{
+  std::copy(g.begin(), g.begin() + gm.size(), gm.begin());
+  std::copy(abs_g.begin(), abs_g.begin() + abs_gm.size(), abs_gm.begin());
+}
+
+/** Adds the moments of the tetrahedron defined by the origin and the triangle.
+  The volume is signed as in triangle::volume.
+
+  It uses the formula for the integral of a power of a linear form over a simplex:
+  \f[ \int (t\cdot x)^d = \frac{6V\,d!}{(d+3)!} h_d(t\cdot p_1, t\cdot p_2, t\cdot p_3), \f]
+  where \f$h_d\f$ is the complete homogeneous symmetric polynomial of degree d.
+  The coefficients of \f$h_d\f$ as a polynomial in t are computed by recursion on d.
+*/
+void geometric_moments::add_tetrahedron(const triangle &t)
+{
+  const double v6 = 6 * t.volume();
+  const vec &u = t.p1, &v = t.p2, &w = t.p3;
+  h1[0] = h2[0] = h3[0] = 1;
+  gm[0] += v6 * fact[0];
+  abs_gm[0] += fabs(v6 * fact[0]);
+  for (int d = 1, k = 1, p = 0 ; d <= N ; d++) {
+    for (int j = 0 ; j <= d ; j++) {
+      const int px = p + j * (j + 1) / 2;  // element a - 1, b, c
+      const int pyz = p + j * (j - 1) / 2; // element a, b - 1, c
+      for (int c = 0 ; c <= j ; c++, k++) {
+        double s1 = 0, s2 = 0, s3 = 0;
+        if (j < d) {
+          s1 += w.x * h1[px + c];
+          s2 += v.x * h2[px + c];
+          s3 += u.x * h3[px + c];
+        }
+        if (c < j) {
+          s1 += w.y * h1[pyz + c];
+          s2 += v.y * h2[pyz + c];
+          s3 += u.y * h3[pyz + c];
+        }
+        if (c > 0) {
+          s1 += w.z * h1[pyz + c - 1];
+          s2 += v.z * h2[pyz + c - 1];
+          s3 += u.z * h3[pyz + c - 1];
+        }
+        h1[k] = s1;
+        h2[k] = s2 + s1;
+        h3[k] = s3 + s2 + s1;
+        const double g = v6 * fact[k] * h3[k];
+        gm[k] += g;
+        abs_gm[k] += fabs(g);
+      }
+    }
+    p += d * (d + 1) / 2;
+  }
+}
+
+geometric_moments &geometric_moments::operator +=(const geometric_moments &g)
+{
+  const size_t n = std::min(gm.size(), g.gm.size());
+  for (size_t i = 0 ; i != n ; i++) {
+    gm[i] += g.gm[i];
+    abs_gm[i] += g.abs_gm[i];
+  }
+  return *this;
+}
+
+/** A homogeneous polynomial in x, y, z.
+  Coefficients are ordered as in geometric_moments (for one degree only).
+*/
+class homogeneous
+{
+public:
+  int d;
+  std::vector<double> c;
+
+  homogeneous(int deg = 0): d(deg), c((d + 1) * (d + 2) / 2, 0) {}
+
+  /** Multiplication by x, y or z, according to dir = 0, 1 or 2. */
+  homogeneous mul(int dir, double s = 1) const
+  {
+    homogeneous h(d + 1);
+    for (int j = 0, k = 0 ; j <= d ; j++)
+      for (int c0 = 0 ; c0 <= j ; c0++, k++) {
+        const int j2 = j + (dir != 0);
+        h.c[j2 * (j2 + 1) / 2 + c0 + (dir == 2)] += s * c[k];
+      }
+    return h;
+  }
+
+  /** Multiplication by x^2+y^2+z^2. */
+  homogeneous mul_r2(double s = 1) const
+  {
+    homogeneous h(d + 2);
+    for (int j = 0, k = 0 ; j <= d ; j++)
+      for (int c0 = 0 ; c0 <= j ; c0++, k++) {
+        const double v = s * c[k];
+        h.c[j * (j + 1) / 2 + c0] += v;
+        h.c[(j + 2) * (j + 3) / 2 + c0] += v;
+        h.c[(j + 2) * (j + 3) / 2 + c0 + 2] += v;
+      }
+    return h;
+  }
+
+  homogeneous &operator +=(const homogeneous &h)
+  {
+    for (size_t k = 0 ; k < c.size() ; k++)
+      c[k] += h.c[k];
+    return *this;
+  }
+};
+
+/** Constructor.
+  Builds the matrix by writing each Zernike polynomial as a polynomial in x, y, z.
+  Spherical harmonics (multiplied by \f$r^l\f$) and radial parts (divided by \f$r^l\f$)
+  use the same recursions as spherical_harmonics and zernike_r.
+  @param n Maximum order needed. Should be positive.
+*/
+geometric_conversion::geometric_conversion(int n):
+N(n), row_norm(0)
+{
+  const zernike index_z(N);
+  std::vector<std::vector<std::pair<int, double>>> rows(index_z.get_zm().size());
+  std::vector<homogeneous> sh1, sh2, sh; // harmonics of order l - 2, l - 1 and l
+  homogeneous re(0), im(0);              // real and imaginary parts of (x+iy)^l
+  re.c[0] = 1;
+  double mm = sqrt(2 / (4 * M_PI));
+  help2 h;
+  help3 h3;
+
+  for (int l = 0 ; l <= N ; l++) {
+    // solid harmonics r^l Y_lm for m = -l..l
+    sh.assign(2 * l + 1, homogeneous(l));
+    if (l == 0)
+      sh[0].c[0] = 1 / sqrt(4 * M_PI);
+    else {
+      for (int m = 0 ; m < l - 1 ; m++) {
+        h.set_sh(l, m);
+        for (int s = -1 ; s <= 1 ; s += 2) {
+          const int i = l + s * m;
+          sh[i] = sh1[i - 1].mul(2, h.c1);
+          sh[i] += sh2[i - 2].mul_r2(-h.c2);
+        }
+      }
+      h.set_sh(l, l - 1);
+      sh[1] = sh1[0].mul(2, h.c1);
+      sh[2 * l - 1] = sh1[2 * l - 2].mul(2, h.c1);
+      homogeneous re2 = re.mul(0);
+      re2 += im.mul(1, -1);
+      homogeneous im2 = im.mul(0);
+      im2 += re.mul(1);
+      re = re2;
+      im = im2;
+      h.set_sh(l, l);
+      mm *= -h.c1;
+      for (size_t k = 0 ; k < re.c.size() ; k++) {
+        sh[2 * l].c[k] = mm * re.c[k];
+        sh[0].c[k] = mm * im.c[k];
+      }
+    }
+
+    // radial parts R_nl / r^l as polynomials in r^2
+    std::vector<std::vector<double>> q(1, {1});
+    for (int n = l + 2 ; n <= N ; n += 2) {
+      h3.set_r(n, l);
+      const std::vector<double> &q1 = q.back();
+      std::vector<double> qn(q1.size() + 1, 0);
+      for (size_t k = 0 ; k < q1.size() ; k++) {
+        qn[k + 1] += h3.c1 * q1[k];
+        qn[k] -= h3.c1 * h3.c2 * q1[k];
+      }
+      if (q.size() >= 2)
+        for (size_t k = 0 ; k < q[q.size() - 2].size() ; k++)
+          qn[k] -= h3.c1 * h3.c3 * q[q.size() - 2][k];
+      q.push_back(qn);
+    }
+
+    // Zernike polynomials, using powers of r^2 times the harmonics
+    for (int m = -l ; m <= l ; m++) {
+      std::vector<homogeneous> t(1, sh[m + l]);
+      while (t.size() < q.size())
+        t.push_back(t.back().mul_r2());
+      for (size_t i = 0 ; i < q.size() ; i++) {
+        std::vector<std::pair<int, double>> &r = rows[index_z.index(l + 2 * i, l, m)];
+        for (size_t k = 0 ; k <= i ; k++) {
+          const int off = monomial_count(t[k].d - 1);
+          for (size_t j = 0 ; j < t[k].c.size() ; j++)
+            if (t[k].c[j] != 0)
+              r.push_back({off + (int) j, q[i][k] * t[k].c[j]});
+        }
+      }
+    }
+
+    sh2.swap(sh1);
+    sh1.swap(sh);
+  }
+
+  start.push_back(0);
+  for (auto &r: rows) {
+    std::sort(r.begin(), r.end());
+    double norm = 0;
+    for (auto &e: r) {
+      col.push_back(e.first);
+      coef.push_back(e.second);
+      norm += fabs(e.second);
+    }
+    row_norm = std::max(row_norm, norm);
+    start.push_back(col.size());
+  }
+}
+
+/** The conversion for the given order.
+  It is built on first use and cached for later calls.
+*/
+const geometric_conversion &geometric_conversion::get(int n)
+{
+  static object_cache<int, geometric_conversion> cache;
+  return cache.get(n, [](int k) { return geometric_conversion(k); });
+}
+
+/** Applies the conversion.
+  @param g The geometric moments, as in geometric_moments::get_gm (of order N or more).
+  @param z The raw Zernike moments, as in zernike::get_zm (of order N).
+*/
+void geometric_conversion::convert(const std::vector<double> &g, std::vector<double> &z) const
+{
+  for (size_t i = 0 ; i + 1 < start.size() ; i++) {
+    double s = 0;
+    for (size_t k = start[i] ; k < start[i + 1] ; k++)
+      s += coef[k] * g[col[k]];
+    z[i] = s;
+  }
+}
+
+/** Bound on the effect of relative errors in the geometric moments.
+  @param abs_g Bounds on the absolute values of the geometric moments.
+  @return The largest sum, over Zernike moments, of the absolute values
+  of the terms of the conversion.
+*/
+double geometric_conversion::amplification(const std::vector<double> &abs_g) const
+{
+  double a = 0;
+  for (size_t i = 0 ; i + 1 < start.size() ; i++) {
+    double s = 0;
+    for (size_t k = start[i] ; k < start[i + 1] ; k++)
+      s += fabs(coef[k]) * abs_g[col[k]];
+    a = std::max(a, s);
+  }
+  return a;
+}
+
+/** Constructor.
+  @param n Maximum order needed. Should be positive.
+*/
+zernike_m_geom::zernike_m_geom(int n):
+zernike(n)
+{}
+
+/** Computes the raw Zernike moments from the geometric moments.
+  The error estimate accounts for rounding errors amplified by the conversion.
+  @param g The geometric moments, of order N or more.
+*/
+void zernike_m_geom::convert(const geometric_moments &g)
+{
+  reset_zm();
+  const geometric_conversion &conv = geometric_conversion::get(N);
+  conv.convert(g.get_gm(), zm);
+  const double err = std::numeric_limits<double>::epsilon() * conv.amplification(g.get_abs_gm());
+  variance = err * err;
+}
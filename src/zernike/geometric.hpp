@@ -0,0 +1,122 @@
+/** \file geometric.hpp
+  Computation of Zernike moments through geometric moments.
+  \author J. Houdayer
+*/
+
+#ifndef GEOMETRIC_HPP
+#define GEOMETRIC_HPP
+
+#include "triangle.hpp"
+#include "zernike.hpp"
+
+/** A class to compute the geometric moments of a volume.
+
+  It computes the integrals over the volume of \f$x^ay^bz^c\f$
+  for all \f$a+b+c\le N\f$.
+
+  Usage:
+    1. create one instance with the maximum order needed.
+    2. use geometric_moments::reset_gm to start from 0.
+    3. repeatedly call geometric_moments::add_tetrahedron.
+    4. use the result.
+    5. go to step 2.
+*/
+class geometric_moments
+{
+public:
+  const int N; /**< Maximum order. */
+
+  geometric_moments(int n);
+
+  /** Index of element a, b, c in storage.
+    Elements are ordered by degree d = a + b + c, then by b + c, then by c.
+
+    @param a, b, c Positive, with a + b + c not larger than N.
+    @return The index of element a, b, c, between 0 and (N + 1) * (N + 2) * (N + 3) / 6 (excluded).
+  */
+  static int index(int a, int b, int c)
+  {
+    const int d = a + b + c;
+    const int j = b + c;
+    return d * (d + 1) * (d + 2) / 6 + j * (j + 1) / 2 + c;
+  }
+
+  /** Value of element a, b, c. */
+  double get(int a, int b, int c) const
+  { return gm[index(a, b, c)]; }
+
+  /** A direct access to data. */
+  const std::vector<double> &get_gm() const
+  { return gm; }
+
+  /** Sums of the absolute values of the terms added, used to estimate rounding errors. */
+  const std::vector<double> &get_abs_gm() const
+  { return abs_gm; }
+
+  void reset_gm();
+  void assign(const std::vector<double> &g, const std::vector<double> &abs_g);
+  void add_tetrahedron(const triangle &t);
+  geometric_moments &operator +=(const geometric_moments &g);
+
+private:
+  std::vector<double> gm;     /**< Storage for the result. */
+  std::vector<double> abs_gm; /**< Storage for the error estimate. */
+  std::vector<double> fact; /**< a! b! c! / (d + 3)! for each element. */
+  std::vector<double> h1, h2, h3; /**< Work space for add_tetrahedron. */
+};
+
+/** The linear map from geometric moments to raw Zernike moments.
+
+  Zernike polynomials are polynomials in x, y and z, so Zernike moments
+  are linear combinations of geometric moments. This class stores the
+  coefficients of this combination as a sparse matrix.
+  Building it costs much more than using it: get it from geometric_conversion::get
+  which keeps one instance for each order.
+
+  The coefficients grow quickly with the order which limits the precision of
+  the result, see geometric_conversion::max_order.
+*/
+class geometric_conversion
+{
+public:
+  const int N; /**< Maximum order. */
+
+  geometric_conversion(int n);
+
+  static const geometric_conversion &get(int n);
+  static int max_order(double precision);
+
+  /** Number of non zero coefficients. */
+  size_t size() const
+  { return coef.size(); }
+
+  /** Largest sum of the absolute values of the coefficients in a row. */
+  double max_row_norm() const
+  { return row_norm; }
+
+  void convert(const std::vector<double> &g, std::vector<double> &z) const;
+  double amplification(const std::vector<double> &abs_g) const;
+
+private:
+  std::vector<size_t> start; /**< Start of each Zernike moment in col and coef. */
+  std::vector<int> col;      /**< Indices of the geometric moments. */
+  std::vector<double> coef;  /**< The coefficients. */
+  double row_norm;
+};
+
+/** Class for computing Zernike moments from geometric moments.
+
+  Usage:
+    1. create one instance with the maximum order needed.
+    2. use zernike_m_geom::convert with the geometric moments.
+    3. use the result.
+ */
+class zernike_m_geom:
+public zernike
+{
+public:
+  zernike_m_geom(int n);
+  void convert(const geometric_moments &g);
+};
+
+#endif
@@ -0,0 +1,146 @@
+/** \file moment_cache.cpp
+  Implementation of moment_cache.hpp.
+  \author J. Houdayer
+*/
+
+#include "moment_cache.hpp"
+#include "hash.hpp"
+#include <cstdio>
+#include <random>
+#include <limits>
+
+/** Constructor.
+  @param directory The cache directory, it should exist.
+  @param ts The quadrature rules used to compute the moments.
+*/
+moment_cache::moment_cache(const std::string &directory, const triquad_selector &ts):
+dir(directory)
+{
+  fnv_hash h;
+  for (auto *v: {&ts.schemes, &ts.secondary_schemes})
+    for (auto &s: *v) {
+      h << (uint64_t) s.order << (uint64_t) s.data.size();
+      for (auto &p: s.data)
+        h << p.weight << p.c1 << p.c2 << p.c3;
+    }
+  rules = h.h;
+}
+
+/** The key of an entry.
+  @param m The mesh.
+  @param n The order of the moments.
+  @param mode A description of the computation, like "exact-auto" or "approx-8".
+  @return The hash, as 16 hexadecimal digits.
+*/
+std::string moment_cache::key(const mesh &m, int n, const std::string &mode) const
+{
+  fnv_hash h;
+  h << rules << (uint64_t) n << mode << (uint64_t) m.points.size() << (uint64_t) m.triangles.size();
+  for (auto &p: m.points)
+    h << p.x << p.y << p.z;
+  for (auto &t: m.triangles)
+    h << (uint64_t) t.i1 << (uint64_t) t.i2 << (uint64_t) t.i3;
+  std::ostringstream os;
+  os << std::hex << std::setw(16) << std::setfill('0') << h.h;
+  return os.str();
+}
+
+std::string moment_cache::path(const std::string &key) const
+{
+  return dir + "/" + key + ".zmc";
+}
+
+/** Reads an entry.
+  The header of the entry is checked against the mesh, order and mode to guard against collisions.
+  @param z The raw moments read, with their error estimate.
+  @return True if the entry was found and read.
+*/
+bool moment_cache::load(const std::string &key, const mesh &m, int n, const std::string &mode, zernike &z) const
+{
+  smart_input is(path(key));
+  if (!is)
+    return false;
+  std::istringstream s;
+  std::string tag, k, md;
+  int n0;
+  size_t facets;
+  double variance;
+  if (!is.next_line(s))
+    return false;
+  s >> tag >> k >> n0 >> md >> facets;
+  if (!s || tag != "ZMCACHE" || k != key || n0 != n || md != mode || facets != m.triangles.size())
+    return false;
+  if (!is.next_line(s) || !(s >> variance))
+    return false;
+  zernike z0;
+  if (!read_object(is, z0).empty() || z0.order() != n || z0.get_norm() != zm_norm::raw)
+    return false;
+  z = z0;
+  z.variance = variance;
+  return true;
+}
+
+/** Writes an entry, through a temporary file renamed at the end.
+  @param z The moments, in any normalization (they are saved raw).
+  @return True if the entry was written.
+*/
+bool moment_cache::save(const std::string &key, const mesh &m, int n, const std::string &mode, const zernike &z) const
+{
+  std::random_device rd;
+  const std::string final_path = path(key);
+  const std::string tmp = final_path + "." + std::to_string(rd()) + ".tmp";
+  zernike raw = z;
+  raw.normalize(zm_norm::raw);
+  raw.output = zm_output::real;
+  {
+    smart_output os(tmp);
+    if (!os)
+      return false;
+    os << std::setprecision(std::numeric_limits<double>::max_digits10);
+    os << "ZMCACHE " << key << " " << n << " " << mode << " " << m.triangles.size() << "\n";
+    os << z.variance << "\n";
+    os << raw;
+    if (os.fail()) {
+      remove(tmp.c_str());
+      return false;
+    }
+  }
+  if (rename(tmp.c_str(), final_path.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/** Computes the raw moments of a mesh, using the cache for each connected component.
+  Missing components are computed and saved. The moments of the components are summed.
+  @param m The mesh.
+  @param n The order of the moments.
+  @param mode A description of the computation, see moment_cache::key.
+  @param compute Computes the moments of a component.
+  @param report If not NULL, it receives the number of components and of cache hits.
+  @return The raw moments, with the error estimates of the components summed as variances.
+*/
+zernike moment_cache::integrate(const mesh &m, int n, const std::string &mode,
+                                std::function<zernike(const mesh &)> compute, cache_report *report) const
+{
+  zernike total(n);
+  cache_report rep = {0, 0, 0};
+  for (auto &c: m.components()) {
+    const std::string k = key(c, n, mode);
+    zernike z;
+    rep.components++;
+    if (load(k, c, n, mode, z))
+      rep.hits++;
+    else {
+      z = compute(c);
+      z.normalize(zm_norm::raw);
+      if (!save(k, c, n, mode, z))
+        rep.failed++;
+    }
+    total += z;
+  }
+  if (report)
+    *report = rep;
+  return total;
+}
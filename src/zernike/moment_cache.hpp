@@ -0,0 +1,52 @@
+/** \file moment_cache.hpp
+  An on-disk cache of the Zernike moments of meshes.
+  \author J. Houdayer
+*/
+
+#ifndef MOMENT_CACHE_HPP
+#define MOMENT_CACHE_HPP
+
+#include <functional>
+#include <cstdint>
+#include "mesh.hpp"
+#include "zernike.hpp"
+
+/** Breakdown of the work done by moment_cache::integrate. */
+class cache_report
+{
+public:
+  size_t components; /**< Number of connected components of the mesh. */
+  size_t hits;       /**< Number of components found in the cache. */
+  size_t failed;     /**< Number of components which could not be saved. */
+};
+
+/** A directory keeping the raw moments of meshes, with their error estimates.
+
+  Entries are keyed by a hash of the mesh (coordinates and facets), the order,
+  a string describing the computation (its mode and precision) and the quadrature rules.
+  Each entry is a file named after the hash, written atomically, so several programs may
+  share the same directory. The directory must exist.
+
+  Usage:
+    1. create one instance with the directory and the quadrature rules.
+    2. use moment_cache::integrate with a function computing the moments.
+*/
+class moment_cache
+{
+public:
+  moment_cache(const std::string &directory, const triquad_selector &ts);
+
+  std::string key(const mesh &m, int n, const std::string &mode) const;
+  bool load(const std::string &key, const mesh &m, int n, const std::string &mode, zernike &z) const;
+  bool save(const std::string &key, const mesh &m, int n, const std::string &mode, const zernike &z) const;
+  zernike integrate(const mesh &m, int n, const std::string &mode,
+                    std::function<zernike(const mesh &)> compute, cache_report *report = NULL) const;
+
+private:
+  std::string dir;
+  uint64_t rules; /**< Hash of the quadrature rules. */
+
+  std::string path(const std::string &key) const;
+};
+
+#endif
@@ -4,7 +4,17 @@
 */
 
 #include "moments.hpp"
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
 #include "parallel.hpp"
+#include "hash.hpp"
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238
+#endif
 
 class cloud_sumer:
 public zernike_m_r
@@ -48,6 +58,28 @@ zernike cloud_integrate(const w_cloud &c, int n, int nt, bool verbose)
   return parallel_collect(nt, c.points, sumer, verbose);
 }
 
+/** Computes the Zernike moments of a cloud read by batches of points, like cloud_integrate.
+  Each batch is integrated in parallel as soon as it is read, so that the memory used
+  does not depend on the number of points.
+  @param ps The points, none of them should have been read yet. Check its input for errors afterwards.
+*/
+zernike cloud_stream_integrate(point_stream &ps, int n, int nt, bool verbose)
+{
+  if (n <= 0) {
+    while (ps.next())
+      ;
+    return zernike();
+  }
+  progression prog(ps.batches(), verbose);
+  const cloud_sumer sumer(n);
+  cloud_sumer total(sumer);
+  while (ps.next()) {
+    total.collect(parallel_collect(nt, ps.c.points, sumer));
+    prog.progress();
+  }
+  return total;
+}
+
 class mesh_exact_sumer:
 public zernike_m_int
 {
@@ -69,83 +101,1173 @@ public:
   }
 };
 
+class mesh_geom_sumer:
+public geometric_moments
+{
+public:
+  const mesh &msh;
+
+  mesh_geom_sumer(int n, const mesh &m): geometric_moments(n), msh(m) {}
+  std::string collect(const t_mesh &i)
+  {
+    add_tetrahedron(i.get_triangle(msh));
+    return "";
+  }
+  void collect(const mesh_geom_sumer &ms)
+  {
+    *this += ms;
+  }
+};
+
+/** The moments of one label of mesh_label_sumer. */
+class label_moments:
+public zernike
+{
+public:
+  label_moments(int n): zernike(n) {}
+  void add(const std::vector<double> &z, const std::vector<double> &sh, double weight)
+  { add_core(z, sh, weight); }
+};
+
+/** Integrates facets like mesh_exact_sumer, adding their moments to the set of their label. */
+class mesh_label_sumer:
+public zernike_int2, public spherical_harmonics
+{
+public:
+  const mesh &msh;
+  const std::vector<size_t> &labels;
+  const triquad_scheme &sch;
+  std::vector<label_moments> sets;
+  size_t current; /**< The label of the facet being integrated. */
+
+  mesh_label_sumer(int n, const mesh &m, const std::vector<size_t> &l, size_t k, const triquad_scheme &s):
+  zernike_int2(n), spherical_harmonics(n), msh(m), labels(l), sch(s), sets(k, label_moments(n)), current(0) {}
+
+  void add(const w_vec &p)
+  {
+    s_vec sp = p.v.spherical();
+    if (sp.r != 0) {
+      eval_zr(sp.r, 1 / (sp.r * sp.r * sp.r));
+      eval_sh(sp.theta, sp.phi);
+      sets[current].add(zr, sh, p.weight);
+    }
+  }
+
+  std::string collect(size_t i)
+  {
+    const triangle t = msh.triangles[i].get_triangle(msh);
+    current = labels[i];
+    sch.integrate(t, *this, 3 * t.volume());
+    sets[current].variance += 1e-28;
+    return "";
+  }
+
+  void collect(const mesh_label_sumer &ms)
+  {
+    for (size_t k = 0 ; k < sets.size() ; k++)
+      sets[k] += ms.sets[k];
+  }
+};
+
+/** Integrates the segments of a profile, see profile_integrate. */
+class profile_sumer:
+public zernike_int2, public zernike
+{
+public:
+  const profile &prof;
+  std::vector<double> x, w; /**< Gauss-Legendre rule on [0, 1]. */
+  std::vector<double> y;    /**< Spherical harmonics of order m = 0. */
+
+  profile_sumer(int n, const profile &p): zernike_int2(n), zernike(n), prof(p), y(zernike::N + 2)
+  {
+    gauss_legendre(zernike::N / 2 + 2, x, w);
+  }
+
+  std::string collect(size_t i)
+  {
+    const vec &a = prof.points[i], &b = prof.points[(i + 1) % prof.points.size()];
+    const vec d = b - a;
+    const double c = a.x * d.z - a.z * d.x; // twice the signed area of the triangle joining the origin to the edge
+    if (c == 0)
+      return "";
+    for (size_t k = 0 ; k < x.size() ; k++) {
+      const vec p = a + x[k] * d;
+      const double rho = p.length();
+      if (rho == 0 || p.x == 0)
+        continue;
+      eval_zr(rho, 1 / (rho * rho * rho));
+      legendre(p.z / rho);
+      add_axial(2 * M_PI * w[k] * c * p.x);
+    }
+    variance += 1e-28;
+    return "";
+  }
+
+  void collect(const profile_sumer &ps)
+  {
+    *this += ps;
+  }
+
+private:
+  /** Computes the spherical harmonics of order m = 0 for the given cosine of the colatitude. */
+  void legendre(double t)
+  {
+    double p0 = 1, p1 = t;
+    y[0] = 1;
+    y[1] = t;
+    for (size_t l = 2 ; l < y.size() ; l++) {
+      const double p2 = ((2 * l - 1) * t * p1 - (l - 1) * p0) / l;
+      p0 = p1;
+      p1 = y[l] = p2;
+    }
+    for (size_t l = 0 ; l < y.size() ; l++)
+      y[l] *= sqrt((2 * l + 1) / (4 * M_PI));
+  }
+
+  /** Same as zernike::add_core restricted to m = 0. */
+  void add_axial(double weight)
+  {
+    int idzr = 0;
+    int idz = 0;
+    for (int n2 = 0 ; n2 <= zernike::N / 2 ; n2++)
+      for (int l = 0 ; l <= 2 * n2 + 1 ; l++, idzr++) {
+        zm[idz + l] += weight * zr[idzr] * y[l];
+        idz += 2 * l + 1;
+      }
+  }
+};
+
+/** Accumulates the gradient of a function of the moments over the vertices, see mesh_moment_gradient. */
+class mesh_gradient_sumer:
+public zernike_m_int_gradient
+{
+public:
+  const mesh &msh;
+  const triquad_scheme &sch;
+  std::vector<vec> grad;
+
+  mesh_gradient_sumer(const zernike &dl, const mesh &m, const triquad_scheme &s):
+  zernike_m_int_gradient(dl), msh(m), sch(s), grad(m.points.size()) {}
+
+  std::string collect(const t_mesh &i)
+  {
+    const triangle t = i.get_triangle(msh);
+    const double w = 3 * t.volume();
+    // derivatives of 3 t.volume() with respect to the vertices
+    const vec dw1 = 0.5 * cross(t.p2, t.p3), dw2 = 0.5 * cross(t.p3, t.p1), dw3 = 0.5 * cross(t.p1, t.p2);
+    vec g1, g2, g3, gp;
+    for (auto &q: sch.data) {
+      const w_vec p = q.point(t, w);
+      const double f = q.weight * eval(p.v, gp);
+      g1 += f * dw1 + (p.weight * q.c1) * gp;
+      g2 += f * dw2 + (p.weight * q.c2) * gp;
+      g3 += f * dw3 + (p.weight * q.c3) * gp;
+    }
+    grad[i.i1] += g1;
+    grad[i.i2] += g2;
+    grad[i.i3] += g3;
+    return "";
+  }
+
+  void collect(const mesh_gradient_sumer &ms)
+  {
+    for (size_t i = 0 ; i < grad.size() ; i++)
+      grad[i] += ms.grad[i];
+  }
+};
+
+/** Largest order for which mesh_engine::automatic considers the geometric engine. */
+const int geom_max_order = 30;
+
+/** Largest error estimate accepted from the geometric engine by mesh_engine::automatic. */
+const double geom_tolerance = 1e-10;
+
+/** Chooses the cheapest engine for the exact computation of the moments of a mesh.
+
+  The cost model was fitted on benchmarks, its unit is the time to add one Zernike moment
+  for one integration point. The quadrature engine costs one unit per moment per point
+  of the rule. The geometric engine costs about 4 units per geometric moment per facet,
+  plus the construction of the conversion matrix (about 60 units for each of its
+  roughly \f$N^5/25\f$ coefficients).
+
+  @param facets The number of facets of the mesh.
+  @param n The maximum order of the moments.
+  @param ts The quadrature rules.
+  @return Either mesh_engine::quadrature or mesh_engine::geometric.
+*/
+mesh_engine select_engine(size_t facets, int n, const triquad_selector &ts)
+{
+  if (n > geom_max_order)
+    return mesh_engine::quadrature;
+  const double zm_size = zernike(n).get_zm().size();
+  const double gm_size = (n + 1) * (n + 2) * (n + 3) / 6.;
+  const double quad_cost = facets * ts.get_scheme(n).data.size() * zm_size;
+  const double geom_cost = facets * 4 * gm_size + 60 * pow(n, 5) / 25;
+  return (geom_cost < quad_cost) ? mesh_engine::geometric : mesh_engine::quadrature;
+}
+
+/** Computes the Zernike moments of a mesh from its geometric moments.
+  It is exact up to rounding errors, which grow quickly with the order:
+  check the error estimate of the result.
+*/
+zernike mesh_geom_integrate(const mesh &m, int n, int nt, bool verbose)
+{
+  if (n <= 0)
+    return zernike();
+
+  mesh_geom_sumer sumer(n, m);
+  zernike_m_geom z(n);
+  z.convert(parallel_collect(nt, m.triangles, sumer, verbose));
+  return z;
+}
+
 /** Computes the Zernike moments of a mesh.
-  This suppose that the order sought is not larger than the order of the integration scheme.
+  The quadrature engine supposes that the order sought is not larger than the order
+  of the integration scheme. By default the engine is selected by select_engine,
+  and the quadrature engine is used when the geometric engine is not precise enough.
 */
-zernike mesh_exact_integrate(const mesh &m, int n, const triquad_selector &ts, int nt, bool verbose)
+zernike mesh_exact_integrate(const mesh &m, int n, const triquad_selector &ts, int nt, bool verbose,
+                             mesh_engine engine)
 {
   if (n <= 0)
     return zernike();
-  
+
+  const bool automatic = engine == mesh_engine::automatic;
+  if (automatic)
+    engine = select_engine(m.triangles.size(), n, ts);
+  if (engine == mesh_engine::geometric) {
+    zernike z = mesh_geom_integrate(m, n, nt, verbose);
+    if (!automatic || z.get_error() <= geom_tolerance)
+      return z;
+    if (verbose)
+      std::cerr << "Geometric moments are not precise enough (" << z.get_error()
+                << "), using quadratures" << std::endl;
+  }
   mesh_exact_sumer sumer(n, m, ts.get_scheme(n));
   return parallel_collect(nt, m.triangles, sumer, verbose);
 }
 
-int facet_approx_integrate(const triangle &t, double error, const triquad_selector &ts, zernike_m_int *&za, zernike_m_int *&zb)
-{ 
-  double err = 0;
-  za->reset_zm();
-  const double w = 3 * t.volume();
-  for (auto &s: ts.schemes) {
-    zb->reset_zm();
-    s.integrate(t, *zb, w);
-    zb->finish();
-    err = za->distance(*zb);
-    std::swap(za, zb);
-    if (za->order() <= s.order) {
-      za->variance = 1e-28;
-      return s.order;
-    }
-    else if (err < error) {
-      za->variance = err * err;
-      return s.order;
+/** Computes the Zernike moments of a mesh read by batches of facets, like mesh_exact_integrate.
+  Each batch is integrated in parallel as soon as it is read, the vertices being the only
+  part of the mesh kept whole in memory. When the facets cannot be read again (on the standard
+  input), the automatic engine uses quadratures, as the geometric engine may not be precise enough.
+  @param fs The facets, none of them should have been read yet. Check its input for errors afterwards.
+*/
+zernike mesh_stream_integrate(facet_stream &fs, int n, const triquad_selector &ts, int nt, bool verbose,
+                              mesh_engine engine)
+{
+  if (n <= 0) {
+    while (fs.next())
+      ;
+    return zernike();
+  }
+
+  const bool automatic = engine == mesh_engine::automatic;
+  if (automatic)
+    engine = fs.can_rewind() ? select_engine(fs.facets, n, ts) : mesh_engine::quadrature;
+  if (engine == mesh_engine::geometric) {
+    progression prog(fs.batches(), verbose);
+    const mesh_geom_sumer sumer(n, fs.m);
+    geometric_moments g(n);
+    while (fs.next()) {
+      g += parallel_collect(nt, fs.m.triangles, sumer);
+      prog.progress();
     }
+    zernike_m_geom z(n);
+    z.convert(g);
+    if (!automatic || z.get_error() <= geom_tolerance || !fs.rewind())
+      return z;
+    if (verbose)
+      std::cerr << "Geometric moments are not precise enough (" << z.get_error()
+                << "), using quadratures" << std::endl;
   }
+  progression prog(fs.batches(), verbose);
+  const mesh_exact_sumer sumer(n, fs.m, ts.get_scheme(n));
+  mesh_exact_sumer total(sumer);
+  while (fs.next()) {
+    total.collect(parallel_collect(nt, fs.m.triangles, sumer));
+    prog.progress();
+  }
+  return total;
+}
+
+/** Collects exact sums of the moments of facets for incremental_moments.
+  The moments of each facet are computed alone, then added (or subtracted if sign is -1).
+*/
+class exact_collector
+{
+public:
+  const mesh *msh;
+  const triquad_scheme &sch;
+  const bool geom;
+  const double sign;
+  zernike_m_int z;
+  geometric_moments g;
+  exact_sum sums;
+
+  exact_collector(int n, bool geometric, const triquad_scheme &s, double sgn, const mesh *m = NULL):
+  msh(m), sch(s), geom(geometric), sign(sgn), z(geometric ? 0 : n), g(geometric ? n : 0),
+  sums(geometric ? 2 * g.get_gm().size() : z.get_zm().size() + 1) {}
 
-  const triquad_scheme &s = ts.schemes.back(); 
-  for(int n = 1 ; ; n++) {
-    zb->reset_zm();
-    s.integrate(t, *zb, w, n);
-    zb->finish();
-    err = za->distance(*zb);
-    std::swap(za, zb);
-    if (err < error) {
-      za->variance = err * err;
-      return -n;
+  std::string collect(const t_mesh &i)
+  {
+    return collect(i.get_triangle(*msh));
+  }
+  std::string collect(const triangle &t)
+  {
+    if (geom) {
+      g.reset_gm();
+      g.add_tetrahedron(t);
+      const std::vector<double> &a = g.get_abs_gm();
+      sums.add(g.get_gm(), sign);
+      for (size_t i = 0 ; i < a.size() ; i++)
+        sums.add(a.size() + i, sign * a[i]);
+    }
+    else {
+      z.reset_zm();
+      sch.integrate(t, z, 3 * t.volume());
+      sums.add(z.get_zm(), sign);
+      sums.add(z.get_zm().size(), sign * 1e-28);
     }
+    return "";
+  }
+  void collect(const exact_collector &c)
+  {
+    sums += c.sums;
+  }
+};
+
+/** Constructor.
+  Computes the moments of the mesh, the engine is chosen as in mesh_exact_integrate.
+  @param m The initial mesh.
+  @param n The maximum order of the moments.
+  @param ts The quadrature rules.
+  @param nt The number of threads used.
+  @param verbose If true, shows a progression bar.
+  @param engine The engine used.
+*/
+incremental_moments::incremental_moments(const mesh &m, int n, const triquad_selector &ts, int nt, bool verbose,
+                                         mesh_engine engine):
+N(n), eng(engine), sch(ts.get_scheme(n))
+{
+  const bool automatic = engine == mesh_engine::automatic;
+  if (automatic)
+    eng = select_engine(m.triangles.size(), n, ts);
+  if (eng == mesh_engine::geometric) {
+    sums = parallel_collect(nt, m.triangles, exact_collector(N, true, sch, 1, &m), verbose).sums;
+    const double err = result().get_error();
+    if (!automatic || err <= geom_tolerance)
+      return;
+    if (verbose)
+      std::cerr << "Geometric moments are not precise enough (" << err << "), using quadratures" << std::endl;
+    eng = mesh_engine::quadrature;
   }
+  sums = parallel_collect(nt, m.triangles, exact_collector(N, false, sch, 1, &m), verbose).sums;
+}
+
+/** Adds facets to the mesh.
+  @param facets The facets added.
+  @param nt The number of threads used.
+*/
+void incremental_moments::add(const std::vector<triangle> &facets, int nt)
+{
+  sums += parallel_collect(nt, facets, exact_collector(N, eng == mesh_engine::geometric, sch, 1)).sums;
+}
+
+/** Removes facets from the mesh.
+  @param facets The facets removed, with the vertices in the order used when they were added.
+  @param nt The number of threads used.
+*/
+void incremental_moments::remove(const std::vector<triangle> &facets, int nt)
+{
+  sums += parallel_collect(nt, facets, exact_collector(N, eng == mesh_engine::geometric, sch, -1)).sums;
+}
+
+/** Moves a vertex of the mesh.
+  @param m The mesh, its vertex is moved.
+  @param v The index of the vertex.
+  @param p The new position of the vertex.
+  @param incident The indices of the facets of m containing the vertex.
+*/
+void incremental_moments::move_vertex(mesh &m, size_t v, const vec &p, const std::vector<size_t> &incident)
+{
+  std::vector<triangle> facets;
+  for (auto i: incident)
+    facets.push_back(m.triangles[i].get_triangle(m));
+  remove(facets);
+  m.points[v] = p;
+  facets.clear();
+  for (auto i: incident)
+    facets.push_back(m.triangles[i].get_triangle(m));
+  add(facets);
+}
+
+/** Moments from the exact sums of incremental_moments. */
+class exact_moments:
+public zernike
+{
+public:
+  exact_moments(int n, const exact_sum &sums):
+  zernike(n)
+  {
+    for (size_t i = 0 ; i < zm.size() ; i++)
+      zm[i] = sums.get(i);
+    variance = sums.get(zm.size());
+  }
+};
+
+/** The current moments, as computed by mesh_exact_integrate with the same engine. */
+zernike incremental_moments::result() const
+{
+  if (eng == mesh_engine::quadrature)
+    return exact_moments(N, sums);
+  const std::vector<double> v = sums.get();
+  const size_t half = v.size() / 2;
+  geometric_moments g(N);
+  g.assign(std::vector<double>(v.begin(), v.begin() + half), std::vector<double>(v.begin() + half, v.end()));
+  zernike_m_geom z(N);
+  z.convert(g);
+  return z;
+}
+
+/** The state of one facet during approximate integration.
+  level is the index of the last integration rule used (see facet_level_integrate),
+  err the estimated error of the corresponding moments.
+*/
+class facet_state
+{
+public:
+  int level;
+  double err;
+  bool final;
+};
+
+/** Maximum number of doubles used to keep the moments of refined facets. */
+const size_t approx_cache_size = 1 << 25;
+
+/** Number of facets of the first pass of approx_scheduler integrated between two checkpoints. */
+const size_t checkpoint_chunk = 1 << 14;
+
+/** Integrates one facet with the rule of the given level.
+  Levels below ts.schemes.size() use the corresponding rule,
+  higher levels use the last rule on subdivided triangles.
+*/
+void facet_level_integrate(const triangle &t, int level, const triquad_selector &ts, zernike_m_int &z)
+{
+  const int ns = ts.schemes.size();
+  const double w = 3 * t.volume();
+  z.reset_zm();
+  if (level < ns)
+    ts.schemes[level].integrate(t, z, w);
+  else
+    ts.schemes.back().integrate(t, z, w, level - ns + 1);
+  z.finish();
 }
 
-class mesh_approx_sumer:
+/** Collects refinements of facets for approx_scheduler.
+  It gathers the changes in the moments and the new states of the facets.
+  The error estimate of a facet is the distance between its two last levels.
+*/
+class facet_refiner:
 public zernike
 {
 public:
   const mesh &msh;
   const triquad_selector &sel;
-  const double err;
+  const std::vector<facet_state> &states;
+  std::vector<std::vector<double>> &kept;
+  const bool keep;
   zernike_m_int z1, z2;
-  
-  mesh_approx_sumer(int n, const mesh &m, const triquad_selector &s, double e):
-  zernike(n), msh(m), sel(s), err(e / m.triangles.size()), z1(n), z2(n) {}
-  std::string collect(const t_mesh &i)
+  std::vector<std::pair<size_t, facet_state>> done;
+
+  facet_refiner(int n, const mesh &m, const triquad_selector &s, const std::vector<facet_state> &st,
+                std::vector<std::vector<double>> &k, bool kp):
+  zernike(n), msh(m), sel(s), states(st), kept(k), keep(kp), z1(n), z2(n) {}
+
+  std::string collect(size_t i)
   {
-    const triangle t = i.get_triangle(msh);
-    zernike_m_int *za = &z1, *zb = &z2;
-    const int res = facet_approx_integrate(t, err, sel, za, zb);
-    *this += *za;
-    return " order: " + std::to_string(res);
+    const triangle t = msh.triangles[i].get_triangle(msh);
+    const int ns = sel.schemes.size();
+    const int old = states[i].level;
+    std::vector<double> &prev = kept[i];
+    int level = old + 1;
+    if (old < 0 && sel.schemes[0].order < order())
+      level = 1;
+    facet_state u = {level, 1e-14, level < ns && sel.schemes[level].order >= order()};
+
+    facet_level_integrate(t, level, sel, z1);
+    *this += z1;
+    if (!prev.empty()) {
+      double d = 0;
+      for (size_t j = 0 ; j < zm.size() ; j++) {
+        zm[j] -= prev[j];
+        d = std::max(d, fabs(z1.get_zm()[j] - prev[j]));
+      }
+      if (!u.final)
+        u.err = d;
+    }
+    else if (level > 0) {
+      facet_level_integrate(t, level - 1, sel, z2);
+      if (old >= 0)
+        *this -= z2;
+      if (!u.final)
+        u.err = z1.distance(z2);
+    }
+    if (keep && !u.final)
+      prev = z1.get_zm();
+    else
+      std::vector<double>().swap(prev);
+    done.push_back({i, u});
+    return "";
   }
-  void collect(const mesh_approx_sumer &ms)
+
+  void collect(const facet_refiner &fr)
   {
-    *this += ms;
+    *this += fr;
+    done.insert(done.end(), fr.done.begin(), fr.done.end());
+  }
+};
+
+/** Distributes a global error budget among the facets of a mesh.
+
+  Every facet starts with one of the cheapest rules. Facets are then refined
+  by parallel batches until the total estimated error (the square root of the sum
+  of the facet variances) meets the target. Facets are refined in order of
+  decreasing variance per integration point needed, so that the error decreases
+  as fast as possible with the computation time.
+
+  The moments of refined facets are kept (within approx_cache_size) so that
+  the next refinement does not need to integrate the previous level again.
+  Each facet appears at most once in a batch, so threads update distinct elements of kept.
+
+  With a checkpoint, the state is saved after each batch (and each chunk of the first pass)
+  once the interval has elapsed. Kept moments are not saved: after a restart, refining a
+  facet integrates its previous level again.
+*/
+class approx_scheduler
+{
+public:
+  const mesh &msh;
+  const triquad_selector &sel;
+  const int N, nt;
+  std::vector<facet_state> states;
+  zernike total;
+  double variance;
+  size_t refinements;
+
+  approx_scheduler(const mesh &m, int n, const triquad_selector &ts, int t, approx_checkpoint *c = NULL):
+  msh(m), sel(ts), N(n), nt(t), states(m.triangles.size(), {-1, 0, false}),
+  total(n), variance(0), refinements(0),
+  kept(m.triangles.size()), cache_room(approx_cache_size), points(0), seconds(0), ckpt(c), last_save(0) {}
+
+  void restore();
+  void checkpoint(bool force);
+  void start(bool verbose);
+  bool refine(double error, double time_left = -1);
+  void report(approx_report &r) const;
+  zernike result() const;
+
+  /** Rule order used at the given level, negative for subdivisions of the last rule. */
+  int level_order(int level) const
+  {
+    const int ns = sel.schemes.size();
+    return (level < ns) ? sel.schemes[level].order : ns - level - 1;
+  }
+
+  /** Number of integration points used at the given level. */
+  double level_cost(int level) const
+  {
+    const int ns = sel.schemes.size();
+    if (level < ns)
+      return sel.schemes[level].data.size();
+    return sel.schemes.back().data.size() * pow(4., level - ns + 1);
   }
+
+  /** Number of integration points needed to refine facet i. */
+  double refine_cost(size_t i) const
+  {
+    const int level = states[i].level;
+    return level_cost(level + 1) + ((kept[i].empty()) ? level_cost(level) : 0);
+  }
+
+private:
+  std::priority_queue<std::pair<double, size_t>> queue;
+  std::vector<std::vector<double>> kept;
+  size_t cache_room;
+  double points, seconds; /**< Work done so far, to estimate the time per point. */
+  approx_checkpoint *ckpt;
+  elapsed clock;
+  double last_save;
+
+  void apply(const facet_refiner &fr);
+  std::string key() const;
+  bool save() const;
 };
 
+/** Identifies the mesh, the order and the quadrature rules of a checkpoint. */
+std::string approx_scheduler::key() const
+{
+  fnv_hash h;
+  h << (uint64_t) N << (uint64_t) msh.points.size() << (uint64_t) msh.triangles.size();
+  for (auto &p: msh.points)
+    h << p.x << p.y << p.z;
+  for (auto &t: msh.triangles)
+    h << (uint64_t) t.i1 << (uint64_t) t.i2 << (uint64_t) t.i3;
+  for (auto *v: {&sel.schemes, &sel.secondary_schemes})
+    for (auto &s: *v) {
+      h << (uint64_t) s.order << (uint64_t) s.data.size();
+      for (auto &p: s.data)
+        h << p.weight << p.c1 << p.c2 << p.c3;
+    }
+  std::ostringstream os;
+  os << std::hex << std::setw(16) << std::setfill('0') << h.h;
+  return os.str();
+}
+
+/** Writes the state to the checkpoint file, through a temporary file renamed at the end.
+  The file has a header line, one line by facet (level, error estimate and final flag)
+  and the raw moments.
+  @return True if the file was written.
+*/
+bool approx_scheduler::save() const
+{
+  std::random_device rd;
+  const std::string tmp = ckpt->file + "." + std::to_string(rd()) + ".tmp";
+  zernike raw = total;
+  raw.normalize(zm_norm::raw);
+  raw.output = zm_output::real;
+  {
+    smart_output os(tmp);
+    if (!os)
+      return false;
+    os << std::setprecision(std::numeric_limits<double>::max_digits10);
+    os << "ZMCHECKPOINT " << key() << " " << N << " " << states.size() << " " << refinements << "\n";
+    for (auto &s: states)
+      os << s.level << " " << s.err << " " << s.final << "\n";
+    os << raw;
+    if (os.fail()) {
+      remove(tmp.c_str());
+      return false;
+    }
+  }
+  if (rename(tmp.c_str(), ckpt->file.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/** Saves the state if the interval since the last saving has elapsed.
+  @param force If true, saves in any case.
+*/
+void approx_scheduler::checkpoint(bool force)
+{
+  if (!ckpt || (!force && clock.seconds() < last_save + ckpt->interval))
+    return;
+  if (!save())
+    ckpt->failed++;
+  last_save = clock.seconds();
+}
+
+/** Reads the state from the checkpoint file, if resuming is asked and the file exists.
+  A file which cannot be read or does not match the computation is ignored.
+*/
+void approx_scheduler::restore()
+{
+  if (!ckpt || !ckpt->resume)
+    return;
+  smart_input is(ckpt->file);
+  if (!is)
+    return;
+  ckpt->rejected = true;
+  std::istringstream s;
+  std::string tag, k;
+  int n0;
+  size_t facets, refined;
+  if (!is.next_line(s))
+    return;
+  s >> tag >> k >> n0 >> facets >> refined;
+  if (!s || tag != "ZMCHECKPOINT" || k != key() || n0 != N || facets != states.size())
+    return;
+  std::vector<facet_state> st(facets);
+  for (auto &f: st) {
+    if (!is.next_line(s))
+      return;
+    s >> f.level >> f.err >> f.final;
+    if (!s || f.level < -1)
+      return;
+  }
+  zernike z;
+  if (!read_object(is, z).empty() || z.order() != N || z.get_norm() != zm_norm::raw)
+    return;
+
+  ckpt->rejected = false;
+  states = st;
+  total = z;
+  total.variance = 0;
+  refinements = refined;
+  variance = 0;
+  ckpt->resumed = 0;
+  for (size_t i = 0 ; i < states.size() ; i++)
+    if (states[i].level >= 0) {
+      variance += states[i].err * states[i].err;
+      ckpt->resumed++;
+      if (!states[i].final)
+        queue.push({states[i].err * states[i].err / refine_cost(i), i});
+    }
+}
+
+/** Merges the result of a batch of refinements. */
+void approx_scheduler::apply(const facet_refiner &fr)
+{
+  total += fr;
+  for (auto &d: fr.done) {
+    facet_state &s = states[d.first];
+    variance += d.second.err * d.second.err - s.err * s.err;
+    s = d.second;
+  }
+  for (auto &d: fr.done)
+    if (!d.second.final)
+      queue.push({d.second.err * d.second.err / refine_cost(d.first), d.first});
+}
+
+/** Integrates with the first rules all facets not integrated yet.
+  With a checkpoint, facets are integrated by chunks (without progression bar),
+  the state being saved between them.
+*/
+void approx_scheduler::start(bool verbose)
+{
+  elapsed timer;
+  std::vector<size_t> todo;
+  for (size_t i = 0 ; i < states.size() ; i++)
+    if (states[i].level < 0)
+      todo.push_back(i);
+  const size_t chunk = (ckpt) ? checkpoint_chunk : std::max<size_t>(todo.size(), 1);
+  for (size_t b = 0 ; b < todo.size() ; b += chunk) {
+    const std::vector<size_t> part(todo.begin() + b, todo.begin() + std::min(todo.size(), b + chunk));
+    const bool keep = part.size() * total.get_zm().size() <= cache_room;
+    facet_refiner fr(N, msh, sel, states, kept, keep);
+    apply(parallel_collect(nt, part, fr, verbose && !ckpt));
+    if (keep)
+      for (auto i: part)
+        cache_room -= kept[i].size();
+    points += part.size() * (level_cost(0) + level_cost(1));
+    if (ckpt && verbose)
+      std::cerr << "Integrated " << b + part.size() << " of " << todo.size() << " facets" << std::endl;
+    checkpoint(false);
+  }
+  seconds += timer.seconds();
+}
+
+/** Refines one batch of facets, those which reduce the error the most for their cost.
+  @param error The target for the global error.
+  @param time_left If positive, the batch stops at the first facet whose refinement
+  should not end within this number of seconds (once the time per point is known).
+  @return false if the target is met or nothing can be refined anymore.
+*/
+bool approx_scheduler::refine(double error, double time_left)
+{
+  const double target = error * error;
+  if (variance <= target || queue.empty())
+    return false;
+  elapsed timer;
+  const size_t max_batch = 64 * std::max(nt, 1);
+  const double max_cost = (time_left >= 0 && seconds > 0) ? time_left * points / seconds : HUGE_VAL;
+  std::vector<size_t> batch;
+  double left = variance, cost = 0;
+  while (!queue.empty() && left > target && batch.size() < max_batch) {
+    const size_t i = queue.top().second;
+    const double c = refine_cost(i);
+    if (cost + c > max_cost)
+      break;
+    left -= states[i].err * states[i].err;
+    cost += c;
+    batch.push_back(i);
+    queue.pop();
+  }
+  if (batch.empty())
+    return false;
+
+  size_t before = 0, after = 0;
+  for (auto i: batch)
+    before += kept[i].size();
+  const bool keep = batch.size() * total.get_zm().size() <= cache_room + before;
+  facet_refiner fr(N, msh, sel, states, kept, keep);
+  apply(parallel_collect(nt, batch, fr));
+  for (auto i: batch)
+    after += kept[i].size();
+  cache_room = cache_room + before - after;
+  refinements += batch.size();
+  points += cost;
+  seconds += timer.seconds();
+  checkpoint(false);
+  return true;
+}
 
-zernike mesh_approx_integrate(const mesh &m, int n, double error, const triquad_selector &ts, int nt, bool verbose)
+/** Fills the error breakdown by rule order. */
+void approx_scheduler::report(approx_report &r) const
+{
+  r.refinements = refinements;
+  r.facets.clear();
+  r.variance.clear();
+  for (auto &s: states) {
+    const int o = level_order(s.level);
+    r.facets[o]++;
+    r.variance[o] += s.err * s.err;
+  }
+}
+
+/** The current moments with their error estimate. */
+zernike approx_scheduler::result() const
+{
+  zernike z = total;
+  z.variance = 0;
+  for (auto &s: states)
+    z.variance += s.err * s.err;
+  return z;
+}
+
+/** Computes the Zernike moments of a mesh with the given global error.
+  The error budget is not evenly split between the facets:
+  the facets contributing most to the error estimate are refined first.
+  @param report If not NULL, receives the breakdown of the work and the error by rule order.
+  @param checkpoint If not NULL, the state is saved periodically and at the end, see approx_checkpoint.
+*/
+zernike mesh_approx_integrate(const mesh &m, int n, double error, const triquad_selector &ts,
+                              int nt, bool verbose, approx_report *report, approx_checkpoint *checkpoint)
 {
   if (n <= 0)
     return zernike();
-  mesh_approx_sumer sumer(n,m, ts, error);
-  return parallel_collect(nt, m.triangles, sumer, verbose);
+  approx_scheduler sch(m, n, ts, nt, checkpoint);
+  sch.restore();
+  sch.start(verbose);
+  while (sch.refine(error))
+    ;
+  sch.checkpoint(true);
+  if (verbose)
+    std::cerr << "Refined " << sch.refinements << " facets" << std::endl;
+  if (report)
+    sch.report(*report);
+  return sch.result();
+}
+
+/** Computes the Zernike moments of a mesh progressively within a time limit.
+  It refines the moments as mesh_approx_integrate does and returns the best
+  result reached when the time is over (or when the error target is met).
+  The first pass on all facets with the cheapest rules is always completed.
+  Refinement batches are selected so that they should end before the deadline.
+  @param seconds The time allowed for the computation.
+  @param error The error target, use 0 to refine until the deadline.
+  @param snapshot If not empty, it is called with the current result
+  (and its error estimate) each time the error estimate decreases.
+  @param report If not NULL, receives the breakdown of the work and the error by rule order.
+  @param checkpoint If not NULL, the state is saved periodically and at the end, see approx_checkpoint.
+*/
+zernike mesh_anytime_integrate(const mesh &m, int n, double seconds, double error,
+                               const triquad_selector &ts, std::function<void(const zernike &)> snapshot,
+                               int nt, bool verbose, approx_report *report, approx_checkpoint *checkpoint)
+{
+  if (n <= 0)
+    return zernike();
+  elapsed timer;
+  approx_scheduler sch(m, n, ts, nt, checkpoint);
+  sch.restore();
+  sch.start(verbose);
+  double best = sch.variance;
+  if (snapshot)
+    snapshot(sch.result());
+  while (sch.refine(error, std::max(0., seconds - timer.seconds())))
+    if (snapshot && sch.variance < best) {
+      best = sch.variance;
+      snapshot(sch.result());
+    }
+  sch.checkpoint(true);
+  if (verbose)
+    std::cerr << "Refined " << sch.refinements << " facets in "
+              << timer.seconds() << " s" << std::endl;
+  if (report)
+    sch.report(*report);
+  return sch.result();
+}
+
+/** Number of independent randomized replicates used by mesh_qmc_integrate. */
+const int qmc_replicates = 16;
+
+/** Maximum number of points by replicate used by mesh_qmc_integrate. */
+const size_t qmc_max_points = 1 << 22;
+
+/** Radical inverse of i in the given base, the Halton sequence. */
+double halton(size_t i, int base)
+{
+  double f = 1, r = 0;
+  while (i > 0) {
+    f /= base;
+    r += f * (i % base);
+    i /= base;
+  }
+  return r;
+}
+
+/** Draws points in the cones defined by the origin and the facets of a mesh.
+  Facets are chosen with probability proportional to the absolute volume of their cone,
+  then points are uniform on the facet. The weight of a point is such that the mean
+  of the integrated Zernike polynomials (see zernike_m_int) is the Zernike moments of the mesh.
+*/
+class cone_sampler
+{
+public:
+  const mesh &msh;
+
+  cone_sampler(const mesh &m): msh(m), cdf(m.triangles.size()), total(0)
+  {
+    for (size_t i = 0 ; i < cdf.size() ; i++)
+      cdf[i] = total += fabs(m.triangles[i].get_triangle(m).volume());
+  }
+
+  /** Total absolute volume of the cones, zero if there is nothing to sample. */
+  double volume() const
+  { return total; }
+
+  /** The point corresponding to the given coordinates in the unit cube. */
+  w_vec sample(double u1, double u2, double u3) const
+  {
+    const size_t i = std::min<size_t>(std::upper_bound(cdf.begin(), cdf.end(), u1 * total) - cdf.begin(),
+                                      cdf.size() - 1);
+    const triangle t = msh.triangles[i].get_triangle(msh);
+    if (u2 + u3 > 1) {
+      u2 = 1 - u2;
+      u3 = 1 - u3;
+    }
+    const double w = (t.volume() < 0) ? -3 * total : 3 * total;
+    return {w, t.p1 + u2 * (t.p2 - t.p1) + u3 * (t.p3 - t.p1)};
+  }
+
+private:
+  std::vector<double> cdf; /**< Cumulated absolute volumes. */
+  double total;
+};
+
+/** Combines the randomized replicates of mesh_qmc_integrate. */
+class qmc_estimator:
+public zernike
+{
+public:
+  qmc_estimator(int n): zernike(n) {}
+
+  /** Sets the moments to the mean of the replicates,
+    and the variance to the largest squared standard error of the moments.
+    @param sums The sums of the weighted integrated polynomials of each replicate.
+    @param points The number of points of each replicate.
+  */
+  void average(const std::vector<zernike> &sums, size_t points)
+  {
+    const double r = sums.size();
+    reset_zm();
+    for (auto &s: sums)
+      *this += s;
+    finish();
+    for (auto &v: zm)
+      v /= r * points;
+    std::vector<double> v(zm.size(), 0);
+    for (auto &s: sums) {
+      zernike z = s;
+      z.finish();
+      for (size_t i = 0 ; i < zm.size() ; i++) {
+        const double d = z.get_zm()[i] / points - zm[i];
+        v[i] += d * d;
+      }
+    }
+    variance = *std::max_element(v.begin(), v.end()) / (r * (r - 1));
+  }
+};
+
+/** Estimates the Zernike moments of a mesh by randomized quasi-Monte Carlo sampling.
+
+  Points are drawn in the cones of the facets from a Halton sequence (see cone_sampler).
+  The sequence is randomized by independent random shifts (modulo 1), the dispersion
+  of the resulting replicates gives the standard error of the moments, which is
+  stored in the variance of the result. The number of points increases until the
+  largest standard error is below the target (or a maximum number of points is reached).
+  The computation time depends on the target, not on the number of facets.
+  @param error The target standard error.
+  @param points If not NULL, receives the total number of points used.
+*/
+zernike mesh_qmc_integrate(const mesh &m, int n, double error, int nt, bool verbose, size_t *points)
+{
+  if (points)
+    *points = 0;
+  if (n <= 0)
+    return zernike();
+  const cone_sampler sampler(m);
+  qmc_estimator est(n);
+  if (sampler.volume() == 0)
+    return est;
+
+  std::mt19937_64 gen(1);
+  std::uniform_real_distribution<double> uni;
+  std::vector<vec> shift(qmc_replicates);
+  for (auto &s: shift)
+    s = {uni(gen), uni(gen), uni(gen)};
+
+  std::vector<zernike> sums(qmc_replicates, zernike(n));
+  size_t done = 0, todo = 256;
+  while (true) {
+    parallel_eval<zernike>(nt, sums, [&](size_t r) {
+      zernike_m_int z(n);
+      for (size_t i = done + 1 ; i <= todo ; i++)
+        z.add(sampler.sample(fmod(halton(i, 2) + shift[r].x, 1),
+                             fmod(halton(i, 3) + shift[r].y, 1),
+                             fmod(halton(i, 5) + shift[r].z, 1)));
+      zernike s = sums[r];
+      s += z;
+      return s;
+    });
+    done = todo;
+    est.average(sums, done);
+    if (verbose)
+      std::cerr << "Sampled " << done * qmc_replicates << " points, standard error "
+                << est.get_error() << std::endl;
+    if (est.get_error() <= error || done >= qmc_max_points)
+      break;
+    // needed is infinite or NaN when error * error underflows, so it is clamped before the conversion
+    const double needed = done * est.variance / (error * error);
+    todo = (size_t) std::min({std::max(2. * done, needed), 16. * done, (double) qmc_max_points});
+  }
+  if (points)
+    *points = done * qmc_replicates;
+  return est;
+}
+
+/** Computes the gradient of a function of the moments of a mesh with respect to its vertices.
+  This is the reverse mode derivative of mesh_exact_integrate with the quadrature engine:
+  the derivatives with respect to the moments are first combined into one function of space
+  (see zernike_m_int_gradient), then the quadrature of each facet is differentiated with respect
+  to the positions of its integration points and to its weight. The cost is about the one of
+  computing the moments, whatever the number of vertices.
+  @param m The mesh.
+  @param dl The derivatives of the function with respect to the moments, in any normalization.
+  Their order is the order of the moments.
+  @return The gradient with respect to each vertex.
+*/
+std::vector<vec> mesh_moment_gradient(const mesh &m, const zernike &dl, const triquad_selector &ts,
+                                      int nt, bool verbose)
+{
+  if (dl.order() <= 0)
+    return std::vector<vec>(m.points.size());
+  mesh_gradient_sumer sumer(dl, m, ts.get_scheme(dl.order()));
+  return parallel_collect(nt, m.triangles, sumer, verbose).grad;
+}
+
+/** Computes the Zernike moments of the parts of a mesh in one pass.
+  Each facet is integrated once with the quadrature engine, the radial parts and
+  spherical harmonics of each integration point being added to the moments of its label only.
+  The moments of the whole mesh are the sum of the moments of all labels.
+  @param m The mesh.
+  @param labels The label of each facet, between 0 and k - 1.
+  @param k The number of labels.
+  @return The moments of the facets of each label.
+*/
+std::vector<zernike> mesh_labeled_integrate(const mesh &m, const std::vector<size_t> &labels, size_t k, int n,
+                                            const triquad_selector &ts, int nt, bool verbose)
+{
+  if (n <= 0)
+    return std::vector<zernike>(k);
+  std::vector<size_t> facets(m.triangles.size());
+  for (size_t i = 0 ; i < facets.size() ; i++)
+    facets[i] = i;
+  mesh_label_sumer sumer(n, m, labels, k, ts.get_scheme(n));
+  const mesh_label_sumer res = parallel_collect(nt, facets, sumer, verbose);
+  return std::vector<zernike>(res.sets.begin(), res.sets.end());
+}
+
+/** Computes the Zernike moments of a solid of revolution around the z axis.
+  Only the moments with m = 0 are not zero. The volume is integrated in the (r, z) plane,
+  as a sum of triangles joining the origin to the edges of the profile, each one reduced
+  to a line integral of the integrated radial parts (see zernike_int2) along its edge.
+  The integrand is a polynomial of the position along the edge, so a Gauss-Legendre rule
+  with N / 2 + 2 nodes is exact. The cost is linear in the number of edges.
+  The orientation of the profile does not matter.
+*/
+zernike profile_integrate(const profile &p, int n, int nt, bool verbose)
+{
+  if (n <= 0)
+    return zernike();
+  std::vector<size_t> edges(p.points.size());
+  for (size_t i = 0 ; i < edges.size() ; i++)
+    edges[i] = i;
+  profile_sumer sumer(n, p);
+  zernike z = parallel_collect(nt, edges, sumer, verbose);
+  if (p.volume() < 0)
+    z *= -1;
+  return z;
+}
+
+/** Computes the Zernike moments of a mesh invariant by a group of symmetries.
+  Only one facet by orbit of the group is integrated. The moments of the facets whose stabilizer
+  has k elements are weighted by |G|/k, then averaged over the group (see zernike::symmetrize),
+  which also sets to zero the moments forbidden by the group.
+  If the mesh is not invariant, all facets are integrated.
+  @param m The mesh.
+  @param g The symmetry group.
+  @param compute Computes the moments of a mesh (of any part of m).
+  @param report If not NULL, receives the number of facets integrated.
+*/
+zernike mesh_symmetric_integrate(const mesh &m, const symmetry_group &g,
+                                 std::function<zernike(const mesh &)> compute, symmetry_report *report)
+{
+  const size_t none = -1, order = g.size();
+  const double tol = 1e-9 * m.radius();
+  symmetry_report rep = {true, m.triangles.size()};
+  std::vector<std::vector<size_t>> perms(order);
+  for (size_t i = 1 ; i < order && rep.invariant ; i++)
+    rep.invariant = m.facet_permutation(g.elements[i], tol, perms[i]);
+
+  // one representative by orbit, gathered by size of stabilizer
+  std::map<size_t, mesh> parts;
+  if (rep.invariant) {
+    std::vector<size_t> orbit(m.triangles.size(), none);
+    rep.integrated = 0;
+    for (size_t f = 0 ; f < m.triangles.size() && rep.invariant ; f++) {
+      if (orbit[f] != none)
+        continue;
+      size_t count = 1;
+      orbit[f] = f;
+      for (size_t i = 1 ; i < order ; i++)
+        if (orbit[perms[i][f]] == none) {
+          orbit[perms[i][f]] = f;
+          count++;
+        }
+      if (order % count != 0)
+        rep.invariant = false;
+      mesh &p = parts[order / count];
+      if (p.points.empty())
+        p.points = m.points;
+      p.triangles.push_back(m.triangles[f]);
+      rep.integrated++;
+    }
+  }
+  if (!rep.invariant) {
+    rep.integrated = m.triangles.size();
+    if (report)
+      *report = rep;
+    return compute(m);
+  }
+
+  zernike z;
+  bool first = true;
+  for (auto &p: parts) {
+    zernike zp = compute(p.second);
+    zp *= (double) order / p.first;
+    if (first)
+      z = zp;
+    else
+      z += zp;
+    first = false;
+  }
+  if (first)
+    z = compute(m);
+  z.symmetrize(g.elements);
+  if (report)
+    *report = rep;
+  return z;
 }
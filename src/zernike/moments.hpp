@@ -6,12 +6,117 @@
 #ifndef MOMENTS_HPP
 #define MOMENTS_HPP
 
+#include <map>
+#include <functional>
 #include "mesh.hpp"
 #include "zernike.hpp"
+#include "geometric.hpp"
+#include "exact_sum.hpp"
+
+/** Engines for the exact computation of the moments of a mesh.
+  quadrature integrates each facet with a quadrature rule,
+  geometric converts the geometric moments of the mesh,
+  automatic selects the cheapest one (see select_engine).
+*/
+enum class mesh_engine {automatic, quadrature, geometric};
+
+/** Breakdown of the work done by mesh_approx_integrate. */
+class approx_report
+{
+public:
+  size_t refinements;             /**< Number of facet refinements after the first pass. */
+  std::map<int, size_t> facets;   /**< Number of facets by final rule order (-n for n subdivisions of the last rule). */
+  std::map<int, double> variance; /**< Error variance contributed by the facets of each rule order. */
+};
+
+/** Periodic saving of the state of mesh_approx_integrate and mesh_anytime_integrate.
+
+  The state (the raw moments, the rule level and error estimate of each facet) is written
+  to a file through a temporary file renamed at the end, so that an interrupted computation
+  can be resumed, possibly with another error target or time budget. The file is checked
+  against the mesh, the order and the quadrature rules before being used.
+*/
+class approx_checkpoint
+{
+public:
+  std::string file; /**< The checkpoint file. */
+  bool resume;      /**< If true, starts from the state saved in the file, if it exists. */
+  double interval;  /**< Minimum number of seconds between two savings. */
+  size_t resumed;   /**< Set to the number of facets found already integrated in the file. */
+  bool rejected;    /**< Set if the file exists but cannot be used. */
+  size_t failed;    /**< Set to the number of savings which failed. */
+
+  approx_checkpoint(const std::string &f, bool r, double i = 60):
+  file(f), resume(r), interval(i), resumed(0), rejected(false), failed(0) {}
+};
+
+/** Breakdown of the work done by mesh_symmetric_integrate. */
+class symmetry_report
+{
+public:
+  bool invariant;    /**< True if the mesh is invariant by the group. */
+  size_t integrated; /**< Number of facets integrated. */
+};
+
+/** Exact and incremental Zernike moments of a mesh.
+
+  The moments of each facet are computed by the quadrature or the geometric engine
+  and accumulated with exact_sum, so that the result depends neither on the order of the
+  facets nor on the number of threads. Facets can then be removed or added at a cost
+  proportional to their number: the result is bit for bit the one of a full computation
+  on the edited mesh, provided removed facets are given with the same vertices,
+  in the same order, as when they were added.
+
+  Usage:
+    1. create one instance with the initial mesh.
+    2. use incremental_moments::add, incremental_moments::remove or incremental_moments::move_vertex.
+    3. get the moments with incremental_moments::result.
+    4. go to step 2.
+*/
+class incremental_moments
+{
+public:
+  incremental_moments(const mesh &m, int n, const triquad_selector &ts, int nt = 1, bool verbose = false,
+                      mesh_engine engine = mesh_engine::automatic);
+
+  /** The engine used, either mesh_engine::quadrature or mesh_engine::geometric. */
+  mesh_engine engine() const
+  { return eng; }
+
+  void add(const std::vector<triangle> &facets, int nt = 1);
+  void remove(const std::vector<triangle> &facets, int nt = 1);
+  void move_vertex(mesh &m, size_t v, const vec &p, const std::vector<size_t> &incident);
+  zernike result() const;
+
+private:
+  int N;
+  mesh_engine eng;
+  const triquad_scheme &sch;
+  exact_sum sums; /**< The raw moments and the variance, or the geometric moments and their absolute values. */
+};
 
 zernike cloud_integrate(const cloud &c, int n, int nt = 1, bool verbose = false);
 zernike cloud_integrate(const w_cloud &c, int n, int nt = 1, bool verbose = false);
-zernike mesh_exact_integrate(const mesh &m, int n, const triquad_selector &ts, int nt = 1, bool verbose = false);
-zernike mesh_approx_integrate(const mesh &m, int n, double error, const triquad_selector &ts, int nt = 1, bool verbose = false);
+zernike cloud_stream_integrate(point_stream &ps, int n, int nt = 1, bool verbose = false);
+mesh_engine select_engine(size_t facets, int n, const triquad_selector &ts);
+zernike mesh_geom_integrate(const mesh &m, int n, int nt = 1, bool verbose = false);
+zernike mesh_exact_integrate(const mesh &m, int n, const triquad_selector &ts, int nt = 1, bool verbose = false,
+                             mesh_engine engine = mesh_engine::automatic);
+zernike mesh_stream_integrate(facet_stream &fs, int n, const triquad_selector &ts, int nt = 1, bool verbose = false,
+                              mesh_engine engine = mesh_engine::automatic);
+zernike mesh_qmc_integrate(const mesh &m, int n, double error, int nt = 1, bool verbose = false, size_t *points = NULL);
+zernike mesh_approx_integrate(const mesh &m, int n, double error, const triquad_selector &ts, int nt = 1, bool verbose = false, approx_report *report = NULL,
+                              approx_checkpoint *checkpoint = NULL);
+std::vector<vec> mesh_moment_gradient(const mesh &m, const zernike &dl, const triquad_selector &ts,
+                                      int nt = 1, bool verbose = false);
+std::vector<zernike> mesh_labeled_integrate(const mesh &m, const std::vector<size_t> &labels, size_t k, int n,
+                                            const triquad_selector &ts, int nt = 1, bool verbose = false);
+zernike profile_integrate(const profile &p, int n, int nt = 1, bool verbose = false);
+zernike mesh_symmetric_integrate(const mesh &m, const symmetry_group &g,
+                                 std::function<zernike(const mesh &)> compute, symmetry_report *report = NULL);
+zernike mesh_anytime_integrate(const mesh &m, int n, double seconds, double error, const triquad_selector &ts,
+                               std::function<void(const zernike &)> snapshot = nullptr,
+                               int nt = 1, bool verbose = false, approx_report *report = NULL,
+                               approx_checkpoint *checkpoint = NULL);
 
 #endif
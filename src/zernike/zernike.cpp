@@ -7,6 +7,11 @@
 #include <sstream>
 #include <iomanip>
 #include <numeric>
+#include <functional>
+#include <memory>
+#include <climits>
+#include <utility>
+#include "cache.hpp"
 
 #ifndef M_PI
 #define M_PI 3.141592653589793238
@@ -76,6 +81,177 @@ void spherical_harmonics::eval_sh(double theta, double phi)
   }
 }
 
+/** Computes the rotation matrices of spherical harmonics for all orders up to n
+  with the recursion of Ivanic and Ruedenberg (J. Phys. Chem. 100, 6342 (1996)
+  and 102, 9099 (1998)).
+
+  The recursion is written for real spherical harmonics with positive coefficients
+  on (y, z, x) at order 1, those of spherical_harmonics differ by a factor \f$(-1)^m\f$.
+  @param m A rotation matrix.
+  @param n The maximum order.
+  @return The matrices, element m1, m2 of order l is at index (m1 + l) * (2l + 1) + m2 + l.
+*/
+static std::vector<std::vector<double>> ivanic_ruedenberg(const mat &m, int n)
+{
+  std::vector<std::vector<double>> d(n + 1);
+  for (int l = 0 ; l <= n ; l++)
+    d[l].assign((2 * l + 1) * (2 * l + 1), 0);
+  auto r = [&](int l, int m1, int m2) -> double &
+    { return d[l][(m1 + l) * (2 * l + 1) + m2 + l]; };
+  d[0][0] = 1;
+  if (n == 0)
+    return d;
+
+  const vec rows[3] = {m.my, m.mz, m.mx};
+  for (int i = -1 ; i <= 1 ; i++) {
+    const vec &v = rows[i + 1];
+    r(1, i, -1) = v.y;
+    r(1, i, 0) = v.z;
+    r(1, i, 1) = v.x;
+  }
+  // the function P of Ivanic and Ruedenberg
+  auto p = [&](int i, int l, int a, int b) {
+    if (b == l)
+      return r(1, i, 1) * r(l - 1, a, l - 1) - r(1, i, -1) * r(l - 1, a, 1 - l);
+    if (b == -l)
+      return r(1, i, 1) * r(l - 1, a, 1 - l) + r(1, i, -1) * r(l - 1, a, l - 1);
+    return r(1, i, 0) * r(l - 1, a, b);
+  };
+  for (int l = 2 ; l <= n ; l++)
+    for (int m1 = -l ; m1 <= l ; m1++) {
+      const int am = abs(m1);
+      const double z = (m1 == 0);
+      for (int m2 = -l ; m2 <= l ; m2++) {
+        const double den = (abs(m2) < l) ? (l + m2) * (l - m2) : 2 * l * (2 * l - 1);
+        const double u = sqrt((l + m1) * (l - m1) / den);
+        const double v = 0.5 * sqrt((1 + z) * (l + am - 1) * (l + am) / den) * (1 - 2 * z);
+        const double w = -0.5 * sqrt((l - am - 1) * (l - am) / den) * (1 - z);
+        double s = 0;
+        if (u != 0)
+          s += u * p(0, l, m1, m2);
+        if (v != 0) {
+          if (m1 == 0)
+            s += v * (p(1, l, 1, m2) + p(-1, l, -1, m2));
+          else if (m1 > 0)
+            s += v * (p(1, l, m1 - 1, m2) * sqrt(1 + (m1 == 1)) - p(-1, l, 1 - m1, m2) * (m1 != 1));
+          else
+            s += v * (p(1, l, m1 + 1, m2) * (m1 != -1) + p(-1, l, -m1 - 1, m2) * sqrt(1 + (m1 == -1)));
+        }
+        if (w != 0) {
+          if (m1 > 0)
+            s += w * (p(1, l, m1 + 1, m2) + p(-1, l, -m1 - 1, m2));
+          else
+            s += w * (p(1, l, m1 - 1, m2) - p(-1, l, 1 - m1, m2));
+        }
+        r(l, m1, m2) = s;
+      }
+    }
+  for (int l = 1 ; l <= n ; l++)
+    for (int m1 = -l ; m1 <= l ; m1++)
+      for (int m2 = -l ; m2 <= l ; m2++)
+        if ((m1 + m2) & 1)
+          r(l, m1, m2) = -r(l, m1, m2);
+  return d;
+}
+
+/** The matrices J of wigner_rotation, for the rotation bringing the z axis on the y axis. */
+static const std::vector<std::vector<double>> &wigner_j(int n)
+{
+  static object_cache<int, std::vector<std::vector<double>>> cache;
+  return cache.get(n, [](int k) {
+    return ivanic_ruedenberg({{1, 0, 0}, {0, 0, 1}, {0, -1, 0}}, k); });
+}
+
+/** Constructor.
+  @param m A rotation matrix, possibly composed with an inversion (if its determinant is negative).
+  @param n Maximum order needed. Should be positive.
+*/
+wigner_rotation::wigner_rotation(const mat &m, int n):
+N(n), parity(1), j(wigner_j(n)),
+ca(n + 1), sa(n + 1), cb(n + 1), sb(n + 1), cg(n + 1), sg(n + 1)
+{
+  mat r = m;
+  if (dot(m.mx, cross(m.my, m.mz)) < 0) {
+    parity = -1;
+    r = -1 * m;
+  }
+  // Euler angles, with alpha + gamma and alpha - gamma from the upper left block for stability
+  const double beta = atan2(sqrt(r.mx.z * r.mx.z + r.my.z * r.my.z), r.mz.z);
+  const double sum = atan2(r.my.x - r.mx.y, r.mx.x + r.my.y);
+  const double diff = atan2(-(r.my.x + r.mx.y), r.my.y - r.mx.x);
+  double alpha = (sum + diff) / 2;
+  double gamma = (sum - diff) / 2;
+  if (cos(alpha) * r.mx.z + sin(alpha) * r.my.z < 0) {
+    alpha += M_PI;
+    gamma += M_PI;
+  }
+  for (int l = 0 ; l <= N ; l++) {
+    ca[l] = cos(l * alpha);
+    sa[l] = sin(l * alpha);
+    cb[l] = cos(l * beta);
+    sb[l] = sin(l * beta);
+    cg[l] = cos(l * gamma);
+    sg[l] = sin(l * gamma);
+  }
+}
+
+/** Applies a rotation around the z axis, with the given cosines and sines of m times the angle. */
+static void rotate_z(int l, const std::vector<double> &c, const std::vector<double> &s, double *v)
+{
+  for (int m = 1 ; m <= l ; m++) {
+    const double p = v[l + m], q = v[l - m];
+    v[l + m] = c[m] * p - s[m] * q;
+    v[l - m] = s[m] * p + c[m] * q;
+  }
+}
+
+/** Applies the rotation to the coefficients of order l.
+  @param l The order, between 0 and N.
+  @param in The coefficients for m = -l .. l.
+  @param out The rotated coefficients for m = -l .. l, it should not overlap with in.
+*/
+void wigner_rotation::apply(int l, const double *in, double *out) const
+{
+  const int s = 2 * l + 1;
+  const std::vector<double> &jl = j[l];
+  std::vector<double> t(in, in + s);
+  rotate_z(l, cg, sg, t.data());
+  for (int m = 0 ; m < s ; m++) {
+    double v = 0;
+    for (int k = 0 ; k < s ; k++)
+      v += jl[k * s + m] * t[k];
+    out[m] = v;
+  }
+  rotate_z(l, cb, sb, out);
+  for (int m = 0 ; m < s ; m++) {
+    double v = 0;
+    for (int k = 0 ; k < s ; k++)
+      v += jl[m * s + k] * out[k];
+    t[m] = v;
+  }
+  rotate_z(l, ca, sa, t.data());
+  const double f = (l & 1) ? parity : 1;
+  for (int m = 0 ; m < s ; m++)
+    out[m] = f * t[m];
+}
+
+/** The rotation matrix of order l.
+  @return Element m1, m2 is at index (m1 + l) * (2l + 1) + m2 + l.
+*/
+std::vector<double> wigner_rotation::matrix(int l) const
+{
+  const int s = 2 * l + 1;
+  std::vector<double> d(s * s), e(s, 0), c(s);
+  for (int m2 = 0 ; m2 < s ; m2++) {
+    e[m2] = 1;
+    apply(l, e.data(), c.data());
+    e[m2] = 0;
+    for (int m1 = 0 ; m1 < s ; m1++)
+      d[m1 * s + m2] = c[m1];
+  }
+  return d;
+}
+
 /** Constructor.
   @param n Maximum order needed. Should be positive.
 */
@@ -158,7 +334,7 @@ void zernike_r::eval_zr(double r, double weight)
   @param n Maximum order needed. Should be positive.
 */
 zernike_int0::zernike_int0(int n):
-zernike_radial(n), help((N / 2 + 1) * (N / 2 + 2), {0, 0}), base_r(n+1)
+zernike_radial(n), help((N / 2 + 1) * (N / 2 + 2), {0, 0}), base_r(n+2)
 {
   int i = 0;
   for (int n2 = 0 ; n2 <= N / 2 ; n2++)
@@ -233,6 +409,83 @@ void zernike_int2::eval_zr(double r, double weight)
   }
 }
 
+/** Nodes and weights of the Gauss-Legendre quadrature on [0, 1].
+  @param k The number of nodes, exact for polynomials up to degree 2k - 1.
+  @param x The nodes.
+  @param w The weights.
+*/
+void gauss_legendre(int k, std::vector<double> &x, std::vector<double> &w)
+{
+  x.resize(k);
+  w.resize(k);
+  for (int i = 0 ; i < k ; i++) {
+    // Newton iterations on the Legendre polynomial P_k on [-1, 1]
+    double t = cos(M_PI * (i + 0.75) / (k + 0.5)), dp = 1;
+    for (int it = 0 ; it < 100 ; it++) {
+      double p0 = 1, p1 = t;
+      for (int j = 2 ; j <= k ; j++) {
+        const double p2 = ((2 * j - 1) * t * p1 - (j - 1) * p0) / j;
+        p0 = p1;
+        p1 = p2;
+      }
+      dp = k * (t * p1 - p0) / (t * t - 1);
+      const double dt = p1 / dp;
+      t -= dt;
+      if (fabs(dt) < 1e-16)
+        break;
+    }
+    x[i] = 0.5 * (1 - t);
+    w[i] = 1 / ((1 - t * t) * dp * dp);
+  }
+}
+
+/** Constructor.
+  @param n Maximum order needed. Should be positive.
+  @param scale The scaling factor, between 0 and 1.
+*/
+zernike_scaling::zernike_scaling(int n, double scale):
+N(n), s(scale), a(n + 1), row_norm(0)
+{
+  std::vector<double> x, w;
+  gauss_legendre(N + 2, x, w);
+  zernike_r zs(N), z1(N);
+  const double s3 = s * s * s;
+  for (int l = 0 ; l <= N ; l++) {
+    const int k = (N - l) / 2 + 1;
+    a[l].assign(k * k, 0);
+  }
+  for (size_t i = 0 ; i < x.size() ; i++) {
+    zs.eval_zr(s * x[i]);
+    z1.eval_zr(x[i], w[i] * x[i] * x[i]);
+    for (int l = 0 ; l <= N ; l++) {
+      const int k = (N - l) / 2 + 1;
+      for (int i1 = 0 ; i1 < k ; i1++)
+        for (int i2 = 0 ; i2 <= i1 ; i2++)
+          a[l][i1 * k + i2] += zs.get(l + 2 * i1, l) * z1.get(l + 2 * i2, l);
+    }
+  }
+  for (int l = 0 ; l <= N ; l++) {
+    const int k = (N - l) / 2 + 1;
+    for (int i1 = 0 ; i1 < k ; i1++) {
+      double norm = 0;
+      for (int i2 = 0 ; i2 <= i1 ; i2++) {
+        a[l][i1 * k + i2] *= s3 * (2 * (l + 2 * i2) + 3);
+        norm += fabs(a[l][i1 * k + i2]);
+      }
+      row_norm = std::max(row_norm, norm);
+    }
+  }
+}
+
+/** The scaling for the given order and factor.
+  It is built on first use and cached for later calls.
+*/
+const zernike_scaling &zernike_scaling::get(int n, double scale)
+{
+  static object_cache<std::pair<int, double>, zernike_scaling> cache;
+  return cache.get({n, scale}, [](const std::pair<int, double> &k) { return zernike_scaling(k.first, k.second); });
+}
+
 /** Output operator for \a zm_norm. */
 std::ostream &operator <<(std::ostream &os, zm_norm norm)
 {
@@ -364,6 +617,190 @@ bool real_out(zm_output output)
   return output == zm_output::real || output == zm_output::real_p;
 }
 
+/** Version of the binary formats ZMB, ZRB and ZSB. */
+const uint32_t binary_version = 1;
+
+/** Size of the header of the binary formats, including the line with their name. */
+const size_t binary_header_size = 32;
+
+/** Writes moments or invariants in binary format.
+ Format:
+ ZMB        <-- a line with the name of the format: ZMB, ZRB or ZSB
+ then little endian numbers:
+ version    <-- 4 bytes unsigned integer, currently 1
+ norm       <-- 4 bytes integer, the value of zm_norm
+ N          <-- 4 bytes integer, the maximum order
+ output     <-- 4 bytes integer, the value of zm_output (0 for invariants)
+ 0          <-- 4 bytes reserved
+ count      <-- 8 bytes unsigned integer, the number of values
+ values     <-- 8 bytes floating point numbers, in the storage order of the class
+ Like in the text formats, comment lines may come before the first line.
+*/
+static void write_binary_data(std::ostream &os, const std::string &tag, zm_norm norm, int n, int output,
+                              const std::vector<double> &v)
+{
+  std::string buf = tag + "\n";
+  put_le<uint32_t>(buf, binary_version);
+  put_le<int32_t>(buf, (int32_t) norm);
+  put_le<int32_t>(buf, n);
+  put_le<int32_t>(buf, output);
+  put_le<uint32_t>(buf, 0);
+  put_le<uint64_t>(buf, v.size());
+  os.write(buf.data(), buf.size());
+  if (little_endian())
+    os.write((const char *) v.data(), v.size() * sizeof(double));
+  else {
+    buf.clear();
+    for (auto x: v)
+      put_le(buf, x);
+    os.write(buf.data(), buf.size());
+  }
+}
+
+/** Reads moments or invariants in binary format, see write_binary_data.
+  Files are mapped in memory and the values copied from the mapping at once,
+  other inputs (like standard input) are read directly.
+  The copy is kept rather than a view on the mapping: the objects own their storage
+  and outlive the file, the values are not aligned when comment lines precede the
+  header, and big endian machines need to convert them anyway.
+  @param tag The name of the format.
+  @param norm Receives the normalization.
+  @param n Receives the maximum order.
+  @param output Receives the output mode.
+  @param size The number of values expected for a given order.
+  @param v Receives the values.
+  @return is, failed if the header or the size of the file are wrong.
+*/
+static smart_input &read_binary_data(smart_input &is, const std::string &tag, zm_norm &norm, int &n, int &output,
+                                     std::function<double(int)> size, std::vector<double> &v)
+{
+  std::istringstream s;
+  size_t lines = 0;
+  is.peek_line(s);
+  const std::streamoff pos = is.tell(lines);
+  std::unique_ptr<mapped_input> mi;
+  char head[binary_header_size];
+  if (pos >= 0) {
+    mi.reset(new mapped_input(is.name));
+    if (!*mi || mi->size() < (size_t) pos + binary_header_size)
+      return is.failed();
+    memcpy(head, mi->content() + pos, binary_header_size);
+  }
+  else {
+    is.next_line(s); // the line with the name of the format
+    memcpy(head, (tag + "\n").data(), tag.size() + 1);
+    if (!is.input->read(head + tag.size() + 1, binary_header_size - tag.size() - 1))
+      return is.failed();
+  }
+  if (std::string(head, tag.size() + 1) != tag + "\n" || get_le<uint32_t>(head + 4) != binary_version)
+    return is.failed();
+  const int32_t nm = get_le<int32_t>(head + 8);
+  n = get_le<int32_t>(head + 12);
+  output = get_le<int32_t>(head + 16);
+  const uint64_t count = get_le<uint64_t>(head + 24);
+  if (nm < 0 || nm > (int) zm_norm::dual_n || n < 0 || (double) count != size(n))
+    return is.failed();
+  norm = (zm_norm) nm;
+
+  if (mi) {
+    const std::streamoff start = pos + binary_header_size;
+    if ((mi->size() - start) / sizeof(double) < count)
+      return is.failed();
+    v.resize(count);
+    const char *p = mi->content() + start;
+    if (little_endian())
+      memcpy(v.data(), p, count * sizeof(double));
+    else
+      for (size_t i = 0 ; i < count ; i++)
+        v[i] = get_le<double>(p + i * sizeof(double));
+    is.seek(start + count * sizeof(double), lines + 1);
+  }
+  else {
+    v.clear();
+    char b[sizeof(double)];
+    for (uint64_t i = 0 ; i < count ; i++) {
+      if (!is.input->read(b, sizeof(double)))
+        return is.failed();
+      v.push_back(get_le<double>(b));
+    }
+  }
+  return is;
+}
+
+/** True if the next line of the input is the name of a binary format. */
+static bool binary_tag(smart_input &is, const std::string &tag)
+{
+  std::istringstream s;
+  std::string t;
+  return is.peek_line(s) && (s >> t) && t == tag;
+}
+
+/** Gives the lines of a ZM, ZRI or ZSI file following the line with the name of the format.
+  The text is parsed in place by mapped_input, which is much faster than through streams:
+  files are mapped in memory, other inputs (like standard input) are read whole into memory.
+  @return The lines, or NULL if the input could not be read.
+*/
+static std::unique_ptr<mapped_input> text_lines(smart_input &is)
+{
+  std::istringstream s;
+  size_t lines = 0;
+  is.peek_line(s);
+  const std::streamoff pos = is.tell(lines);
+  std::unique_ptr<mapped_input> mi;
+  if (pos >= 0) {
+    mi.reset(new mapped_input(is.name, pos, lines));
+    if (*mi && mi->next_line())
+      return mi;
+  }
+  if (!is.next_line(s))
+    return nullptr;
+  mi.reset(new mapped_input(*is.input, is.line_count));
+  if (!*mi)
+    return nullptr;
+  return mi;
+}
+
+/** Reads the second line of a ZM, ZRI or ZSI file: the normalization, the maximum order
+  and, for ZM (when output is not NULL), the output mode.
+  @return False if the line is invalid.
+*/
+static bool read_text_header(mapped_input &mi, zm_norm &norm, int &n, zm_output *output)
+{
+  std::string w;
+  long n0;
+  if (!mi.next_line() || !mi.read(w))
+    return false;
+  std::istringstream s(w);
+  s >> norm;
+  if (!s || !mi.read(n0) || n0 < 0 || n0 > INT_MAX)
+    return false;
+  n = n0;
+  if (output == NULL)
+    return true;
+  if (!mi.read(w))
+    return false;
+  s.clear();
+  s.str(w);
+  s >> *output;
+  return (bool) s;
+}
+
+/** Leaves the input at the line reached in the text read by text_lines.
+  @param ok If false, the input is marked as failed on this line, as when it is read line by line.
+*/
+static smart_input &text_end(smart_input &is, const mapped_input &mi, bool ok)
+{
+  is.seek(mi.tell(), mi.line_count);
+  is.line_count = mi.line_count;
+  if (ok)
+    return is;
+  if (mi.eof())
+    is.input->setstate(std::ios_base::eofbit | std::ios_base::failbit);
+  else
+    is.failed();
+  return is;
+}
+
 /** Constructor.
   @param n Maximum order needed. Should be positive.
 */
@@ -544,6 +981,133 @@ zernike &zernike::operator +=(const zernike &z)
   return *this;
 }
 
+/** Multiplies the moments, the error estimate follows. */
+zernike &zernike::operator *=(double s)
+{
+  for (auto &v: zm)
+    v *= s;
+  variance *= s * s;
+  return *this;
+}
+
+/** Subtracts moments, the variances still add up. */
+zernike &zernike::operator -=(const zernike &z)
+{
+  if (norm != z.get_norm())
+    return *this;
+  const std::vector<double> &z2 = z.get_zm();
+  const size_t n = std::min(zm.size(), z2.size());
+  for (size_t i = 0 ; i != n ; i++)
+    zm[i] -= z2[i];
+  variance += z.variance;
+  return *this;
+}
+
+/** Rotates the moments.
+  The result is the moments of the shape transformed by the matrix of the rotation.
+  It costs \f$O(N^4)\f$ operations.
+  @param w The rotation, its order should not be less than the order of the moments.
+  @return false if the order of the rotation is too low, the moments are then unchanged.
+*/
+bool zernike::rotate(const wigner_rotation &w)
+{
+  if (w.order() < N)
+    return false;
+  finish();
+  std::vector<double> out(2 * N + 3);
+  for (int n = 0 ; n <= N ; n++)
+    for (int l = n & 1 ; l <= n ; l += 2) {
+      double *v = zm.data() + index(n, l, -l);
+      w.apply(l, v, out.data());
+      std::copy(out.begin(), out.begin() + 2 * l + 1, v);
+    }
+  return true;
+}
+
+/** Rotates the moments by the given matrix, see wigner_rotation. */
+void zernike::rotate(const mat &m)
+{
+  rotate(wigner_rotation(m, N));
+}
+
+/** Scales the moments.
+  The result is the moments of the shape shrunk around the origin by the factor of the scaling.
+  The error estimate grows with the largest row norm of the scaling matrices.
+  @param sc The scaling, its order should not be less than the order of the moments.
+*/
+void zernike::scale(const zernike_scaling &sc)
+{
+  const zm_norm old_norm = norm;
+  normalize(zm_norm::raw);
+  std::vector<double> in(N / 2 + 1);
+  for (int l = 0 ; l <= N ; l++) {
+    const int k = (N - l) / 2 + 1, ks = (sc.N - l) / 2 + 1;
+    const std::vector<double> &a = sc.matrix(l);
+    for (int m = -l ; m <= l ; m++) {
+      for (int i = 0 ; i < k ; i++)
+        in[i] = zm[index(l + 2 * i, l, m)];
+      for (int i1 = 0 ; i1 < k ; i1++) {
+        double v = 0;
+        for (int i2 = 0 ; i2 <= i1 ; i2++)
+          v += a[i1 * ks + i2] * in[i2];
+        zm[index(l + 2 * i1, l, m)] = v;
+      }
+    }
+  }
+  variance *= sc.max_row_norm() * sc.max_row_norm();
+  normalize(old_norm);
+}
+
+/** Scales the moments by the given factor, see zernike_scaling. */
+void zernike::scale(double s)
+{
+  scale(zernike_scaling::get(N, s));
+}
+
+/** Averages the moments over a group of transformations.
+  The result is the mean of the moments rotated by each element of the group (see zernike::rotate),
+  the moments forbidden by the group being set exactly to zero. The error estimate is unchanged.
+  @param group The elements of the group, including the identity.
+*/
+void zernike::symmetrize(const std::vector<mat> &group)
+{
+  if (group.size() < 2)
+    return;
+  finish();
+  std::vector<std::vector<double>> proj(N + 1);
+  for (int l = 0 ; l <= N ; l++)
+    proj[l].assign((2 * l + 1) * (2 * l + 1), 0);
+  for (auto &g: group) {
+    const wigner_rotation w(g, N);
+    for (int l = 0 ; l <= N ; l++) {
+      const std::vector<double> d = w.matrix(l);
+      for (size_t i = 0 ; i < d.size() ; i++)
+        proj[l][i] += d[i];
+    }
+  }
+
+  std::vector<double> in(2 * N + 1);
+  for (int l = 0 ; l <= N ; l++) {
+    const int s = 2 * l + 1;
+    std::vector<double> &p = proj[l];
+    for (auto &v: p) {
+      v /= group.size();
+      if (fabs(v) < 1e-12)
+        v = 0;
+    }
+    for (int n = l ; n <= N ; n += 2) {
+      double *z = zm.data() + index(n, l, -l);
+      std::copy(z, z + s, in.begin());
+      for (int m1 = 0 ; m1 < s ; m1++) {
+        double v = 0;
+        for (int m2 = 0 ; m2 < s ; m2++)
+          v += p[m1 * s + m2] * in[m2];
+        z[m1] = v;
+      }
+    }
+  }
+}
+
 zernike operator -(const zernike &z1, const zernike &z2)
 {
   if (z1.norm != z2.norm)
@@ -571,10 +1135,11 @@ zernike operator -(const zernike &z1, const zernike &z2)
 */
 std::ostream &operator <<(std::ostream &os, const zernike &zm)
 {
-  os << "ZM" << std::endl;
-  os << zm.get_norm() << " " << zm.order() << " " << zm.output << std::endl;
+  os << "ZM\n";
+  os << zm.get_norm() << " " << zm.order() << " " << zm.output << "\n";
   const bool flip = flip_out(zm.output);
   const bool real = real_out(zm.output);
+  text_buffer b(os);
   for (int n = 0 ; n <= zm.order() ; n++)
     for (int l = n & 1 ; l <= n ; l+=2) {
       if (real)
@@ -582,12 +1147,12 @@ std::ostream &operator <<(std::ostream &os, const zernike &zm)
           double z = zm.get(n, l, m);
           if (flip && (m & 1))
             z = -z;
-          os << n << " " << l << " " << m << " " << z << std::endl;
+          b << n << ' ' << l << ' ' << m << ' ' << z << '\n';
         }
       else {
         const double z0 = zm.get(n, l, 0);
         if (z0 != 0)
-          os << n << " " << l << " 0 " << z0 << std::endl;
+          b << n << ' ' << l << " 0 " << z0 << '\n';
         for (int m = 1 ; m <= l ; m++) {
           double r = sqrt(0.5) * zm.get(n, l, m);
           double i = - sqrt(0.5) * zm.get(n, l, -m);
@@ -595,63 +1160,79 @@ std::ostream &operator <<(std::ostream &os, const zernike &zm)
             r = -r;
             i = -i;
           }
-          os << n << " " << l << " " << m << " " << r << " " << i << std::endl;
+          b << n << ' ' << l << ' ' << m << ' ' << r << ' ' << i << '\n';
         }
       }
     }
   return os;
 }
 
-/** Reads a zernike in ZM format.
- See format in operator >> doc.
+/** Writes a zernike in binary ZMB format, see write_binary_data.
+ The moments are written in full precision, whatever the precision of the stream.
+*/
+void write_binary(std::ostream &os, const zernike &z)
+{
+  write_binary_data(os, "ZMB", z.get_norm(), z.order(), (int) z.output, z.get_zm());
+}
+
+/** Reads a zernike in ZM format, or in binary ZMB format.
+ See format in operator << doc and in write_binary_data.
 */
 smart_input &operator >>(smart_input &is, zernike &z)
 {
-  std::istringstream s;
-  if (!is.next_line(s)) //remove first line containing "ZM"
-    return is.failed();
-  if (!is.next_line(s))
+  if (binary_tag(is, "ZMB")) {
+    zm_norm norm;
+    int n0, output;
+    std::vector<double> v;
+    auto size = [](int n) { return 2. * (n / 2 + 1) * (n / 2 + 2) * (2 * (n / 2) + 3) / 3; };
+    if (!read_binary_data(is, "ZMB", norm, n0, output, size, v))
+      return is;
+    if (output < 0 || output > (int) zm_output::complex_p)
+      return is.failed();
+    zernike z0(n0);
+    z0.norm = norm;
+    z0.output = (zm_output) output;
+    z0.zm.swap(v);
+    z0.finish();
+    z = std::move(z0);
+    return is;
+  }
+  std::unique_ptr<mapped_input> mi = text_lines(is);
+  if (!mi)
     return is.failed();
   int n0;
   zm_norm norm;
   zm_output output;
-  s >> norm >> n0 >> output;
-  if (!s || n0 < 0)
-    return is.failed();
+  if (!read_text_header(*mi, norm, n0, &output))
+    return text_end(is, *mi, false);
   const bool flip = flip_out(output);
   const bool real = real_out(output);
+  const double s2 = sqrt(2);
   zernike z0(n0);
   z0.norm = norm;
   z0.output = output;
   z0.odd_clean = true;
-  while(is.next_line(s)) {
-    int n, l, m;
+  while (mi->next_line()) {
+    long n, l, m;
     double r, i;
-    s >> n >> l >> m >> r;
-    if (!s || n < 0 || n > n0 || l < 0 || l > n || (l ^ n) == 1
-        || m < -l || m > l)
-      return is.failed();
+    if (!mi->read(n) || !mi->read(l) || !mi->read(m) || !mi->read(r)
+        || n < 0 || n > n0 || l < 0 || l > n || ((n - l) & 1) || m < -l || m > l)
+      return text_end(is, *mi, false);
     if (flip && (m & 1))
       r = -r;
     if (m == 0 || real)
       z0.zm[z0.index(n, l, m)] = r;
-    else if (m < 0)
-      return is.failed();
+    else if (m < 0 || !mi->read(i))
+      return text_end(is, *mi, false);
     else {
-      s >> i;
-      if (!s)
-        return is.failed();
       if (flip && (m & 1))
         i = -i;
-      z0.zm[z0.index(n, l, m)] = sqrt(2) * r;
-      z0.zm[z0.index(n, l, -m)] = - sqrt(2) * i;
+      z0.zm[z0.index(n, l, m)] = s2 * r;
+      z0.zm[z0.index(n, l, -m)] = - s2 * i;
     }
   }
-  if (is.eof()) {
-    z = z0;
-    is.clear();
-  }
-  return is;
+  z = std::move(z0);
+  return text_end(is, *mi, true);
 }
 
 /** Constructor.
@@ -692,6 +1273,96 @@ void zernike_m_int::add(const w_vec &p)
   }
 }
 
+/** Constructor.
+  @param derivatives The derivatives of the function with respect to the moments,
+  in their normalization. They are converted to derivatives with respect to the raw moments.
+*/
+zernike_m_int_gradient::zernike_m_int_gradient(const zernike &derivatives):
+zernike(derivatives), zi(N), zr(N), sh(N + 2), ca((N + 2) * (N + 2)), cb((N + 2) * (N + 2))
+{
+  // derivatives transform inversely to the moments
+  const zm_norm old_norm = norm;
+  norm = zm_norm::raw;
+  normalize(old_norm);
+  norm = zm_norm::raw;
+}
+
+/** Evaluates the function and its gradient.
+  @param p The point.
+  @param grad Receives the gradient. It is not computed at the origin (it is set to 0),
+  where only the value is needed: a facet with an integration point there has a zero weight.
+  @return The value of the function.
+*/
+double zernike_m_int_gradient::eval(const vec &p, vec &grad)
+{
+  const s_vec sp = p.spherical();
+  grad = vec();
+  if (sp.r == 0) {
+    // only l = 0 is left, with A(0) = R(0) / 3
+    zr.eval_zr(0);
+    double g = 0;
+    for (int n = 0 ; n <= N ; n += 2)
+      g += zm[index(n, 0, 0)] * zr.get(n, 0) / 3;
+    return g / sqrt(4 * M_PI);
+  }
+  const double r = sp.r;
+  zi.eval_zr(r, 1 / (r * r * r));
+  zr.eval_zr(r);
+  sh.eval_sh(sp.theta, 0); // sh.get(l, m) is the colatitude part for m >= 0
+
+  // sums over n
+  const std::vector<double> &a = zi.get_zr(), &ra = zr.get_zr();
+  for (auto &v: ca)
+    v = 0;
+  for (auto &v: cb)
+    v = 0;
+  int idzr = 0;
+  int idz = 0;
+  for (int n2 = 0 ; n2 <= N / 2 ; n2++)
+    for (int l = 0 ; l <= 2 * n2 + 1 ; l++, idzr++) {
+      const double av = a[idzr], dav = (ra[idzr] - 3 * av) / r;
+      for (int m = -l ; m <= l ; m++, idz++) {
+        ca[l * l + l + m] += zm[idz] * av;
+        cb[l * l + l + m] += zm[idz] * dav;
+      }
+    }
+
+  // sums over l and m, in spherical coordinates
+  const int lmax = 2 * (N / 2) + 1;
+  auto t = [&](int l, int m) { return (m > l) ? 0 : sh.get(l, m); };
+  double g = 0, gr = 0, gt = 0, gp = 0;
+  for (int m = 0 ; m <= lmax ; m++) {
+    const double cm = cos(m * sp.phi), sm = sin(m * sp.phi);
+    for (int l = m ; l <= lmax ; l++) {
+      const int i = l * l + l;
+      const double th = t(l, m);
+      if (m == 0) {
+        const double d = sqrt(l * (l + 1) / 2.) * t(l, 1);
+        g += ca[i] * th;
+        gr += cb[i] * th;
+        gt += ca[i] * d;
+        continue;
+      }
+      const double d = (m == 1) ?
+        0.5 * sqrt((l - 1) * (l + 2.)) * t(l, 2) - sqrt(l * (l + 1) / 2.) * t(l, 0) :
+        0.5 * (sqrt((l - m) * (l + m + 1.)) * t(l, m + 1) - sqrt((l + m) * (l - m + 1.)) * t(l, m - 1));
+      // m Y / sin(theta)
+      const double e = -0.5 * sqrt((2 * l + 1.) / (2 * l + 3)) *
+        (sqrt((l + m + 1.) * (l + m + 2)) * t(l + 1, m + 1) +
+         ((m == 1) ? sqrt(2) : 1) * sqrt((l - m + 1.) * (l - m + 2)) * t(l + 1, m - 1));
+      const double c = ca[i + m], s = ca[i - m];
+      g += th * (c * cm + s * sm);
+      gr += th * (cb[i + m] * cm + cb[i - m] * sm);
+      gt += d * (c * cm + s * sm);
+      gp += e * (s * cm - c * sm);
+    }
+  }
+
+  const double ct = cos(sp.theta), st = sin(sp.theta), cp = cos(sp.phi), spp = sin(sp.phi);
+  grad = gr * vec(st * cp, st * spp, ct) + (gt / r) * vec(ct * cp, ct * spp, -st) + (gp / r) * vec(-spp, cp, 0);
+  return g;
+}
+
 /** Dummy constructor for operator >>.
  @param n The maximum order available. 
 */
@@ -748,34 +1419,46 @@ std::ostream &operator <<(std::ostream &os, const rotational_invariants &ri)
   return os;
 }
 
+/** Writes rotational invariants in binary ZRB format, see write_binary_data. */
+void write_binary(std::ostream &os, const rotational_invariants &ri)
+{
+  write_binary_data(os, "ZRB", ri.get_norm(), ri.order(), 0, ri.get_ri());
+}
+
 smart_input &operator >>(smart_input &is, rotational_invariants &ri)
 {
-  std::istringstream s;
-  if (!is.next_line(s)) //remove first line containing "ZRI"
-    return is.failed();
-  if (!is.next_line(s))
+  if (binary_tag(is, "ZRB")) {
+    zm_norm norm;
+    int n0, output;
+    std::vector<double> v;
+    auto size = [](int n) { return (n / 2 + 1.) * (n / 2 + 2) * (n / 2 + 3) / 3; };
+    if (!read_binary_data(is, "ZRB", norm, n0, output, size, v))
+      return is;
+    rotational_invariants ri0(n0);
+    ri0.norm = norm;
+    ri0.ri.swap(v);
+    ri = std::move(ri0);
+    return is;
+  }
+  std::unique_ptr<mapped_input> mi = text_lines(is);
+  if (!mi)
     return is.failed();
   int n0;
   zm_norm norm;
-  s >> norm >> n0;
-  if (!s || n0 < 0)
-    return is.failed();
+  if (!read_text_header(*mi, norm, n0, NULL))
+    return text_end(is, *mi, false);
   rotational_invariants ri0(n0);
-  ri.norm = norm;
-  while(is.next_line(s)) {
-    int n1, n2, l;
+  ri0.norm = norm;
+  while (mi->next_line()) {
+    long n1, n2, l;
     double z;
-    s >> n1 >> n2 >> l >> z;
-    if (!s || n1 < 0 || n1 > n0 || n2 < 0 || n2 > n1 || l < 0 || l > n2
-        || (n1 | n2) == 1 || (l | n2) ==1)
-      return is.failed();
+    if (!mi->read(n1) || !mi->read(n2) || !mi->read(l) || !mi->read(z)
+        || n1 < 0 || n1 > n0 || n2 < 0 || n2 > n1 || l < 0 || l > n2 || ((n1 ^ n2) & 1) || ((n2 ^ l) & 1))
+      return text_end(is, *mi, false);
     ri0.ri[ri0.index(n1, n2, l)] = z;
   }
-  if (is.eof()) {
-    ri = ri0;
-    is.clear();
-  }
-  return is;
+  ri = std::move(ri0);
+  return text_end(is, *mi, true);
 }
 
 /** Dummy constructor for operator >>.
@@ -828,31 +1511,42 @@ std::ostream &operator <<(std::ostream &os, const signature_invariants &si)
   return os;
 }
 
+/** Writes signature invariants in binary ZSB format, see write_binary_data. */
+void write_binary(std::ostream &os, const signature_invariants &si)
+{
+  write_binary_data(os, "ZSB", si.get_norm(), si.order(), 0, si.get_si());
+}
+
 smart_input &operator >>(smart_input &is, signature_invariants &si)
 {
-  std::istringstream s;
-  if (!is.next_line(s)) //remove first line containing "ZSI"
-    return is.failed();
-  if (!is.next_line(s))
+  if (binary_tag(is, "ZSB")) {
+    zm_norm norm;
+    int n0, output;
+    std::vector<double> v;
+    if (!read_binary_data(is, "ZSB", norm, n0, output, [](int n) { return n + 1.; }, v))
+      return is;
+    signature_invariants si0(n0);
+    si0.norm = norm;
+    si0.si.swap(v);
+    si = std::move(si0);
+    return is;
+  }
+  std::unique_ptr<mapped_input> mi = text_lines(is);
+  if (!mi)
     return is.failed();
   int n0;
   zm_norm norm;
-  s >> norm >> n0;
-  if (!s || n0 < 0)
-    return is.failed();
+  if (!read_text_header(*mi, norm, n0, NULL))
+    return text_end(is, *mi, false);
   signature_invariants si0(n0);
-  si.norm = norm;
-  while(is.next_line(s)) {
-    int n;
+  si0.norm = norm;
+  while (mi->next_line()) {
+    long n;
     double z;
-    s >> n >> z;
-    if (!s || n < 0 || n > n0)
-      return is.failed();
+    if (!mi->read(n) || !mi->read(z) || n < 0 || n > n0)
+      return text_end(is, *mi, false);
     si0.si[n] = z;
   }
-  if (is.eof()) {
-    si = si0;
-    is.clear();
-  }
-  return is;
+  si = std::move(si0);
+  return text_end(is, *mi, true);
 }
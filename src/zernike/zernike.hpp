@@ -71,6 +71,89 @@ private:
   std::vector<help2> help; /**< Fixed coefficients needed by computation. */
 };
 
+/** A class to rotate spherical harmonics.
+
+  For a rotation matrix M (or a rotation composed with an inversion), it applies
+  for each order l the matrix \f$D^l\f$ (the Wigner matrix in the real basis used
+  by spherical_harmonics) such that \f$Y_l(Mx) = D^l Y_l(x)\f$, where \f$Y_l\f$ is the vector of the
+  spherical harmonics of order l.
+
+  The matrices are factored as \f$D(M) = Z(\alpha) J Z(\beta) J^T Z(\gamma)\f$ where
+  \f$\alpha, \beta, \gamma\f$ are the Euler angles of M (in the zyz convention),
+  Z is a rotation around the z axis, which only mixes m and -m, and J the matrix of
+  the fixed rotation bringing the z axis on the y axis. J is computed by the
+  Ivanic-Ruedenberg recursion and cached for all rotations, the cosines and sines
+  needed by Z are kept by each instance. Applying D to a vector of size 2l+1 costs
+  about \f$2(2l+1)^2\f$ operations.
+
+  Usage:
+    1. create one instance with the rotation and the maximum order needed.
+    2. use wigner_rotation::apply on vectors of coefficients (or zernike::rotate).
+*/
+class wigner_rotation
+{
+public:
+  wigner_rotation(const mat &m, int n);
+
+  /** Maximum order available. */
+  int order() const
+  { return N; }
+
+  void apply(int l, const double *in, double *out) const;
+  std::vector<double> matrix(int l) const;
+
+  /** The matrix J of order l, element m1, m2 is at index (m1 + l) * (2l + 1) + m2 + l. */
+  const std::vector<double> &matrix_j(int l) const
+  { return j[l]; }
+
+private:
+  int N;
+  double parity; /**< -1 if the matrix includes an inversion. */
+  const std::vector<std::vector<double>> &j;   /**< The matrices J for each l, shared by all instances. */
+  std::vector<double> ca, sa, cb, sb, cg, sg;  /**< cos(m angle) and sin(m angle) for the three Euler angles. */
+};
+
+void gauss_legendre(int k, std::vector<double> &x, std::vector<double> &w);
+
+/** A class to scale Zernike moments.
+
+  Shrinking a shape by a factor s (not larger than 1) around the origin changes
+  its raw moments \f$z_{nlm}\f$ into
+  \f[ z'_{nlm} = s^3 \sum_{n'} A^l_{nn'}(s) z_{n'lm}, \f]
+  where \f$R_{nl}(sr) = \sum_{n'} A^l_{nn'}(s) R_{n'l}(r)\f$. The matrices \f$A^l\f$
+  are lower triangular (n' runs from l to n with the parity of n) and do not depend on m.
+  They are computed by a Gauss-Legendre quadrature of the radial parts.
+  Get them from zernike_scaling::get which keeps one instance for each order and factor.
+
+  Usage:
+    1. get one instance with the maximum order needed and the factor.
+    2. use zernike::scale.
+*/
+class zernike_scaling
+{
+public:
+  const int N;     /**< Maximum order. */
+  const double s;  /**< The scaling factor. */
+
+  zernike_scaling(int n, double scale);
+
+  static const zernike_scaling &get(int n, double scale);
+
+  /** The matrix of order l, element n1, n2 is at index ((n1 - l) / 2) * k + (n2 - l) / 2,
+    where k = (N - l) / 2 + 1 is the number of radial orders.
+  */
+  const std::vector<double> &matrix(int l) const
+  { return a[l]; }
+
+  /** Largest sum of the absolute values of the coefficients in a row, including the factor \f$s^3\f$. */
+  double max_row_norm() const
+  { return row_norm; }
+
+private:
+  std::vector<std::vector<double>> a; /**< The matrices for each l, including the factor \f$s^3\f$. */
+  double row_norm;
+};
+
 /** Base class for computing radial part of zernike polynomials.
 */
 class zernike_radial
@@ -208,11 +291,15 @@ enum class zm_norm {raw, ortho, dual, raw_n, ortho_n, dual_n};
  By defaut (all args false) it gives ortho, the args sets the different possibilities.
 */
 zm_norm make_norm(bool raw, bool dual, bool norm);
+std::ostream &operator <<(std::ostream &os, zm_norm norm);
+std::istream &operator >>(std::istream &is, zm_norm &norm);
 
 /** Enumeration to represent types of output for Zernike moments.*/
 enum class zm_output {real, complex, real_p, complex_p};
 
 zm_output make_output(bool cplx, bool phase);
+std::ostream &operator <<(std::ostream &os, zm_output output);
+std::istream &operator >>(std::istream &is, zm_output &output);
 
 /** A base class to compute Zernike moments. */
 class zernike
@@ -272,9 +359,17 @@ public:
   void finish();
   double distance(const zernike &z) const;
   zernike &operator +=(const zernike &z);
+  zernike &operator -=(const zernike &z);
+  zernike &operator *=(double s);
+  bool rotate(const wigner_rotation &w);
+  void rotate(const mat &m);
+  void scale(const zernike_scaling &sc);
+  void scale(double s);
+  void symmetrize(const std::vector<mat> &group);
 
   friend smart_input &operator >>(smart_input &, zernike &);
   friend zernike operator -(const zernike &z1, const zernike &z2);
+  friend class zm_store;
  
   double variance;
   zm_output output;
@@ -292,6 +387,7 @@ zernike operator -(const zernike &z1, const zernike &z2);
 
 std::ostream &operator <<(std::ostream &, const zernike &);
 smart_input &operator >>(smart_input &, zernike &);
+void write_binary(std::ostream &, const zernike &);
 
 /** Class for computing weighted sums of zernike polynomials.
 
@@ -335,6 +431,33 @@ public:
   void add(const w_vec &p);
 };
 
+/** Class for computing the gradients of linear functions of the moments.
+
+  Given the derivatives \f$c_{nlm}\f$ of a function with respect to the moments, it computes
+  \f$G(x) = \sum c_{nlm} A_{nl}(r) Y_{lm}(\theta, \phi)\f$ and its gradient, where
+  \f$A_{nl}(r) = r^{-3} \int_0^r t^2 R_{nl}(t) \mathrm dt\f$ is the radial part added by zernike_m_int.
+  The derivatives of \f$A_{nl}\f$ come from zernike_r, those of the spherical harmonics from
+  recursions on m (for \f$\theta\f$) and on l (for \f$\phi\f$, which avoids dividing by
+  \f$\sin\theta\f$ on the z axis). The cost is the one of zernike_m_int::add.
+
+  Usage:
+    1. create one instance with the derivatives, in any normalization.
+    2. use zernike_m_int_gradient::eval on each point.
+*/
+class zernike_m_int_gradient:
+public zernike
+{
+public:
+  zernike_m_int_gradient(const zernike &derivatives);
+  double eval(const vec &p, vec &grad);
+
+private:
+  zernike_int2 zi;
+  zernike_r zr;
+  spherical_harmonics sh;
+  std::vector<double> ca, cb; /**< Sums over n of the derivatives times A and its derivative, by (l, m). */
+};
+
 /** Class for computing rotational invariants from Zernike moments.
   The normalization of the result corresponds to the one of the z given.
   First use z.orthonormalize() if needed.
@@ -393,6 +516,7 @@ rotational_invariants operator -(const rotational_invariants &r1, const rotation
 
 std::ostream &operator <<(std::ostream &, const rotational_invariants &);
 smart_input &operator >>(smart_input &, rotational_invariants &);
+void write_binary(std::ostream &, const rotational_invariants &);
 
 class signature_invariants
 {
@@ -431,5 +555,6 @@ private:
 signature_invariants operator -(const signature_invariants &s1, const signature_invariants &s2);
 std::ostream &operator <<(std::ostream &, const signature_invariants &);
 smart_input &operator >>(smart_input &, signature_invariants &);
+void write_binary(std::ostream &, const signature_invariants &);
 
 #endif
@@ -0,0 +1,351 @@
+/** \file zm_codes.cpp
+  Implementation of zm_codes.hpp.
+  \author J. Houdayer
+*/
+
+#include "zm_codes.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+
+static const std::string codes_write_msg = "Cannot write codes to ";
+
+/** Version of the codes format. */
+const uint32_t codes_version = 2;
+
+/** Size of the header of the codes, including the line "ZMQ". */
+const size_t codes_header_size = 40;
+
+/** Number of records handled together when building or searching codes. */
+const size_t codes_block = 1024;
+
+/** Largest absolute value of a code. */
+static int code_max(int bits)
+{
+  return (bits == 16) ? INT16_MAX : INT8_MAX;
+}
+
+/** Constructor.
+  All scales are null until zm_codec::fit is called.
+  @param b The number of bits of a code value, 8 or 16.
+  @param starts The start of each group, then the size of the vectors.
+*/
+zm_codec::zm_codec(int b, const std::vector<size_t> &starts):
+bits(b == 16 ? 16 : 8), groups(starts), scales(starts.size() - 1, 0)
+{}
+
+/** Widens the scales so that the values of a vector fit.
+  @param v A vector of dim() values.
+*/
+void zm_codec::fit(const std::vector<double> &v)
+{
+  const double qmax = code_max(bits);
+  for (size_t g = 0 ; g < scales.size() ; g++)
+    for (size_t i = groups[g] ; i < groups[g + 1] ; i++)
+      scales[g] = std::max(scales[g], std::abs(v[i]) / qmax);
+}
+
+/** Widens the scales to those of another codec with the same groups. */
+void zm_codec::fit(const zm_codec &c)
+{
+  for (size_t g = 0 ; g < scales.size() ; g++)
+    scales[g] = std::max(scales[g], c.scales[g]);
+}
+
+/** Encodes a vector.
+  @param v A vector of dim() values.
+  @param code Receives code_size() bytes.
+*/
+void zm_codec::encode(const std::vector<double> &v, char *code) const
+{
+  const long qmax = code_max(bits);
+  int8_t *c8 = reinterpret_cast<int8_t *>(code);
+  int16_t *c16 = reinterpret_cast<int16_t *>(code);
+  for (size_t g = 0 ; g < scales.size() ; g++)
+    for (size_t i = groups[g] ; i < groups[g + 1] ; i++) {
+      const long q = (scales[g] == 0) ? 0 : std::max(-qmax, std::min(qmax, std::lround(v[i] / scales[g])));
+      if (bits == 16)
+        c16[i] = q;
+      else
+        c8[i] = q;
+    }
+}
+
+/** Decodes a vector.
+  @param code The code_size() bytes of the code.
+  @return The dim() values, each within half the scale of its group from the value encoded if it was in range.
+*/
+std::vector<double> zm_codec::decode(const char *code) const
+{
+  const int8_t *c8 = reinterpret_cast<const int8_t *>(code);
+  const int16_t *c16 = reinterpret_cast<const int16_t *>(code);
+  std::vector<double> v(dim());
+  for (size_t g = 0 ; g < scales.size() ; g++)
+    for (size_t i = groups[g] ; i < groups[g + 1] ; i++)
+      v[i] = scales[g] * ((bits == 16) ? c16[i] : c8[i]);
+  return v;
+}
+
+/** Sum of the squared differences of two arrays of code values.
+  The loop is kept simple so that compilers vectorize it. The sum is accumulated on S,
+  which must hold n squared differences.
+*/
+template<typename S, typename T>
+static S square_diff(const T *a, const T *b, size_t n)
+{
+  S sum = 0;
+  for (size_t i = 0 ; i < n ; i++) {
+    const S d = (S) a[i] - (S) b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+/** Sum of the squared differences of two arrays of 8 bits code values.
+  The sums are accumulated on 32 bits by chunks small enough not to overflow.
+*/
+static double square_diff_8(const int8_t *a, const int8_t *b, size_t n)
+{
+  const size_t chunk = 1 << 15;
+  double sum = 0;
+  for (size_t i = 0 ; i < n ; i += chunk)
+    sum += square_diff<int32_t>(a + i, b + i, std::min(chunk, n - i));
+  return sum;
+}
+
+/** Distance between two codes.
+  @return The euclidean distance between the decoded vectors, without decoding them.
+*/
+double zm_codec::distance(const char *c1, const char *c2) const
+{
+  double sum = 0;
+  for (size_t g = 0 ; g < scales.size() ; g++) {
+    const size_t i = groups[g];
+    const size_t n = groups[g + 1] - i;
+    const double d = (bits == 16) ?
+      square_diff<int64_t>(reinterpret_cast<const int16_t *>(c1) + i, reinterpret_cast<const int16_t *>(c2) + i, n) :
+      square_diff_8(reinterpret_cast<const int8_t *>(c1) + i, reinterpret_cast<const int8_t *>(c2) + i, n);
+    sum += scales[g] * scales[g] * d;
+  }
+  return sqrt(sum);
+}
+
+/** Bound on the error made by coding.
+  @return The largest euclidean distance between a vector in range and its decoded code.
+  Distances computed from codes are thus within twice this bound from the exact ones.
+*/
+double zm_codec::error_bound() const
+{
+  double sum = 0;
+  for (size_t g = 0 ; g < scales.size() ; g++)
+    sum += (groups[g + 1] - groups[g]) * scales[g] * scales[g] / 4;
+  return sqrt(sum);
+}
+
+/** Groups of the moments of order up to n, by pairs of orders (2k, 2k+1) as they are stored in zernike. */
+std::vector<size_t> zm_codec::zernike_groups(int n)
+{
+  std::vector<size_t> starts;
+  for (size_t k = 0 ; k <= (size_t) n / 2 + 1 ; k++)
+    starts.push_back(2 * k * (k + 1) * (2 * k + 1) / 3);
+  return starts;
+}
+
+/** Groups of the rotational invariants of order up to n, by pairs of orders n1 (2k, 2k+1)
+  as they are stored in rotational_invariants.
+*/
+std::vector<size_t> zm_codec::ri_groups(int n)
+{
+  std::vector<size_t> starts;
+  for (size_t k = 0 ; k <= (size_t) n / 2 + 1 ; k++)
+    starts.push_back(k * (k + 1) * (k + 2) / 3);
+  return starts;
+}
+
+/** Euclidean distance between two vectors of the same size. */
+double euclidean_distance(const std::vector<double> &v1, const std::vector<double> &v2)
+{
+  double sum = 0;
+  for (size_t i = 0 ; i < v1.size() ; i++)
+    sum += (v1[i] - v2[i]) * (v1[i] - v2[i]);
+  return sqrt(sum);
+}
+
+/** The rotational invariants used by zm_codes.
+  @param z The moments, of order at least n.
+  @param n The order of the invariants.
+  @return The rotational invariants of the moments truncated to order n, in ORTHO normalization.
+*/
+std::vector<double> zm_codes::invariants(const zernike &z, int n)
+{
+  zernike zn(n, z);
+  zn.normalize(zm_norm::ortho);
+  rotational_invariants ri(n);
+  ri.eval_ri(zn);
+  return ri.get_ri();
+}
+
+/** Builds the codes of a store.
+  The store is read twice, first to fit the scales, then to encode the records.
+  @param st The store.
+  @param bits The number of bits of a code value, 8 or 16.
+  @param nt The number of threads to use.
+  @param verbose Whether to show progression bars.
+*/
+zm_codes::zm_codes(const zm_store &st, int bits, int nt, bool verbose):
+codec(bits, zm_codec::ri_groups(st.order())), ok(true), N(st.order()), records(st.size()), stamp(st.stamp()), codes(NULL)
+{
+  const size_t blocks = (records + codes_block - 1) / codes_block;
+  auto records_of = [&](size_t b, std::function<void(const std::vector<double> &, size_t)> f) {
+    zernike z;
+    for (size_t i = b * codes_block ; i < records && i < (b + 1) * codes_block ; i++) {
+      st.read(i, z);
+      f(invariants(z, N), i);
+    }
+  };
+
+  std::vector<zm_codec> fits(blocks, codec);
+  parallel_eval<zm_codec>(nt, fits, [&](size_t b) {
+    zm_codec c = codec;
+    records_of(b, [&](const std::vector<double> &v, size_t) { c.fit(v); });
+    return c;
+  }, verbose);
+  for (auto &c: fits)
+    codec.fit(c);
+
+  own.resize(records * codec.code_size());
+  std::vector<int> done(blocks);
+  parallel_eval<int>(nt, done, [&](size_t b) {
+    records_of(b, [&](const std::vector<double> &v, size_t i) { codec.encode(v, &own[i * codec.code_size()]); });
+    return 1;
+  }, verbose);
+  codes = own.data();
+}
+
+/** Reads codes from a file.
+  The file is mapped in memory, but for 16 bits codes on big endian machines.
+  @param name The name of the file.
+*/
+zm_codes::zm_codes(const std::string &name):
+ok(false), N(0), records(0), stamp(0), file(new mapped_input(name)), codes(NULL)
+{
+  const char *p = file->content();
+  if (!*file || file->size() < codes_header_size
+      || std::string(p, 4) != "ZMQ\n" || get_le<uint32_t>(p + 4) != codes_version)
+    return;
+  const int32_t bits = get_le<int32_t>(p + 8);
+  N = get_le<int32_t>(p + 12);
+  const size_t ngroups = get_le<uint32_t>(p + 16);
+  records = get_le<uint64_t>(p + 24);
+  stamp = get_le<uint64_t>(p + 32);
+  if ((bits != 8 && bits != 16) || N < 0 || ngroups != (size_t) N / 2 + 1)
+    return;
+  codec = zm_codec(bits, zm_codec::ri_groups(N));
+  const size_t tables = codes_header_size + (2 * ngroups + 1) * 8;
+  if (file->size() < tables || (file->size() - tables) / codec.code_size() != records
+      || (file->size() - tables) % codec.code_size() != 0)
+    return;
+  for (size_t g = 0 ; g <= ngroups ; g++)
+    if (get_le<uint64_t>(p + codes_header_size + 8 * g) != codec.groups[g])
+      return;
+  for (size_t g = 0 ; g < ngroups ; g++)
+    codec.scales[g] = get_le<double>(p + codes_header_size + 8 * (ngroups + 1 + g));
+  codes = p + tables;
+  if (bits == 16 && !little_endian()) {
+    own.resize(records * codec.code_size());
+    for (size_t i = 0 ; i < own.size() ; i += 2) {
+      const int16_t x = get_le<int16_t>(codes + i);
+      memcpy(&own[i], &x, 2);
+    }
+    codes = own.data();
+  }
+  ok = true;
+}
+
+/** Writes the codes, through a temporary file renamed at the end.
+  @param name The name of the file.
+  @return An error message, empty on success.
+*/
+std::string zm_codes::save(const std::string &name) const
+{
+  std::string head = "ZMQ\n";
+  put_le<uint32_t>(head, codes_version);
+  put_le<int32_t>(head, codec.bits);
+  put_le<int32_t>(head, N);
+  put_le<uint32_t>(head, codec.scales.size());
+  put_le<uint32_t>(head, 0);
+  put_le<uint64_t>(head, records);
+  put_le<uint64_t>(head, stamp);
+  for (auto g: codec.groups)
+    put_le<uint64_t>(head, g);
+  for (auto s: codec.scales)
+    put_le(head, s);
+
+  const std::string tmp = name + ".tmp";
+  std::ofstream f(tmp, std::ios::binary);
+  if (!f)
+    return cannot_open_msg + tmp + " (" + strerror(errno) + ")";
+  f.write(head.data(), head.size());
+  const size_t size = records * codec.code_size();
+  if (codec.bits == 8 || little_endian())
+    f.write(codes, size);
+  else {
+    std::string buf;
+    for (size_t i = 0 ; i < size ; i += 2)
+      put_le(buf, *reinterpret_cast<const int16_t *>(codes + i));
+    f.write(buf.data(), buf.size());
+  }
+  f.close();
+  if (f.fail() || rename(tmp.c_str(), name.c_str()) != 0) {
+    remove(tmp.c_str());
+    return codes_write_msg + name;
+  }
+  return "";
+}
+
+/** Keeps the k smallest matches, sorted. */
+static void keep_best(std::vector<zm_match> &m, size_t k)
+{
+  if (m.size() > k) {
+    std::nth_element(m.begin(), m.begin() + k, m.end());
+    m.resize(k);
+  }
+  std::sort(m.begin(), m.end());
+}
+
+/** Finds the records closest to a query.
+  @param query The invariants of the query, see zm_codes::invariants.
+  @param k The number of records to find.
+  @param candidates The number of records kept from their codes (at least k), ranked again with exact.
+  @param exact If not NULL, gives the exact distance between the query and a record, using its full moments.
+  @param nt The number of threads to use.
+  @return The k closest records, by increasing distance, exact if given.
+*/
+std::vector<zm_match> zm_codes::search(const std::vector<double> &query, size_t k, size_t candidates,
+                                       std::function<double(size_t)> exact, int nt) const
+{
+  candidates = std::max(k, candidates);
+  std::string q(codec.code_size(), 0);
+  codec.encode(query, &q[0]);
+
+  std::vector<std::vector<zm_match>> best((records + codes_block - 1) / codes_block);
+  parallel_eval<std::vector<zm_match>>(nt, best, [&](size_t b) {
+    std::vector<zm_match> m;
+    for (size_t i = b * codes_block ; i < records && i < (b + 1) * codes_block ; i++)
+      m.push_back(zm_match(codec.distance(q.data(), code(i)), i));
+    keep_best(m, candidates);
+    return m;
+  });
+
+  std::vector<zm_match> found;
+  for (auto &m: best)
+    found.insert(found.end(), m.begin(), m.end());
+  keep_best(found, candidates);
+  if (exact)
+    for (auto &m: found)
+      m.first = exact(m.second);
+  keep_best(found, k);
+  return found;
+}
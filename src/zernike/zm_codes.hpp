@@ -0,0 +1,122 @@
+/** \file zm_codes.hpp
+  Compact codes of moments and invariants, to search a store for similar shapes.
+  \author J. Houdayer
+*/
+
+#ifndef ZM_CODES_HPP
+#define ZM_CODES_HPP
+
+#include <functional>
+#include <utility>
+#include "zm_store.hpp"
+
+/** Quantization of vectors of moments or invariants into small integers.
+
+  The values are split in groups, one by order (see zm_codec::zernike_groups and zm_codec::ri_groups),
+  each with its own scale: a value v is coded as the nearest integer to v / scale, on 8 or 16 bits.
+  The scales are set by zm_codec::fit so that the largest values seen fit, the error on a value is then
+  at most half the scale of its group (values out of range are clipped).
+  Distances are computed on the codes directly, with a scale by group.
+
+  Usage:
+    1. create one instance with the number of bits and the groups.
+    2. call zm_codec::fit with all the vectors to encode.
+    3. use zm_codec::encode, zm_codec::decode and zm_codec::distance.
+*/
+class zm_codec
+{
+public:
+  int bits;                   /**< Size of a code value, 8 or 16. */
+  std::vector<size_t> groups; /**< Start of each group, then the size of the vectors. */
+  std::vector<double> scales; /**< Scale of each group. */
+
+  zm_codec(int b = 8, const std::vector<size_t> &starts = {0});
+
+  /** Number of values of a vector. */
+  size_t dim() const
+  { return groups.back(); }
+
+  /** Size of the code of a vector in bytes. */
+  size_t code_size() const
+  { return dim() * (bits / 8); }
+
+  void fit(const std::vector<double> &v);
+  void fit(const zm_codec &c);
+  void encode(const std::vector<double> &v, char *code) const;
+  std::vector<double> decode(const char *code) const;
+  double distance(const char *c1, const char *c2) const;
+  double error_bound() const;
+
+  static std::vector<size_t> zernike_groups(int n);
+  static std::vector<size_t> ri_groups(int n);
+};
+
+double euclidean_distance(const std::vector<double> &v1, const std::vector<double> &v2);
+
+/** A result of a search: the distance to the query and the index of the record. */
+typedef std::pair<double, size_t> zm_match;
+
+/** The codes of the rotational invariants of the records of a store, to find similar shapes quickly.
+
+  The invariants are those of the moments in ORTHO normalization (see zm_codes::invariants),
+  coded with a zm_codec by order n1. They are kept in a binary file, usually named after the store
+  with ".zmq" appended: the line "ZMQ", then in little endian the version, the number of bits,
+  the order, the number of groups, 0 (all on 32 bits), the number of records and the stamp
+  of the store (see zm_store::stamp) on 64 bits, the starts of the groups and the size of the vectors (on 64 bits), the scales (as doubles),
+  and finally the codes of the records. The file is mapped in memory to read it.
+
+  zm_codes::search compares the query with all the codes, keeps the closest candidates,
+  and may rank them again with their exact distance, computed from the full records of the store.
+
+  Usage:
+    1. build the codes of a store with the first constructor and save them with zm_codes::save,
+    or read them with the second constructor and check them with operator bool.
+    2. use zm_codes::search with the invariants of the query.
+*/
+class zm_codes
+{
+public:
+  zm_codec codec;
+
+  zm_codes(const zm_store &st, int bits, int nt = 1, bool verbose = false);
+  zm_codes(const std::string &name);
+  zm_codes(const zm_codes &) = delete;
+  zm_codes &operator=(const zm_codes &) = delete;
+
+  /** To check whether the codes could be read. */
+  explicit operator bool() const
+  { return ok; }
+
+  /** Number of records. */
+  size_t size() const
+  { return records; }
+
+  /** Order of the invariants. */
+  int order() const
+  { return N; }
+
+  /** Stamp of the store the codes were built from. */
+  uint64_t store_stamp() const
+  { return stamp; }
+
+  /** The code of record i. */
+  const char *code(size_t i) const
+  { return codes + i * codec.code_size(); }
+
+  std::string save(const std::string &name) const;
+  std::vector<zm_match> search(const std::vector<double> &query, size_t k, size_t candidates = 0,
+                               std::function<double(size_t)> exact = nullptr, int nt = 1) const;
+
+  static std::vector<double> invariants(const zernike &z, int n);
+
+private:
+  bool ok;
+  int N;
+  size_t records;
+  uint64_t stamp;
+  std::unique_ptr<mapped_input> file;
+  std::string own; /**< The codes when they are not read from the file. */
+  const char *codes;
+};
+
+#endif
@@ -0,0 +1,217 @@
+/** \file zm_store.cpp
+  Implementation of zm_store.hpp.
+  \author J. Houdayer
+*/
+
+#include "zm_store.hpp"
+#include "hash.hpp"
+#include <cctype>
+#include <cerrno>
+
+static const std::string bad_id_msg = "Invalid shape ID (it should not be empty nor contain spaces): ";
+static const std::string store_order_msg = "The order of the moments is lower than the order of store ";
+static const std::string store_write_msg = "Cannot write to store ";
+
+/** Version of the store format. */
+const uint32_t store_version = 1;
+
+/** Size of the header of a store, including the line "ZMS". */
+const size_t store_header_size = 32;
+
+/** The header of a store, see zm_store. */
+static std::string store_header(int n, zm_norm norm, zm_output output, size_t values)
+{
+  std::string head = "ZMS\n";
+  put_le<uint32_t>(head, store_version);
+  put_le<int32_t>(head, (int32_t) norm);
+  put_le<int32_t>(head, n);
+  put_le<int32_t>(head, (int32_t) output);
+  put_le<uint32_t>(head, 0);
+  put_le<uint64_t>(head, values);
+  return head;
+}
+
+/** Reads the header of a store.
+  @param head The first store_header_size bytes of the store.
+  @return True if the header is valid.
+*/
+static bool read_store_header(const char *head, int &n, zm_norm &norm, zm_output &output, size_t &values)
+{
+  if (std::string(head, 4) != "ZMS\n" || get_le<uint32_t>(head + 4) != store_version)
+    return false;
+  const int32_t nm = get_le<int32_t>(head + 8);
+  const int32_t out = get_le<int32_t>(head + 16);
+  const uint64_t count = get_le<uint64_t>(head + 24);
+  n = get_le<int32_t>(head + 12);
+  if (nm < 0 || nm > (int) zm_norm::dual_n || out < 0 || out > (int) zm_output::complex_p || n < 0
+      || (double) count != 2. * (n / 2 + 1) * (n / 2 + 2) * (2 * (n / 2) + 3) / 3)
+    return false;
+  norm = (zm_norm) nm;
+  output = (zm_output) out;
+  values = count;
+  return true;
+}
+
+/** Opens a store for reading.
+  The store is mapped in memory and its index is read.
+  @param name The name of the store.
+*/
+zm_store::zm_store(const std::string &name):
+ok(false), N(0), norm(zm_norm::raw), output(zm_output::real), values(0), records(0),
+file(new mapped_input(name))
+{
+  if (!*file || file->size() < store_header_size
+      || !read_store_header(file->content(), N, norm, output, values))
+    return;
+  const size_t stride = values * sizeof(double);
+  records = (file->size() - store_header_size) / stride;
+  ids.resize(records);
+  std::ifstream idx(name + ".idx");
+  std::string id;
+  uint64_t pos;
+  while (idx >> id >> pos) {
+    if (pos < store_header_size || (pos - store_header_size) % stride != 0)
+      return;
+    const size_t i = (pos - store_header_size) / stride;
+    if (i >= records) // the record was lost, for instance by a crash before it reached the disk
+      continue;
+    ids[i] = id;
+    by_id[id] = i;
+  }
+  ok = !idx.is_open() || idx.eof();
+}
+
+/** The last record of a shape.
+  @param id The ID of the shape.
+  @return The index of the record, or size() if the ID is unknown.
+*/
+size_t zm_store::find(const std::string &id) const
+{
+  auto it = by_id.find(id);
+  return (it == by_id.end()) ? records : it->second;
+}
+
+/** Reads a record.
+  Reading into the same zernike does not allocate memory.
+  @param i The index of the record, less than size().
+  @param z Receives the moments.
+*/
+void zm_store::read(size_t i, zernike &z) const
+{
+  if (z.N != N || z.zm.size() != values)
+    z = zernike(N);
+  z.norm = norm;
+  z.output = output;
+  z.odd_clean = true;
+  z.variance = 0;
+  const char *p = file->content() + store_header_size + i * values * sizeof(double);
+  if (little_endian())
+    memcpy(z.zm.data(), p, values * sizeof(double));
+  else
+    for (size_t k = 0 ; k < values ; k++)
+      z.zm[k] = get_le<double>(p + k * sizeof(double));
+}
+
+/** A hash identifying the content of the store, to detect files derived from an older store.
+  It covers the number of records, the index and a sample of at most 65 records,
+  evenly spaced and including the last one, so that it is cheap to compute.
+*/
+uint64_t zm_store::stamp() const
+{
+  fnv_hash h;
+  h << (uint64_t) records;
+  for (auto &id: ids)
+    h << id;
+  if (records == 0)
+    return h.h;
+  const size_t step = std::max<size_t>(records / 64, 1);
+  zernike z;
+  for (size_t i = 0 ; i < records ; i += step) {
+    const size_t k = (i + step < records) ? i : records - 1;
+    read(k, z);
+    for (auto x: z.get_zm())
+      h << x;
+    if (k == records - 1)
+      break;
+  }
+  return h.h;
+}
+
+/** Appends moments to a store.
+  The store is created if needed, with the order, normalization and output mode of the moments.
+  Otherwise the moments are truncated to the order of the store and converted to its normalization.
+  @param name The name of the store.
+  @param id The ID of the shape, without spaces.
+  @param z The moments.
+  @return An error message, empty on success.
+*/
+std::string zm_store::append(const std::string &name, const std::string &id, const zernike &z)
+{
+  if (id.empty() || std::any_of(id.begin(), id.end(), [](char c) { return isspace((unsigned char) c); }))
+    return bad_id_msg + "\"" + id + "\"";
+
+  int n = z.order();
+  zm_norm nm = z.get_norm();
+  zm_output out = z.output;
+  size_t vals = z.get_zm().size();
+  uint64_t pos = store_header_size;
+  std::fstream f;
+  if (std::ifstream(name)) {
+    f.open(name, std::ios::in | std::ios::out | std::ios::binary);
+    if (!f)
+      return cannot_open_msg + name + " (" + strerror(errno) + ")";
+    char head[store_header_size];
+    if (!f.read(head, store_header_size) || !read_store_header(head, n, nm, out, vals))
+      return invalid_file_msg + name;
+    if (z.order() < n)
+      return store_order_msg + name + " (" + std::to_string(n) + ")";
+    // a partial record left by an interrupted append is overwritten
+    f.seekg(0, std::ios::end);
+    const uint64_t stride = vals * sizeof(double);
+    pos += ((uint64_t) f.tellg() - store_header_size) / stride * stride;
+  }
+  else {
+    f.open(name, std::ios::out | std::ios::binary);
+    if (!f)
+      return cannot_open_msg + name + " (" + strerror(errno) + ")";
+    const std::string head = store_header(n, nm, out, vals);
+    f.write(head.data(), head.size());
+  }
+
+  zernike zs(n, z);
+  zs.normalize(nm);
+  f.seekp(pos);
+  if (little_endian())
+    f.write((const char *) zs.get_zm().data(), vals * sizeof(double));
+  else {
+    std::string buf;
+    for (auto x: zs.get_zm())
+      put_le(buf, x);
+    f.write(buf.data(), buf.size());
+  }
+  f.close();
+  if (f.fail())
+    return store_write_msg + name;
+
+  std::ofstream idx(name + ".idx", std::ios::app);
+  idx << id << " " << pos << "\n";
+  idx.close();
+  if (idx.fail())
+    return store_write_msg + name + ".idx";
+  return "";
+}
+
+/** The default ID of a shape: the name of its file, without directory nor extension.
+  @return The ID, empty for standard input.
+*/
+std::string shape_id(const std::string &filename)
+{
+  if (filename == "-")
+    return "";
+  const size_t slash = filename.rfind('/');
+  std::string id = (slash == std::string::npos) ? filename : filename.substr(slash + 1);
+  const size_t dot = id.rfind('.');
+  if (dot != std::string::npos && dot > 0)
+    id.erase(dot);
+  return id;
+}
@@ -0,0 +1,78 @@
+/** \file zm_store.hpp
+  A single file keeping the Zernike moments of many shapes.
+  \author J. Houdayer
+*/
+
+#ifndef ZM_STORE_HPP
+#define ZM_STORE_HPP
+
+#include <memory>
+#include <unordered_map>
+#include "zernike.hpp"
+
+/** A store of Zernike moments, all of the same order and normalization.
+
+  The store is a binary file: a line with "ZMS", a header as in the ZMB format
+  (version, norm, order, output mode and number of values of a record, see write_binary),
+  then the records, one by shape, holding the moments in the storage order of zernike.
+  All records have the same size, so that record i is found directly, and the file is
+  mapped in memory to read it.
+  A text file named after the store with ".idx" appended gives the index: on each line,
+  the ID of a shape and the position of its record in the store.
+
+  The store only grows. A record is written before its index line, so that an
+  interrupted append leaves at most a record without ID. When an ID is used several
+  times, zm_store::find gives the last record. Only one program should append at a time.
+
+  Usage:
+    1. add moments with zm_store::append, which creates the store if needed.
+    2. open the store with the constructor and check it with operator bool.
+    3. read records with zm_store::read, reusing the same zernike to avoid allocations,
+    or look for a shape with zm_store::find.
+*/
+class zm_store
+{
+public:
+  zm_store(const std::string &name);
+
+  /** To check whether the store could be read. */
+  explicit operator bool() const
+  { return ok; }
+
+  /** Number of records. */
+  size_t size() const
+  { return records; }
+
+  /** Order of the moments. */
+  int order() const
+  { return N; }
+
+  /** Normalization of the moments. */
+  zm_norm get_norm() const
+  { return norm; }
+
+  /** ID of record i, empty if the record is not indexed. */
+  const std::string &id(size_t i) const
+  { return ids[i]; }
+
+  size_t find(const std::string &id) const;
+  void read(size_t i, zernike &z) const;
+  uint64_t stamp() const;
+
+  static std::string append(const std::string &name, const std::string &id, const zernike &z);
+
+private:
+  bool ok;
+  int N;
+  zm_norm norm;
+  zm_output output;
+  size_t values;  /**< Number of values of a record. */
+  size_t records;
+  std::unique_ptr<mapped_input> file;
+  std::vector<std::string> ids;
+  std::unordered_map<std::string, size_t> by_id;
+};
+
+std::string shape_id(const std::string &filename);
+
+#endif